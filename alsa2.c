@@ -1,204 +1,348 @@
 #include <alsa/asoundlib.h>
 #include <stdint.h>
 #include <err.h>
+#include <limits.h>
 #include <stdio.h>
 #include <math.h>
 #include <poll.h> // For pollfd and POLLIN/POLLOUT
-
-#define ALSA_CHECK(x) if ( (errval = (x)) < 0 ) errx(1, #x ": %s", snd_strerror(errval))
-
-static void generate_data(float *buffer, size_t buffer_size, unsigned int rate) {
-    static float phase = 0.0f;
-    const float frequency = 440.0; // A4 note
-
-    for(size_t idx = 0; idx < buffer_size; ++idx) {
-        // Generate a sine wave sample
-        buffer[idx] = sin(phase * 2.0 * M_PI * frequency / rate);
-        phase += 1.0;
-        // Reset phase to prevent overflow for long running applications
-        if (phase >= rate) {
-            phase -= rate;
-        }
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/signalfd.h>
+#include <unistd.h> // For getopt
+
+#include "alsaplay_internal.h"
+#include "control.h"
+#include "effects.h"
+#include "file_source.h"
+#include "oscillator.h"
+#include "pcm_config.h"
+#include "resample.h"
+#include "trace.h"
+#include "wavetable.h"
+
+// Per-wakeup logging, off by default as stdio on the audio path causes jitter.
+static bool verbose = false;
+#define VERBOSE(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
+
+// How long a change from the control socket takes to ramp in.
+#define CONTROL_RAMP_MS 20
+// While the frequency is gliding, the tone is generated this many samples at a
+// time, each at the next step of the ramp.
+#define GLIDE_STEP 32
+
+// Where the mono samples come from: the tone, resampled to the device's rate
+// when it isn't the tone's, scaled by the level, then through the effects.
+struct producer {
+    struct oscillator tone;
+    // The rate the tone is generated at, and the one it's played at.
+    unsigned int tone_rate, rate;
+    bool resample;
+    struct resampler resampler;
+    struct effect_chain effects;
+    // With -C, where the frequency and level come from, checked before every
+    // block.
+    struct control *control;
+    struct ramp frequency;
+    struct ramp level;
+};
+
+static void fill_tone(void *arg, float *buffer, size_t frames) {
+    struct producer *producer = arg;
+    while (producer->frequency.remaining && frames) {
+        size_t step = frames < GLIDE_STEP ? frames : GLIDE_STEP;
+        oscillator_set_frequency(&producer->tone, ramp_advance(&producer->frequency, step), producer->tone_rate);
+        oscillator_fill(&producer->tone, buffer, step);
+        buffer += step;
+        frames -= step;
     }
+    oscillator_fill(&producer->tone, buffer, frames);
 }
 
-int main(int argc, char *argv[]) {
-    (void) argc;
-    (void) argv;
-
-    int errval;
-    const char* device_name = "default";
-    snd_pcm_t *pcm_handle;
-    unsigned int rate = 44100;
-
-    ALSA_CHECK(snd_pcm_open(&pcm_handle, device_name, SND_PCM_STREAM_PLAYBACK, SND_PCM_ASYNC));
-
-    uint8_t hw_params_raw_data[snd_pcm_hw_params_sizeof()];
-    snd_pcm_hw_params_t *hwparams = (snd_pcm_hw_params_t *)hw_params_raw_data;
-
-    ALSA_CHECK(snd_pcm_hw_params_any(pcm_handle, hwparams));
-    ALSA_CHECK(snd_pcm_hw_params_set_access(pcm_handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED));
-    ALSA_CHECK(snd_pcm_hw_params_set_format(pcm_handle, hwparams, SND_PCM_FORMAT_FLOAT_LE));
-    ALSA_CHECK(snd_pcm_hw_params_set_rate_near(pcm_handle, hwparams, &rate, NULL));
-
-    printf("Actual Rate: %u\n", rate);
-    ALSA_CHECK(snd_pcm_hw_params_set_channels(pcm_handle, hwparams, 1)); /* Mono */
-
-    ALSA_CHECK(snd_pcm_hw_params(pcm_handle, hwparams));
-    size_t fd_count = snd_pcm_poll_descriptors_count(pcm_handle);
-    struct pollfd fds[fd_count];
-
-    ALSA_CHECK(snd_pcm_poll_descriptors(pcm_handle, fds, fd_count));
-
-    for(size_t i = 0; i < fd_count; ++i) {
-        printf("%zd: fd%d%s%s%s\n",
-                i,
-                fds[i].fd,
-                fds[i].events & POLLIN ? " POLLIN" : "",
-                fds[i].events & POLLOUT ? " POLLOUT" : "",
-                fds[i].events & POLLERR ? " POLLERR" : "");
+static void producer_fill(void *arg, float *buffer, size_t frames) {
+    struct producer *producer = arg;
+    const struct control_params *params;
+    if (producer->control && control_poll(producer->control, &params)) {
+        ramp_set(&producer->frequency, params->frequency, producer->tone_rate * CONTROL_RAMP_MS / 1000);
+        ramp_set(&producer->level, params->mute ? 0.0 : pow(10, params->gain_db / 20), producer->rate * CONTROL_RAMP_MS / 1000);
     }
 
-    snd_pcm_uframes_t buffer_size_frames;
-    snd_pcm_uframes_t period_size_frames;
-    ALSA_CHECK(snd_pcm_get_params(pcm_handle, &buffer_size_frames, &period_size_frames));
+    if (producer->resample)
+        resampler_fill(&producer->resampler, buffer, frames, fill_tone, producer);
+    else
+        fill_tone(producer, buffer, frames);
+    ramp_apply(&producer->level, buffer, frames);
+    effect_chain_process(&producer->effects, buffer, frames);
+}
 
-    printf("Buffer size (frames): %lu, Period size (frames): %lu\n", buffer_size_frames, period_size_frames);
+// A signalfd for SIGHUP, SIGTERM and SIGINT.
+static int watch_signals(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        err(1, "sigprocmask");
+
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
+        err(1, "signalfd");
+    return signal_fd;
+}
 
-    snd_output_t *output;
-    ALSA_CHECK(snd_output_stdio_attach(&output, stdout, 0));
-    ALSA_CHECK(snd_pcm_dump(pcm_handle, output));
+static double ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
 
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-m] [-n] [-l] [-T us] [-w waveform] [-W interp] [-Q quality] [-e effect]... [-C socket] [-s file] [-t file] [-v] [-i ms] [-D device] [-f format] [-c count] [-B us] [-F us] [-A frames] [-S frames] [-N]\n", progname);
+    fprintf(stderr, "  -m         Use mmap access, generating directly into the ring buffer\n");
+    fprintf(stderr, "  -n         Non-interleaved: one buffer per channel, written with snd_pcm_writen\n");
+    fprintf(stderr, "  -l         Low latency: only generate as many whole periods as ALSA can accept\n");
+    fprintf(stderr, "  -T us      Wake on a timer, when the buffer drains to us microseconds, instead of polling ALSA\n");
+    fprintf(stderr, "  -w wave    Waveform: sine, saw, square or triangle (band limited wavetables except sine)\n");
+    fprintf(stderr, "  -W interp  Wavetable interpolation: linear or cubic (default linear)\n");
+    fprintf(stderr, "  -Q quality Open the device at its native rate, resampling the tone to it: fast, medium or best\n");
+    fprintf(stderr, "  -e effect  Add an effect to the chain the tone goes through, see below\n");
+    fprintf(stderr, "  -C socket  Take freq hz, gain db and mute on|off datagrams on a Unix socket, ramping\n");
+    fprintf(stderr, "             them in.  Blocks are then a period long, so changes are heard within a buffer\n");
+    fprintf(stderr, "  -s file    Play a WAV or raw PCM file (in -f format with -c channels, default S16_LE stereo\n");
+    fprintf(stderr, "             at 44100 Hz), or stdin for -, instead of the tone\n");
+    fprintf(stderr, "  -t file    Trace each stage of every wakeup into a ring in file, for trace_dump\n");
+    fprintf(stderr, "  -v         Log every wakeup and write\n");
+    fprintf(stderr, "  -i ms      Print stats every ms milliseconds (they are also printed on SIGUSR1)\n");
+    fprintf(stderr, "On SIGHUP the device is closed and reopened, with the parameters negotiated the first time.\n");
+    fprintf(stderr, "On SIGTERM or SIGINT it's closed and the program exits.\n");
+    pcm_config_usage(stderr);
+    effect_chain_usage(stderr);
+    exit(1);
+}
 
-    const size_t local_data_buffer_size = 65536; // A reasonable buffer size for local data (can be anything)
-    float local_data_buffer[local_data_buffer_size];
-    ssize_t frames_to_write_from_local_buffer = 0; // How many frames are currently in our local buffer
-    float *local_data_ptr = NULL;
+int main(int argc, char *argv[]) {
+    struct alsaplay *play = alsaplay_new();
+    unsigned int flags = 0;
+    unsigned int watermark_us = 0;
+    unsigned int stats_interval_ms = 0;
+    int waveform = WAVEFORM_SINE;
+    int interp = WAVETABLE_LINEAR;
+    int quality = -1;
+    const char *file_path = NULL;
+    const char *control_path = NULL;
+    const char *trace_path = NULL;
+    const char *effect_specs[EFFECT_CHAIN_MAX];
+    size_t effect_count = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "mnlT:w:W:Q:e:C:s:t:vi:" PCM_CONFIG_OPTSTRING)) != -1) {
+        if (alsaplay_configure(play, opt, optarg))
+            continue;
+
+        switch (opt) {
+            case 'm':
+                flags |= ALSAPLAY_MMAP;
+                break;
+            case 'n':
+                flags |= ALSAPLAY_PLANAR;
+                break;
+            case 'l':
+                flags |= ALSAPLAY_LOW_LATENCY;
+                break;
+            case 'T':
+                watermark_us = pcm_config_parse_number(opt, optarg, UINT_MAX);
+                if (!watermark_us)
+                    usage(argv[0]);
+                break;
+            case 'w':
+                waveform = waveform_value(optarg);
+                if (waveform < 0)
+                    usage(argv[0]);
+                break;
+            case 'W':
+                interp = wavetable_interp_value(optarg);
+                if (interp < 0)
+                    usage(argv[0]);
+                break;
+            case 'Q':
+                quality = resample_quality_value(optarg);
+                if (quality < 0)
+                    usage(argv[0]);
+                flags |= ALSAPLAY_NATIVE_RATE;
+                break;
+            case 'e':
+                if (effect_count == EFFECT_CHAIN_MAX)
+                    errx(1, "-e: at most %d effects are supported", EFFECT_CHAIN_MAX);
+                effect_specs[effect_count++] = optarg;
+                break;
+            case 'C':
+                control_path = optarg;
+                break;
+            case 's':
+                file_path = optarg;
+                break;
+            case 't':
+                trace_path = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'i':
+                stats_interval_ms = pcm_config_parse_number(opt, optarg, UINT_MAX);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
 
+    // The file's frames are written from where they are, so the device has to
+    // take them as they are.
+    if (file_path && (flags || effect_count || control_path))
+        errx(1, "-s can't be used with -m, -n, -l, -Q, -e or -C");
+
+    if (trace_path)
+        trace_open(trace_path);
+
+    struct wavetable table;
+    if (waveform != WAVEFORM_SINE)
+        wavetable_init(&table, waveform);
+
+    // The rate the tone is generated at, and asked of the device.
+    const unsigned int tone_rate = 44100;
+    unsigned int requested_rate = tone_rate;
+    struct pcm_config *config = alsaplay_config(play);
+    struct file_source file;
+    if (file_path) {
+        file_source_open(&file, file_path, config->format ? config->format : SND_PCM_FORMAT_S16_LE, config->channels ? config->channels : 2, tone_rate);
+        config->format = file.format;
+        config->channels = file.channels;
+        requested_rate = file.rate;
+    }
+    alsaplay_open(play, requested_rate, flags);
+    const unsigned int rate = alsaplay_rate(play);
+    if (file_path && rate != file.rate)
+        errx(1, "%s can't play %s at %u Hz", pcm_config_device(config), file_path, file.rate);
+
+    struct producer producer = {
+        .tone_rate = quality >= 0 && rate != tone_rate ? tone_rate : rate,
+        .rate = rate,
+        .resample = quality >= 0 && rate != tone_rate,
+    };
+    const struct control_params initial_params = { .frequency = 440.0 }; // A4 note
+    oscillator_init(&producer.tone, initial_params.frequency, producer.tone_rate, waveform != WAVEFORM_SINE ? &table : NULL, interp);
+    ramp_init(&producer.frequency, initial_params.frequency);
+    ramp_init(&producer.level, 1.0);
+    if (producer.resample) {
+        resampler_init(&producer.resampler, tone_rate, rate, quality);
+        printf("Resampling from %u Hz to %u Hz\n", tone_rate, rate);
+    }
+    for (size_t i = 0; i < effect_count; ++i)
+        effect_chain_add(&producer.effects, effect_specs[i], rate, alsaplay_format(play));
+    struct control control;
+    if (control_path) {
+        control_open(&control, control_path, &initial_params, producer.tone_rate / 2.0);
+        producer.control = &control;
+        // A whole block ahead would hold back changes by over a second.
+        alsaplay_set_block(play, alsaplay_period_size(play));
+    }
 
-    for(;;) {
-        // If our local buffer is empty or completely written, generate more data
-        if (frames_to_write_from_local_buffer == 0) {
-            generate_data(local_data_buffer, local_data_buffer_size, rate);
-            local_data_ptr = local_data_buffer;
-            frames_to_write_from_local_buffer = local_data_buffer_size;
-            printf("Generated new data block (%zu frames)\n", local_data_buffer_size);
+    alsaplay_watch_stats(play, stats_interval_ms);
+    int signal_fd = watch_signals();
+    alsaplay_watch_fd(play, signal_fd);
+    // Set by SIGTERM or SIGINT, to leave the loop and clean up.
+    bool stopped = false;
+    // Set while reopening, until the first write to the new handle.
+    bool reopened = false;
+    struct timespec reopen_started;
+
+    printf("Buffer size (frames): %zu, Period size (frames): %zu\n", alsaplay_buffer_size(play), alsaplay_period_size(play));
+
+    if (watermark_us) {
+        // The PCM's poll descriptors aren't waited on at all then, so plugins
+        // that signal them far more often than we need (eg dmix) can't wake us.
+        alsaplay_wake_on_timer(play, watermark_us);
+        printf("Timer mode, waking at %llu frames left\n", (unsigned long long)watermark_us * rate / 1000000);
+    } else {
+        snd_pcm_t *pcm_handle = alsaplay_pcm(play);
+        struct pollfd fds[8];
+        int fd_count = snd_pcm_poll_descriptors(pcm_handle, fds, 8);
+        for (int i = 0; i < fd_count; ++i) {
+            printf("%d: fd%d%s%s%s\n",
+                    i,
+                    fds[i].fd,
+                    fds[i].events & POLLIN ? " POLLIN" : "",
+                    fds[i].events & POLLOUT ? " POLLOUT" : "",
+                    fds[i].events & POLLERR ? " POLLERR" : "");
         }
+    }
 
-        fd_set rfd;
-        fd_set wfd;
-        fd_set xfd;
-        FD_ZERO(&rfd);
-        FD_ZERO(&wfd);
-        FD_ZERO(&xfd);
-        int max_fd = -1;
-        for(size_t i = 0; i < fd_count; ++i) {
-            if (fds[i].events & POLLIN) FD_SET(fds[i].fd, &rfd);
-            if (fds[i].events & POLLOUT) FD_SET(fds[i].fd, &wfd);
-            if (fds[i].events & POLLERR) FD_SET(fds[i].fd, &xfd);
-            if (fds[i].events && fds[i].fd > max_fd)
-                max_fd = fds[i].fd;
+    // The file is written straight from its mapping or read ahead buffer,
+    // consuming however much there was room for.
+    const void *frames = NULL;
+    size_t frames_left = 0;
+    while (!stopped) {
+        long written;
+        if (file_path) {
+            if (frames_left == 0) {
+                frames_left = file_source_peek(&file, &frames, ALSAPLAY_BLOCK_MAX);
+                if (frames_left == 0)
+                    break;
+            }
+            written = alsaplay_pump_frames(play, frames, frames_left, -1);
+        } else {
+            written = alsaplay_pump(play, producer_fill, &producer, -1);
         }
 
-        int ret = select(max_fd + 1, &rfd, &wfd, &xfd, NULL);
-        if (ret == -1) {
-            // Check for EINTR, which can happen if a signal is caught
-            if (errno == EINTR) {
-                continue; // Retry select
+        if (written == ALSAPLAY_FD_READY) {
+            struct signalfd_siginfo info;
+            bool hangup = false;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGHUP)
+                    hangup = true;
+                else
+                    stopped = true;
             }
-            err(1, "select");
+            if (stopped || !hangup)
+                continue;
+
+            clock_gettime(CLOCK_MONOTONIC, &reopen_started);
+            reopened = true;
+            alsaplay_reopen(play);
+            frames_left = 0;
+            printf("Reopened in %.2f ms\n", ms_since(&reopen_started));
+            continue;
         }
+        if (written == 0)
+            continue;
 
-        for(size_t i = 0; i < fd_count; ++i) {
-            fds[i].revents =
-                (FD_ISSET(fds[i].fd, &rfd) ? POLLIN : 0) |
-                (FD_ISSET(fds[i].fd, &wfd) ? POLLOUT : 0) |
-                (FD_ISSET(fds[i].fd, &xfd) ? POLLERR : 0);
+        VERBOSE("%ld\n", written);
+        if (reopened) {
+            printf("First sample %.2f ms after reopening\n", ms_since(&reopen_started));
+            reopened = false;
         }
-
-        unsigned short revents = 0;
-        ALSA_CHECK(snd_pcm_poll_descriptors_revents(
-                    pcm_handle,
-                    fds,
-                    fd_count,
-                    &revents));
-
-        printf("Poll events: %s%s%s\n",
-                   revents & POLLIN ? " POLLIN" : "",
-                   revents & POLLOUT ? " POLLOUT" : "",
-                   revents & POLLERR ? " POLLERR" : "");
-
-        if (revents & POLLOUT) {
-            snd_pcm_sframes_t frames_available;
-            snd_pcm_state_t state = snd_pcm_state(pcm_handle);
-
-            if (state == SND_PCM_STATE_XRUN) {
-                // Handle underrun/overrun
-                ret = snd_pcm_prepare(pcm_handle);
-                if (ret < 0) errx(1, "snd_pcm_prepare after XRUN: %s", snd_strerror(ret));
-                printf("ALSA underrun, attempting to recover.\n");
-                continue; // Try again after preparing
-            } else if (state == SND_PCM_STATE_SUSPENDED) {
-                ret = snd_pcm_resume(pcm_handle);
-                if (ret < 0 || ret == 0) { // 0 means it's not possible to resume
-                    ret = snd_pcm_prepare(pcm_handle);
-                    if (ret < 0) errx(1, "snd_pcm_prepare after SUSPENDED: %s", snd_strerror(ret));
-                }
-                printf("ALSA suspended, attempting to resume/prepare.\n");
-                continue; // Try again
-            }
-
-            // Get the number of frames that can be written without blocking
-            frames_available = snd_pcm_avail_update(pcm_handle);
-            if (frames_available < 0) {
-                if (frames_available == -EPIPE) { // XRUN (underrun/overrun)
-                    ret = snd_pcm_prepare(pcm_handle);
-                    if (ret < 0) errx(1, "snd_pcm_prepare after avail_update XRUN: %s", snd_strerror(ret));
-                    printf("ALSA underrun detected by avail_update, attempting to recover.\n");
-                    continue;
-                } else {
-                    errx(1, "snd_pcm_avail_update: %s", snd_strerror(frames_available));
-                }
-            }
-
-            // Determine how many frames to write
-            snd_pcm_sframes_t frames_to_write_this_iter = frames_available;
-            if (frames_to_write_this_iter > frames_to_write_from_local_buffer) {
-                frames_to_write_this_iter = frames_to_write_from_local_buffer;
-            }
-
-            if (frames_to_write_this_iter > 0) {
-                ret = snd_pcm_writei(pcm_handle, local_data_ptr, frames_to_write_this_iter);
-                printf("writei %i\n", ret);
-                if (ret < 0) {
-                    if (ret == -EPIPE) { // XRUN (underrun/overrun)
-                        ret = snd_pcm_prepare(pcm_handle);
-                        if (ret < 0) errx(1, "snd_pcm_prepare after writei XRUN: %s", snd_strerror(ret));
-                        printf("ALSA underrun detected by writei, attempting to recover.\n");
-                        continue;
-                    } else if (ret == -ESTRPIPE) { // Suspended
-                        ret = snd_pcm_resume(pcm_handle);
-                        if (ret < 0 || ret == 0) {
-                            ret = snd_pcm_prepare(pcm_handle);
-                            if (ret < 0) errx(1, "snd_pcm_prepare after writei SUSPENDED: %s", snd_strerror(ret));
-                        }
-                        printf("ALSA suspended detected by writei, attempting to resume/prepare.\n");
-                        continue;
-                    } else {
-                        errx(1, "snd_pcm_writei: %s", snd_strerror(ret));
-                    }
-                }
-                // printf("Wrote %d frames\n", ret);
-
-                local_data_ptr += ret;
-                frames_to_write_from_local_buffer -= ret;
-            }
+        if (file_path) {
+            file_source_consume(&file, written);
+            frames = (const uint8_t *)frames + snd_pcm_frames_to_bytes(alsaplay_pcm(play), written);
+            frames_left -= written;
         }
     }
 
-    // Cleanup (though this loop runs indefinitely)
-    snd_output_close(output);
-    snd_pcm_close(pcm_handle);
+    // Reached at the end of a file, which is left to finish playing, or on
+    // being stopped, which drops whatever's queued.
+    if (file_path) {
+        if (!stopped)
+            alsaplay_drain(play);
+        file_source_close(&file);
+    }
+
+    if (control_path)
+        control_close(&control);
+    trace_close();
+    if (producer.resample)
+        resampler_free(&producer.resampler);
+    if (producer.tone.table)
+        wavetable_free(&table);
+    alsaplay_close(play);
 
     return 0;
 }
@@ -0,0 +1,526 @@
+#include "alsaplay.h"
+#include "alsaplay_internal.h"
+#include "convert.h"
+#include "event_loop.h"
+#include "pcm_config.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define ALSA_CHECK(x) if ( (errval = (x)) < 0 ) errx(1, #x ": %s", snd_strerror(errval))
+
+struct alsaplay {
+    struct pcm_config config;
+    // alsaplay_set_config's copy of the device name.
+    char *device;
+    // Reopening with the same configuration installs what was negotiated
+    // the first time, rather than negotiating again.
+    struct pcm_cache cache;
+    snd_pcm_t *pcm_handle;
+    unsigned int flags;
+    snd_pcm_access_t access;
+    unsigned int requested_rate;
+    unsigned int rate;
+    unsigned int channels;
+    snd_pcm_format_t format;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+
+    // Converting our mono float samples to the negotiated format.
+    // Interleaved, there's one plane holding whole frames.  Non-interleaved,
+    // there's one per channel, each converted into separately.
+    sample_convert_fn convert;
+    size_t frame_bytes;
+    size_t planes;
+    // Bytes from one frame to the next within a plane.
+    size_t plane_step;
+
+    // Without mmap, a block converted but not all written yet, in planes of
+    // block_capacity frames.
+    uint8_t *block;
+    snd_pcm_uframes_t block_capacity;
+    snd_pcm_uframes_t block_frames;
+    snd_pcm_uframes_t block_offset;
+    snd_pcm_uframes_t block_pending;
+
+    struct event_loop loop;
+    // Waited on for room, unless waking on a timer.
+    struct event_source *pcm_source;
+    struct event_source *timer_source;
+    snd_pcm_sframes_t watermark;
+    bool rearm_timer;
+    struct event_source *fd_source;
+    struct playback_stats stats;
+};
+
+struct alsaplay *alsaplay_new(void) {
+    struct alsaplay *play = calloc(1, sizeof(*play));
+    if (!play)
+        err(1, "calloc");
+    return play;
+}
+
+void alsaplay_set_config(struct alsaplay *play, const struct alsaplay_config *config) {
+    free(play->device);
+    play->device = NULL;
+    if (config->device) {
+        play->device = strdup(config->device);
+        if (!play->device)
+            err(1, "strdup");
+    }
+
+    snd_pcm_format_t format = 0;
+    if (config->format) {
+        format = snd_pcm_format_value(config->format);
+        if (!sample_converter(format, 1))
+            errx(1, "Unsupported format '%s'", config->format);
+    }
+    if (config->channels && !sample_converter(SND_PCM_FORMAT_FLOAT_LE, config->channels))
+        errx(1, "Between 1 and %d channels are supported", CONVERT_MAX_CHANNELS);
+
+    play->config = (struct pcm_config){
+        .device = play->device,
+        .format = format,
+        .channels = config->channels,
+        .buffer_time_us = config->buffer_time_us,
+        .period_time_us = config->period_time_us,
+        .avail_min = config->avail_min,
+        .start_threshold = config->start_threshold,
+        .no_dump = config->no_dump,
+    };
+}
+
+bool alsaplay_configure(struct alsaplay *play, int opt, const char *value) {
+    return pcm_config_parse_option(&play->config, opt, value);
+}
+
+struct pcm_config *alsaplay_config(struct alsaplay *play) {
+    return &play->config;
+}
+
+// Open the PCM, and look up the converter for the format and channels that
+// were negotiated.
+static void open_pcm(struct alsaplay *play) {
+    int errval;
+    play->rate = play->requested_rate;
+    play->pcm_handle = pcm_config_open(&play->cache, &play->config, SND_PCM_STREAM_PLAYBACK, SND_PCM_ASYNC, play->access, &play->rate);
+
+    uint8_t hw_params_raw_data[snd_pcm_hw_params_sizeof()];
+    snd_pcm_hw_params_t *hwparams = (snd_pcm_hw_params_t *)hw_params_raw_data;
+    ALSA_CHECK(snd_pcm_hw_params_current(play->pcm_handle, hwparams));
+    ALSA_CHECK(snd_pcm_hw_params_get_format(hwparams, &play->format));
+    ALSA_CHECK(snd_pcm_hw_params_get_channels(hwparams, &play->channels));
+    ALSA_CHECK(snd_pcm_get_params(play->pcm_handle, &play->buffer_size, &play->period_size));
+
+    bool planar = play->flags & ALSAPLAY_PLANAR;
+    play->convert = sample_converter(play->format, planar ? 1 : play->channels);
+    if (!play->convert)
+        errx(1, "No converter for %s with %u channels", snd_pcm_format_name(play->format), play->channels);
+    play->frame_bytes = snd_pcm_frames_to_bytes(play->pcm_handle, 1);
+    play->planes = planar ? play->channels : 1;
+    play->plane_step = play->frame_bytes / play->planes;
+}
+
+void alsaplay_open(struct alsaplay *play, unsigned int rate, unsigned int flags) {
+    bool planar = flags & ALSAPLAY_PLANAR;
+    play->flags = flags;
+    play->access = flags & ALSAPLAY_MMAP
+        ? (planar ? SND_PCM_ACCESS_MMAP_NONINTERLEAVED : SND_PCM_ACCESS_MMAP_INTERLEAVED)
+        : (planar ? SND_PCM_ACCESS_RW_NONINTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED);
+    play->requested_rate = rate;
+    if (flags & ALSAPLAY_NATIVE_RATE)
+        play->config.native_rate = true;
+    open_pcm(play);
+
+    if (!(flags & ALSAPLAY_MMAP)) {
+        play->block_capacity = flags & ALSAPLAY_LOW_LATENCY ? play->period_size : ALSAPLAY_BLOCK_MAX;
+        play->block_frames = play->block_capacity;
+        play->block = malloc(play->block_capacity * play->frame_bytes);
+        if (!play->block)
+            err(1, "malloc");
+    }
+
+    event_loop_init(&play->loop);
+    play->pcm_source = event_loop_add_pcm(&play->loop, play->pcm_handle, NULL);
+    stats_init(&play->stats, play->rate);
+}
+
+unsigned int alsaplay_rate(const struct alsaplay *play) {
+    return play->rate;
+}
+
+unsigned int alsaplay_channels(const struct alsaplay *play) {
+    return play->channels;
+}
+
+size_t alsaplay_period_size(const struct alsaplay *play) {
+    return play->period_size;
+}
+
+size_t alsaplay_buffer_size(const struct alsaplay *play) {
+    return play->buffer_size;
+}
+
+snd_pcm_format_t alsaplay_format(const struct alsaplay *play) {
+    return play->format;
+}
+
+snd_pcm_t *alsaplay_pcm(const struct alsaplay *play) {
+    return play->pcm_handle;
+}
+
+void alsaplay_set_block(struct alsaplay *play, size_t frames) {
+    if (play->flags & (ALSAPLAY_MMAP | ALSAPLAY_LOW_LATENCY))
+        return;
+    play->block_frames = frames < ALSAPLAY_BLOCK_MAX ? frames : ALSAPLAY_BLOCK_MAX;
+}
+
+void alsaplay_wake_on_timer(struct alsaplay *play, unsigned int watermark_us) {
+    play->watermark = (unsigned long long)watermark_us * play->rate / 1000000;
+    // Each wakeup refills the buffer, so it must be able to take at least a
+    // period above the watermark, or we'd never sleep.
+    if ((snd_pcm_uframes_t)play->watermark + play->period_size > play->buffer_size)
+        errx(1, "A %u us watermark leaves less than a period of the %lu frame buffer to refill", watermark_us, play->buffer_size);
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+        err(1, "timerfd_create");
+    play->timer_source = event_loop_add_fd(&play->loop, timer_fd, POLLIN, NULL);
+    event_loop_remove(&play->loop, play->pcm_source);
+    play->pcm_source = NULL;
+    play->rearm_timer = true;
+}
+
+void alsaplay_watch_fd(struct alsaplay *play, int fd) {
+    play->fd_source = event_loop_add_fd(&play->loop, fd, POLLIN, NULL);
+}
+
+void alsaplay_trace(const char *path) {
+    trace_open(path);
+}
+
+void alsaplay_watch_stats(struct alsaplay *play, unsigned int interval_ms) {
+    stats_watch(&play->stats, &play->loop, interval_ms);
+}
+
+// Recover from err, as returned by what, by preparing after an xrun (-EPIPE)
+// or resuming (or, if the device can't, preparing) after a suspend
+// (-ESTRPIPE).  Exits on any other error.
+static void recover(struct alsaplay *play, int err, const char *what) {
+    int ret;
+    trace_instant(TRACE_XRUN);
+    if (err == -EPIPE) {
+        ret = snd_pcm_prepare(play->pcm_handle);
+        if (ret < 0)
+            errx(1, "snd_pcm_prepare after %s underrun: %s", what, snd_strerror(ret));
+        stats_add(&play->stats.xruns, 1);
+        printf("ALSA underrun detected by %s, attempting to recover.\n", what);
+    } else if (err == -ESTRPIPE) {
+        // If it can't resume (or isn't ready to yet), start afresh.
+        ret = snd_pcm_resume(play->pcm_handle);
+        if (ret < 0) {
+            ret = snd_pcm_prepare(play->pcm_handle);
+            if (ret < 0)
+                errx(1, "snd_pcm_prepare after %s suspend: %s", what, snd_strerror(ret));
+        }
+        printf("ALSA suspend detected by %s, attempting to resume/prepare.\n", what);
+    } else {
+        errx(1, "%s: %s", what, snd_strerror(err));
+    }
+}
+
+// Arm the timer to fire when the buffer will have drained down to the
+// watermark, going by snd_pcm_delay.  If the stream isn't running (eg it's
+// just been prepared after an xrun) fire straight away for the write path to
+// sort out.
+static void arm_timer(struct alsaplay *play) {
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_state(play->pcm_handle) != SND_PCM_STATE_RUNNING || snd_pcm_delay(play->pcm_handle, &delay) < 0)
+        delay = 0;
+
+    long long ns = delay > play->watermark ? (long long)(delay - play->watermark) * 1000000000LL / play->rate : 0;
+    // An it_value of zero would disarm the timer instead.
+    if (ns == 0)
+        ns = 1;
+
+    struct itimerspec when = {
+        .it_value = { ns / 1000000000LL, ns % 1000000000LL },
+    };
+    if (timerfd_settime(play->timer_source->fds[0].fd, 0, &when, NULL) == -1)
+        err(1, "timerfd_settime");
+}
+
+// Generate frames and convert them into each of the planes, starting offset
+// frames in.
+static void generate(struct alsaplay *play, void *const *planes, size_t offset, size_t frames, alsaplay_fill_fn fill, void *user_data) {
+    // Small enough to stay in L1 between generating and converting.
+    float samples[1024];
+
+    uint64_t start = trace_begin();
+    for (size_t done = 0; done < frames; ) {
+        size_t chunk = frames - done < 1024 ? frames - done : 1024;
+        fill(user_data, samples, chunk);
+        for (size_t p = 0; p < play->planes; ++p)
+            play->convert((uint8_t *)planes[p] + (offset + done) * play->plane_step, samples, chunk);
+        done += chunk;
+    }
+    trace_end(TRACE_GENERATE, start, frames);
+}
+
+// Generate straight into the mmap area, avoiding the copy through a buffer of
+// our own that writei does.
+static snd_pcm_sframes_t write_mmap(struct alsaplay *play, snd_pcm_uframes_t frames_available, alsaplay_fill_fn fill, void *user_data) {
+    snd_pcm_uframes_t frames_written = 0;
+
+    while (frames_written < frames_available) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = frames_available - frames_written;
+
+        int ret = snd_pcm_mmap_begin(play->pcm_handle, &areas, &offset, &frames);
+        if (ret < 0)
+            return ret;
+        if (frames == 0)
+            break;
+
+        // Interleaved, the first channel's area gives the start of each frame.
+        // Non-interleaved, each channel's area is its plane.
+        void *planes[CONVERT_MAX_CHANNELS];
+        for (size_t p = 0; p < play->planes; ++p)
+            planes[p] = (uint8_t *)areas[p].addr + (areas[p].first + offset * areas[p].step) / 8;
+        generate(play, planes, 0, frames, fill, user_data);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(play->pcm_handle, offset, frames);
+        if (committed < 0)
+            return committed;
+        if ((snd_pcm_uframes_t)committed != frames)
+            return -EPIPE;
+        frames_written += committed;
+    }
+
+    // Committing doesn't start the stream as writei does.
+    if (snd_pcm_state(play->pcm_handle) == SND_PCM_STATE_PREPARED) {
+        int ret = snd_pcm_start(play->pcm_handle);
+        if (ret < 0)
+            return ret;
+    }
+    return frames_written;
+}
+
+static void generate_block(struct alsaplay *play, alsaplay_fill_fn fill, void *user_data) {
+    void *planes[CONVERT_MAX_CHANNELS];
+    for (size_t p = 0; p < play->planes; ++p)
+        planes[p] = play->block + p * play->block_capacity * play->plane_step;
+    generate(play, planes, 0, play->block_frames, fill, user_data);
+    play->block_offset = 0;
+    play->block_pending = play->block_frames;
+}
+
+// Write frames from the start of each of planes, with writen if there's more
+// than one.
+static snd_pcm_sframes_t write_planes(struct alsaplay *play, void *const *planes, snd_pcm_uframes_t frames) {
+    if (play->planes > 1)
+        return snd_pcm_writen(play->pcm_handle, (void **)planes, frames);
+    return snd_pcm_writei(play->pcm_handle, planes[0], frames);
+}
+
+// Generate a block at a time and write it, keeping whatever of it wasn't
+// written for next time.
+static snd_pcm_sframes_t write_rw(struct alsaplay *play, snd_pcm_uframes_t frames_available, alsaplay_fill_fn fill, void *user_data) {
+    snd_pcm_uframes_t frames_written = 0;
+
+    while (frames_written < frames_available) {
+        if (play->block_pending == 0)
+            generate_block(play, fill, user_data);
+
+        snd_pcm_uframes_t frames = frames_available - frames_written;
+        if (frames > play->block_pending)
+            frames = play->block_pending;
+        void *planes[CONVERT_MAX_CHANNELS];
+        for (size_t p = 0; p < play->planes; ++p)
+            planes[p] = play->block + (p * play->block_capacity + play->block_offset) * play->plane_step;
+        snd_pcm_sframes_t ret = write_planes(play, planes, frames);
+        // An error after some has been written comes back from the next write.
+        if (ret < 0)
+            return frames_written ? (snd_pcm_sframes_t)frames_written : ret;
+
+        play->block_offset += ret;
+        play->block_pending -= ret;
+        frames_written += ret;
+        if ((snd_pcm_uframes_t)ret < frames)
+            break;
+    }
+
+    // Generating ahead, have the next block ready before going back to sleep,
+    // rather than generating it once there's room for it.
+    if (!(play->flags & ALSAPLAY_LOW_LATENCY) && play->block_pending == 0)
+        generate_block(play, fill, user_data);
+    return frames_written;
+}
+
+// Wait up to timeout_ms for room, returning how much there is, 0 if there
+// isn't any (after recovering if need be), or ALSAPLAY_FD_READY.
+static snd_pcm_sframes_t wait_for_room(struct alsaplay *play, int timeout_ms, struct timespec *woken) {
+    // Every path back here after a timer wakeup needs the timer rearming.
+    if (play->rearm_timer) {
+        arm_timer(play);
+        play->rearm_timer = false;
+    }
+
+    struct event_source *ready[5];
+    size_t ready_count = event_loop_wait(&play->loop, ready, 5, timeout_ms);
+
+    unsigned short revents = 0;
+    bool fd_ready = false;
+    for (size_t i = 0; i < ready_count; ++i) {
+        if (ready[i] == play->pcm_source) {
+            revents = play->pcm_source->revents;
+        } else if (ready[i] == play->timer_source) {
+            uint64_t expirations;
+            if (read(play->timer_source->fds[0].fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+                err(1, "read timerfd");
+            // Treat it as ALSA saying there's room, avail_update says how much.
+            revents = POLLOUT;
+            play->rearm_timer = true;
+        } else if (ready[i] == play->fd_source) {
+            fd_ready = true;
+        } else {
+            stats_handle_event(&play->stats, ready[i]);
+        }
+    }
+    if (fd_ready)
+        return ALSAPLAY_FD_READY;
+    if (!(revents & (POLLOUT | POLLERR)))
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, woken);
+    stats_add(&play->stats.wakeups, 1);
+    trace_instant(TRACE_WAKEUP);
+
+    // In the XRUN or SUSPENDED state (which is what POLLERR means) this fails
+    // with -EPIPE or -ESTRPIPE.
+    uint64_t start = trace_begin();
+    snd_pcm_sframes_t frames_available = snd_pcm_avail_update(play->pcm_handle);
+    if (frames_available < 0) {
+        recover(play, frames_available, "snd_pcm_avail_update");
+        return 0;
+    }
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(play->pcm_handle, &delay) == 0)
+        stats_record_delay(&play->stats, delay);
+    trace_end(TRACE_AVAIL, start, frames_available);
+    return frames_available;
+}
+
+// Count written, out of the frames_available there was room for, or recover
+// if it's an error from what.
+static long wrote(struct alsaplay *play, snd_pcm_sframes_t written, snd_pcm_sframes_t frames_available, const struct timespec *woken, const char *what) {
+    if (written < 0) {
+        recover(play, written, what);
+        return 0;
+    }
+
+    stats_record_latency(&play->stats, woken);
+    stats_add(&play->stats.frames_written, written);
+    if (written < frames_available)
+        stats_add(&play->stats.short_writes, 1);
+    return written;
+}
+
+long alsaplay_pump(struct alsaplay *play, alsaplay_fill_fn fill, void *user_data, int timeout_ms) {
+    struct timespec woken;
+    snd_pcm_sframes_t frames_available = wait_for_room(play, timeout_ms, &woken);
+    if (frames_available <= 0)
+        return frames_available;
+
+    // Only whole periods, so what's been generated but not played yet is
+    // bounded by the ALSA buffer.
+    if (play->flags & ALSAPLAY_LOW_LATENCY) {
+        frames_available -= frames_available % play->period_size;
+        if (frames_available == 0)
+            return 0;
+    }
+
+    bool use_mmap = play->flags & ALSAPLAY_MMAP;
+    uint64_t start = trace_begin();
+    snd_pcm_sframes_t written = use_mmap
+            ? write_mmap(play, frames_available, fill, user_data)
+            : write_rw(play, frames_available, fill, user_data);
+    trace_end(TRACE_WRITE, start, written > 0 ? written : 0);
+    return wrote(play, written, frames_available, &woken,
+            use_mmap ? "mmap commit" : play->planes > 1 ? "snd_pcm_writen" : "snd_pcm_writei");
+}
+
+long alsaplay_pump_frames(struct alsaplay *play, const void *frames, size_t count, int timeout_ms) {
+    struct timespec woken;
+    snd_pcm_sframes_t frames_available = wait_for_room(play, timeout_ms, &woken);
+    if (frames_available <= 0)
+        return frames_available;
+
+    if ((size_t)frames_available > count)
+        frames_available = count;
+    uint64_t start = trace_begin();
+    snd_pcm_sframes_t written = snd_pcm_writei(play->pcm_handle, frames, frames_available);
+    trace_end(TRACE_WRITE, start, written > 0 ? written : 0);
+    return wrote(play, written, frames_available, &woken, "snd_pcm_writei");
+}
+
+void alsaplay_reopen(struct alsaplay *play) {
+    unsigned int rate = play->rate;
+    sample_convert_fn convert = play->convert;
+
+    // Waking on a timer, the PCM isn't in the loop.
+    if (!play->timer_source) {
+        event_loop_remove(&play->loop, play->pcm_source);
+        play->pcm_source = NULL;
+    }
+    snd_pcm_close(play->pcm_handle);
+
+    open_pcm(play);
+    if (play->rate != rate || play->convert != convert)
+        errx(1, "Reopened %s with a different format or rate", pcm_config_device(&play->config));
+    if (!play->timer_source)
+        play->pcm_source = event_loop_add_pcm(&play->loop, play->pcm_handle, NULL);
+    else
+        play->rearm_timer = true;
+    play->block_pending = 0;
+}
+
+void alsaplay_drain(struct alsaplay *play) {
+    int errval;
+    ALSA_CHECK(snd_pcm_drain(play->pcm_handle));
+}
+
+void alsaplay_stats(const struct alsaplay *play, struct alsaplay_stats *stats) {
+    *stats = (struct alsaplay_stats){
+        .wakeups = atomic_load_explicit(&play->stats.wakeups, memory_order_relaxed),
+        .frames_written = atomic_load_explicit(&play->stats.frames_written, memory_order_relaxed),
+        .short_writes = atomic_load_explicit(&play->stats.short_writes, memory_order_relaxed),
+        .xruns = atomic_load_explicit(&play->stats.xruns, memory_order_relaxed),
+        .min_delay = atomic_load_explicit(&play->stats.min_delay, memory_order_relaxed),
+        .max_delay = atomic_load_explicit(&play->stats.max_delay, memory_order_relaxed),
+    };
+}
+
+void alsaplay_print_stats(struct alsaplay *play) {
+    stats_dump(&play->stats, stdout);
+}
+
+void alsaplay_close(struct alsaplay *play) {
+    if (play->pcm_handle) {
+        stats_unwatch(&play->stats, &play->loop);
+        event_loop_close(&play->loop);
+        snd_pcm_drop(play->pcm_handle);
+        snd_pcm_close(play->pcm_handle);
+    }
+    pcm_cache_clear(&play->cache);
+    free(play->device);
+    free(play->block);
+    free(play);
+}
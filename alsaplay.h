@@ -0,0 +1,151 @@
+#ifndef ALSAPLAY_H
+#define ALSAPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// libalsaplay: opening and negotiating a playback PCM, the poll, generate,
+// convert and write loop, and xrun recovery, shared by alsa, alsa2 and the
+// Rust program (see src/alsaplay.rs), so there's one hot path to tune and
+// benchmark rather than one per program.
+//
+// The API only passes plain C types and an opaque handle, so it can be used
+// over FFI and the internals can change without breaking callers.  (The C
+// programs also use alsaplay_internal.h, which isn't part of it.)  Errors
+// from ALSA other than an xrun or a suspend are fatal, as in the programs.
+
+struct alsaplay;
+
+// Fill buffer with frames mono samples, between -1 and 1.
+typedef void (*alsaplay_fill_fn)(void *user_data, float *buffer, size_t frames);
+
+struct alsaplay_stats {
+    unsigned long wakeups;
+    unsigned long frames_written;
+    unsigned long short_writes;
+    unsigned long xruns;
+    // The range of snd_pcm_delay since the stats were last printed, or
+    // min_delay > max_delay if there haven't been any.
+    long min_delay;
+    long max_delay;
+};
+
+// The PCM parameters to ask for.  Zero (or NULL) leaves one at whatever ALSA
+// picks, except for the format and channels, which are picked from what there
+// are converters for.
+struct alsaplay_config {
+    // NULL for "default".
+    const char *device;
+    // An ALSA format name, eg "S16_LE".
+    const char *format;
+    unsigned int channels;
+    unsigned int buffer_time_us;
+    unsigned int period_time_us;
+    unsigned long avail_min;
+    unsigned long start_threshold;
+    // Don't print snd_pcm_dump after opening.
+    bool no_dump;
+};
+
+struct alsaplay *alsaplay_new(void);
+
+// Set the PCM parameters before alsaplay_open.  The strings are copied.
+// Exits if the format or the number of channels isn't supported.
+void alsaplay_set_config(struct alsaplay *play, const struct alsaplay_config *config);
+
+// For the C programs' command lines: set one PCM parameter before
+// alsaplay_open, by its option letter in PCM_CONFIG_OPTSTRING (eg 'D' for the
+// device, 'B' for the buffer time), with value as it would be given on the
+// command line (NULL for 'N'), which must outlive play.  Returns false if opt
+// isn't one of them; exits if value is invalid.
+bool alsaplay_configure(struct alsaplay *play, int opt, const char *value);
+
+// How alsaplay_open accesses the PCM, and how far ahead alsaplay_pump
+// generates, or'd together.
+enum alsaplay_flags {
+    // Generate straight into the mmap area, rather than into a buffer of our
+    // own that's written with writei (or writen).
+    ALSAPLAY_MMAP = 1 << 0,
+    // Non-interleaved, with a plane per channel, each converted into
+    // separately.
+    ALSAPLAY_PLANAR = 1 << 1,
+    // Only generate as many whole periods as there's room for, so what's been
+    // generated but not played yet is bounded by the ALSA buffer.  Otherwise
+    // a block is generated ahead (see alsaplay_set_block) and written as
+    // there's room for it, and with mmap all the room there is is filled.
+    ALSAPLAY_LOW_LATENCY = 1 << 2,
+    // Take the device's own rate nearest the one asked for, rather than
+    // letting the plug layer resample to it, for callers that resample.
+    ALSAPLAY_NATIVE_RATE = 1 << 3,
+};
+
+// Open and negotiate the PCM at the rate nearest rate, as flags says.  Exits
+// on error.
+void alsaplay_open(struct alsaplay *play, unsigned int rate, unsigned int flags);
+
+// The negotiated parameters, once open.
+unsigned int alsaplay_rate(const struct alsaplay *play);
+unsigned int alsaplay_channels(const struct alsaplay *play);
+size_t alsaplay_period_size(const struct alsaplay *play);
+size_t alsaplay_buffer_size(const struct alsaplay *play);
+
+// The most frames generated ahead at a time without ALSAPLAY_LOW_LATENCY, and
+// the default.
+#define ALSAPLAY_BLOCK_MAX 65536
+
+// Without ALSAPLAY_LOW_LATENCY or ALSAPLAY_MMAP, generate frames (at most
+// ALSAPLAY_BLOCK_MAX) at a time ahead, eg a period, so that changes the fill
+// callback makes are heard within a buffer rather than a second later.
+void alsaplay_set_block(struct alsaplay *play, size_t frames);
+
+// Wake alsaplay_pump on a timer, when the buffer has drained to watermark_us,
+// rather than when ALSA says there's room, so plugins that signal that far
+// more often than needed (eg dmix) can't wake it.  Exits if that leaves less
+// than a period of the buffer to refill.
+void alsaplay_wake_on_timer(struct alsaplay *play, unsigned int watermark_us);
+
+// What alsaplay_pump returns when a descriptor from alsaplay_watch_fd is
+// readable.
+#define ALSAPLAY_FD_READY (-1)
+
+// Also wake alsaplay_pump when fd is readable, for the caller's own events
+// (eg a signalfd), which it returns ALSAPLAY_FD_READY for without reading it.
+// fd is closed by alsaplay_close.
+void alsaplay_watch_fd(struct alsaplay *play, int fd);
+
+// Record tracepoints into a ring in path, as the programs' -t does, for
+// trace_dump.  Exits on error.
+void alsaplay_trace(const char *path);
+
+// Print the stats on SIGUSR1, and every interval_ms if that's non-zero, from
+// alsaplay_pump.  SIGUSR1 is blocked in the calling thread until
+// alsaplay_close, so this is only for single threaded programs, as any other
+// thread would still be sent it.
+void alsaplay_watch_stats(struct alsaplay *play, unsigned int interval_ms);
+
+// Wait up to timeout_ms (-1 for forever) for the PCM to have room, then fill
+// it from fill as alsaplay_open's flags say, recovering from an xrun or a
+// suspend.  Returns the frames written, which is 0 on timing out, on a signal
+// or after recovering, or ALSAPLAY_FD_READY.
+long alsaplay_pump(struct alsaplay *play, alsaplay_fill_fn fill, void *user_data, int timeout_ms);
+// As alsaplay_pump, but write up to count interleaved frames that are already
+// in the device's format, rather than generating them.  Not for ALSAPLAY_MMAP
+// or ALSAPLAY_PLANAR.
+long alsaplay_pump_frames(struct alsaplay *play, const void *frames, size_t count, int timeout_ms);
+
+// Close the PCM and open it again with what was negotiated the first time, as
+// after a hotplug: what was queued is lost.  Exits if it comes back with a
+// different rate or format.
+void alsaplay_reopen(struct alsaplay *play);
+// Wait for what's queued to finish playing.
+void alsaplay_drain(struct alsaplay *play);
+
+// A snapshot of the stats, which can be taken from any thread.
+void alsaplay_stats(const struct alsaplay *play, struct alsaplay_stats *stats);
+// Print the stats to stdout, as on SIGUSR1, starting a new delay range.
+void alsaplay_print_stats(struct alsaplay *play);
+
+// Stop and close the PCM, and free play.
+void alsaplay_close(struct alsaplay *play);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef ALSAPLAY_INTERNAL_H
+#define ALSAPLAY_INTERNAL_H
+
+#include <alsa/asoundlib.h>
+
+#include "alsaplay.h"
+#include "pcm_config.h"
+
+// Parts of libalsaplay for the C programs, in terms of ALSA and the internal
+// types, so not part of the stable API in alsaplay.h.
+
+// The parameters alsaplay_configure sets, to adjust before alsaplay_open.
+struct pcm_config *alsaplay_config(struct alsaplay *play);
+// The negotiated format, once open.
+snd_pcm_format_t alsaplay_format(const struct alsaplay *play);
+// The PCM, once open, until it's reopened or closed.
+snd_pcm_t *alsaplay_pcm(const struct alsaplay *play);
+
+#endif
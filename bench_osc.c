@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include "oscillator.h"
+#include "wavetable.h"
+
+// Compares sine_fill against the original per-sample sin() loop, and the
+// wavetable oscillators, filling the same 65536 frame blocks the playback
+// programs use.
+
+static const unsigned int rate = 44100;
+static const float frequency = 440.0;
+
+static void generate_data_libm(float *buffer, size_t buffer_size) {
+    static float phase = 0.0f;
+
+    for(size_t idx = 0; idx < buffer_size; ++idx) {
+        buffer[idx] = sin(phase * 2.0 * M_PI * frequency / rate);
+        phase += 1.0;
+        if (phase >= rate) {
+            phase -= rate;
+        }
+    }
+}
+
+static struct wavetable saw_table;
+static struct oscillator sine_tone, saw_linear_tone, saw_cubic_tone;
+
+static void generate_data_kernel(float *buffer, size_t buffer_size) {
+    oscillator_fill(&sine_tone, buffer, buffer_size);
+}
+
+static void generate_data_saw_linear(float *buffer, size_t buffer_size) {
+    oscillator_fill(&saw_linear_tone, buffer, buffer_size);
+}
+
+static void generate_data_saw_cubic(float *buffer, size_t buffer_size) {
+    oscillator_fill(&saw_cubic_tone, buffer, buffer_size);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void bench(const char *name, void (*generate)(float *, size_t)) {
+    const size_t block_size = 65536;
+    const int iterations = 200;
+    static float block[65536];
+    volatile float sink = 0.0f;
+
+    generate(block, block_size); // warm up
+
+    double start = now();
+    for (int i = 0; i < iterations; ++i) {
+        generate(block, block_size);
+        sink += block[i];
+    }
+    double elapsed = now() - start;
+
+    double samples_per_sec = block_size * iterations / elapsed;
+    printf("%-12s %12.0f samples/sec, %8.1f us per %zu frame block (%.3f%% of realtime at %u Hz)\n",
+            name,
+            samples_per_sec,
+            1e6 * elapsed / iterations,
+            block_size,
+            100.0 * rate / samples_per_sec,
+            rate);
+}
+
+int main(void) {
+    bench("sin()", generate_data_libm);
+    oscillator_init(&sine_tone, frequency, rate, NULL, WAVETABLE_LINEAR);
+    bench("kernel", generate_data_kernel);
+
+    double start = now();
+    wavetable_init(&saw_table, WAVEFORM_SAW);
+    printf("Built the saw tables in %.1f ms\n", 1e3 * (now() - start));
+    oscillator_init(&saw_linear_tone, frequency, rate, &saw_table, WAVETABLE_LINEAR);
+    oscillator_init(&saw_cubic_tone, frequency, rate, &saw_table, WAVETABLE_CUBIC);
+    bench("saw linear", generate_data_saw_linear);
+    bench("saw cubic", generate_data_saw_cubic);
+    wavetable_free(&saw_table);
+    return 0;
+}
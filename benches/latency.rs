@@ -0,0 +1,334 @@
+//! Runs each playback implementation against the `null` plugin and a real `hw:` device, and
+//! records wakeup-to-write latency, the `snd_pcm_delay` distribution, CPU time per second of audio
+//! and xruns.
+//!
+//! Results are written to stdout as one JSON object per line, with a human readable summary on
+//! stderr.  The C programs need building with `make` first, they're skipped if they haven't been.
+//!
+//! `LATENCY_BENCH_SECONDS` sets how long each run lasts (default 10), and `LATENCY_BENCH_HW` the
+//! hardware device (default `hw:0`, empty to skip it).  Note the null plugin never blocks, so its
+//! runs measure the write loop's throughput rather than its scheduling.  `LATENCY_BENCH_C_DIR`
+//! runs the C programs from another directory, such as one of the tuned builds under `build/`.
+
+use std::io::Read as _;
+use std::process::{Command, Stdio};
+use std::time::Duration;
+
+struct Backend {
+    name: &'static str,
+    program: &'static str,
+    args: &'static [&'static str],
+}
+
+const RUST_PROGRAM: &str = "alsa-test";
+
+const BACKENDS: &[Backend] = &[
+    Backend {
+        name: "alsa",
+        program: "alsa",
+        args: &[],
+    },
+    Backend {
+        name: "alsa-mmap",
+        program: "alsa",
+        args: &["-m"],
+    },
+    Backend {
+        name: "alsa-lowlat",
+        program: "alsa",
+        args: &["-l"],
+    },
+    Backend {
+        name: "alsa2",
+        program: "alsa2",
+        args: &[],
+    },
+    Backend {
+        name: "alsa2-mmap",
+        program: "alsa2",
+        args: &["-m"],
+    },
+    Backend {
+        name: "alsa2-lowlat",
+        program: "alsa2",
+        args: &["-l"],
+    },
+    Backend {
+        name: "rust",
+        program: RUST_PROGRAM,
+        args: &[],
+    },
+    Backend {
+        name: "rust-lowlat",
+        program: RUST_PROGRAM,
+        args: &["-l"],
+    },
+    Backend {
+        name: "rust-rt",
+        program: RUST_PROGRAM,
+        args: &["-R", "50"],
+    },
+];
+
+/// The last stats dump a run printed.
+#[derive(Debug, Default)]
+struct Report {
+    rate: Option<f64>,
+    counters: Vec<(String, String)>,
+    /// Each histogram's buckets, as their upper bound and count.
+    histograms: Vec<(String, Vec<(u64, u64)>)>,
+}
+
+impl Report {
+    fn parse(output: &str) -> Self {
+        let mut report = Self::default();
+        for line in output.lines() {
+            if let Some(negotiated) = line.strip_prefix("Negotiated: ") {
+                report.rate = negotiated
+                    .strip_suffix(" Hz")
+                    .and_then(|rest| rest.rsplit(' ').next())
+                    .and_then(|rate| rate.parse().ok())
+                    .or(report.rate);
+                continue;
+            }
+            let Some(stats) = line.strip_prefix("stats: ") else {
+                continue;
+            };
+
+            let mut words = stats.split(' ');
+            let first = words.next().unwrap_or_default();
+            if first.contains('=') {
+                // A new dump, replacing the previous one.
+                report.counters = std::iter::once(first)
+                    .chain(words)
+                    .filter_map(|word| word.split_once('='))
+                    .map(|(key, value)| (key.to_owned(), value.to_owned()))
+                    .collect();
+                report.histograms.clear();
+            } else if first.ends_with("_us") || first.ends_with("_frames") {
+                let buckets = words
+                    .filter_map(|word| {
+                        let (bound, count) = word.split_once(':')?;
+                        // The open ended last bucket is reported by its lower bound.
+                        let bound = match bound.strip_prefix(">=") {
+                            Some(lower) => lower.parse::<u64>().ok()? * 2,
+                            None => bound.strip_prefix('<')?.parse().ok()?,
+                        };
+                        Some((bound, count.parse().ok()?))
+                    })
+                    .collect();
+                report.histograms.push((first.to_owned(), buckets));
+            }
+        }
+        report
+    }
+
+    fn counter(&self, name: &str) -> Option<u64> {
+        self.counters
+            .iter()
+            .find(|(key, _)| key == name)
+            .and_then(|(_, value)| value.parse().ok())
+    }
+}
+
+/// The upper bound of the bucket containing the `quantile` point of `buckets`.
+fn quantile(buckets: &[(u64, u64)], quantile: f64) -> Option<u64> {
+    let total: u64 = buckets.iter().map(|&(_, count)| count).sum();
+    let target = (quantile * total as f64).ceil().max(1.0) as u64;
+    let mut seen = 0;
+    buckets.iter().find_map(|&(bound, count)| {
+        seen += count;
+        (seen >= target).then_some(bound)
+    })
+}
+
+fn json_string(s: &str) -> String {
+    let mut out = String::from("\"");
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if c.is_control() => out.push_str(&format!("\\u{:04x}", c as u32)),
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
+
+fn json_histogram(buckets: &[(u64, u64)]) -> String {
+    let or_null = |value: Option<u64>| value.map_or("null".to_owned(), |v| v.to_string());
+    let formatted = buckets
+        .iter()
+        .map(|(bound, count)| format!("\"<{bound}\":{count}"))
+        .collect::<Vec<_>>()
+        .join(",");
+    format!(
+        "{{\"p50\":{},\"p99\":{},\"max\":{},\"buckets\":{{{formatted}}}}}",
+        or_null(quantile(buckets, 0.5)),
+        or_null(quantile(buckets, 0.99)),
+        or_null(quantile(buckets, 1.0)),
+    )
+}
+
+/// User plus system CPU time used by all the children we've waited for.
+fn children_cpu_seconds() -> f64 {
+    // SAFETY: getrusage only writes to the struct we pass it.
+    let usage = unsafe {
+        let mut usage = std::mem::zeroed::<libc::rusage>();
+        libc::getrusage(libc::RUSAGE_CHILDREN, &mut usage);
+        usage
+    };
+    let seconds = |tv: libc::timeval| tv.tv_sec as f64 + tv.tv_usec as f64 / 1e6;
+    seconds(usage.ru_utime) + seconds(usage.ru_stime)
+}
+
+fn program_path(program: &str) -> std::path::PathBuf {
+    if program == RUST_PROGRAM {
+        env!("CARGO_BIN_EXE_alsa-test").into()
+    } else {
+        std::env::var_os("LATENCY_BENCH_C_DIR")
+            .map(std::path::PathBuf::from)
+            .unwrap_or_else(|| env!("CARGO_MANIFEST_DIR").into())
+            .join(program)
+    }
+}
+
+/// Play on `device` with `backend` for `duration`, then have it dump its stats and stop it.
+/// Returns what it printed, and the CPU time it used.
+fn run(backend: &Backend, device: &str, duration: Duration) -> Result<(String, f64), String> {
+    let path = program_path(backend.program);
+    if !path.exists() {
+        return Err(format!("{} hasn't been built, run make", path.display()));
+    }
+
+    let cpu_before = children_cpu_seconds();
+    let mut child = Command::new(&path)
+        .args(backend.args)
+        .args(["-D", device])
+        .stdin(Stdio::null())
+        .stdout(Stdio::piped())
+        .stderr(Stdio::piped())
+        .spawn()
+        .map_err(|err| format!("couldn't run {}: {err}", path.display()))?;
+
+    // Read as we go, so a chatty program can't fill the pipe and block.
+    let collect = |mut pipe: Box<dyn std::io::Read + Send>| {
+        std::thread::spawn(move || {
+            let mut output = String::new();
+            let _ = pipe.read_to_string(&mut output);
+            output
+        })
+    };
+    let stdout = collect(Box::new(child.stdout.take().unwrap()));
+    let stderr = collect(Box::new(child.stderr.take().unwrap()));
+
+    let deadline = std::time::Instant::now() + duration;
+    let mut exited = None;
+    while exited.is_none() && std::time::Instant::now() < deadline {
+        std::thread::sleep(Duration::from_millis(100));
+        exited = child.try_wait().map_err(|err| err.to_string())?;
+    }
+
+    if exited.is_none() {
+        let pid = child.id() as libc::pid_t;
+        // SAFETY: plain signal sends to our own child, which hasn't been reaped yet.
+        unsafe { libc::kill(pid, libc::SIGUSR1) };
+        std::thread::sleep(Duration::from_millis(500));
+        unsafe { libc::kill(pid, libc::SIGTERM) };
+    }
+    child.wait().map_err(|err| err.to_string())?;
+    let cpu = children_cpu_seconds() - cpu_before;
+
+    let stdout = stdout.join().unwrap_or_default();
+    let stderr = stderr.join().unwrap_or_default();
+    if let Some(status) = exited {
+        let reason = stderr.lines().last().unwrap_or_default();
+        return Err(format!("exited early ({status}): {reason}"));
+    }
+
+    Ok((stdout, cpu))
+}
+
+fn result_json(backend: &Backend, device: &str, duration: Duration) -> String {
+    let header = format!(
+        "\"backend\":{},\"device\":{},\"seconds\":{}",
+        json_string(backend.name),
+        json_string(device),
+        duration.as_secs_f64()
+    );
+
+    let (output, cpu_seconds) = match run(backend, device, duration) {
+        Ok(result) => result,
+        Err(error) => {
+            eprintln!("{:<14} {device:<8} {error}", backend.name);
+            return format!("{{{header},\"error\":{}}}", json_string(&error));
+        }
+    };
+
+    let report = Report::parse(&output);
+    let (Some(rate), Some(frames_written)) = (report.rate, report.counter("frames_written")) else {
+        let error = "no stats in the output";
+        eprintln!("{:<14} {device:<8} {error}", backend.name);
+        return format!("{{{header},\"error\":{}}}", json_string(error));
+    };
+
+    let audio_seconds = frames_written as f64 / rate;
+    let cpu_per_audio_second = if audio_seconds > 0.0 {
+        cpu_seconds / audio_seconds
+    } else {
+        f64::NAN
+    };
+    let histogram = |name: &str| {
+        report
+            .histograms
+            .iter()
+            .find(|(key, _)| key == name)
+            .map(|(_, buckets)| buckets.as_slice())
+            .unwrap_or_default()
+    };
+    let latency = histogram("wakeup_latency_us");
+    let delay = histogram("delay_frames");
+    let counter = |name| report.counter(name).unwrap_or_default();
+
+    eprintln!(
+        "{:<14} {device:<8} {:9.2}s audio, {:6.2}% cpu/audio-s, latency p50<{}us p99<{}us, delay p50<{} frames, {} xruns",
+        backend.name,
+        audio_seconds,
+        100.0 * cpu_per_audio_second,
+        quantile(latency, 0.5).unwrap_or_default(),
+        quantile(latency, 0.99).unwrap_or_default(),
+        quantile(delay, 0.5).unwrap_or_default(),
+        counter("xruns"),
+    );
+
+    let cpu_per_audio_second = if cpu_per_audio_second.is_finite() {
+        cpu_per_audio_second.to_string()
+    } else {
+        "null".to_owned()
+    };
+    format!(
+        "{{{header},\"rate\":{rate},\"wakeups\":{},\"frames_written\":{frames_written},\"short_writes\":{},\"xruns\":{},\"audio_seconds\":{audio_seconds},\"cpu_seconds\":{cpu_seconds},\"cpu_per_audio_second\":{cpu_per_audio_second},\"wakeup_latency_us\":{},\"delay_frames\":{}}}",
+        counter("wakeups"),
+        counter("short_writes"),
+        counter("xruns"),
+        json_histogram(latency),
+        json_histogram(delay),
+    )
+}
+
+fn main() {
+    let seconds = std::env::var("LATENCY_BENCH_SECONDS")
+        .ok()
+        .and_then(|seconds| seconds.parse().ok())
+        .unwrap_or(10.0);
+    let duration = Duration::from_secs_f64(seconds);
+    let hw = std::env::var("LATENCY_BENCH_HW").unwrap_or_else(|_| "hw:0".to_owned());
+
+    let devices = std::iter::once("null").chain((!hw.is_empty()).then_some(hw.as_str()));
+    for device in devices {
+        for backend in BACKENDS {
+            println!("{}", result_json(backend, device, duration));
+        }
+    }
+}
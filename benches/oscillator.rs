@@ -0,0 +1,75 @@
+//! Compares `osc::sine_fill` against the original per-sample `sin()` loop, and the wavetable
+//! oscillators, filling the same 65536 frame blocks the playback program uses.
+
+#[path = "../src/osc.rs"]
+mod osc;
+#[path = "../src/wavetable.rs"]
+mod wavetable;
+
+const RATE: f32 = 44100.0;
+const FREQUENCY: f32 = 440.0;
+const BLOCK_SIZE: usize = 65536;
+const ITERATIONS: usize = 200;
+
+fn generate_data_libm(buffer: &mut [f32], phase: &mut f32) {
+    for i in buffer {
+        *i = (*phase * std::f32::consts::TAU * FREQUENCY / RATE).sin();
+        *phase += 1.0;
+    }
+    if *phase > RATE {
+        *phase -= RATE;
+    }
+}
+
+fn bench(name: &str, mut generate: impl FnMut(&mut [f32])) {
+    let mut block = vec![0.0f32; BLOCK_SIZE];
+
+    generate(&mut block); // warm up
+
+    let start = std::time::Instant::now();
+    for _ in 0..ITERATIONS {
+        generate(&mut block);
+        std::hint::black_box(&block);
+    }
+    let elapsed = start.elapsed().as_secs_f64();
+
+    let samples_per_sec = (BLOCK_SIZE * ITERATIONS) as f64 / elapsed;
+    println!(
+        "{name:<12} {samples_per_sec:12.0} samples/sec, {:8.1} us per {BLOCK_SIZE} frame block ({:.3}% of realtime at {RATE} Hz)",
+        1e6 * elapsed / ITERATIONS as f64,
+        100.0 * RATE as f64 / samples_per_sec,
+    );
+}
+
+fn main() {
+    let mut phase = 0.0;
+    bench("sin()", |block| generate_data_libm(block, &mut phase));
+
+    let mut tone = osc::Oscillator::new(FREQUENCY, RATE, None);
+    bench("kernel", |block| tone.fill(block));
+
+    // As a multi-device worker does: aligned once, then retuned a little on every write.
+    let mut tone = osc::Oscillator::new(FREQUENCY, RATE, None);
+    tone.skip(0.25);
+    let mut ratio = 1.0;
+    bench("kernel drift", |block| {
+        for chunk in block.chunks_mut(1024) {
+            ratio = if ratio > 1.0 { 0.99995 } else { 1.00005 };
+            tone.retune(FREQUENCY * ratio, RATE);
+            tone.fill(chunk);
+        }
+    });
+
+    // Named as on the command line, so they're parsed the same way.
+    for waveform in ["saw", "square", "triangle"] {
+        for interpolation in ["linear", "cubic"] {
+            let name = format!("{waveform} {interpolation}");
+            let table = wavetable::Wavetable::new(
+                wavetable::Waveform::parse(waveform).unwrap(),
+                wavetable::Interpolation::parse(interpolation).unwrap(),
+            );
+            let mut tone = osc::Oscillator::new(FREQUENCY, RATE, Some(std::sync::Arc::new(table)));
+            bench(&name, |block| tone.fill(block));
+        }
+    }
+}
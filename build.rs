@@ -0,0 +1,48 @@
+//! Builds libalsaplay, the C core most playback goes through (see alsaplay.h), with the Makefile
+//! into `OUT_DIR`, and links it.  `ALSAPLAY_CFLAGS` overrides its CFLAGS, as the Makefile's tuned
+//! builds do.
+
+const SOURCES: &[&str] = &[
+    "Makefile",
+    "alsaplay.c",
+    "alsaplay.h",
+    "alsaplay_internal.h",
+    "convert.c",
+    "convert.h",
+    "event_loop.c",
+    "event_loop.h",
+    "pcm_config.c",
+    "pcm_config.h",
+    "stats.c",
+    "stats.h",
+    "trace.c",
+    "trace.h",
+];
+
+fn main() {
+    let manifest = std::env::var("CARGO_MANIFEST_DIR").expect("CARGO_MANIFEST_DIR not set");
+    let out = std::env::var("OUT_DIR").expect("OUT_DIR not set");
+
+    let mut make = std::process::Command::new("make");
+    make.arg("-C")
+        .arg(&out)
+        .arg("-f")
+        .arg(format!("{manifest}/Makefile"))
+        .arg(format!("SRCDIR={manifest}"))
+        .arg("libalsaplay.a");
+    if let Ok(cflags) = std::env::var("ALSAPLAY_CFLAGS") {
+        make.arg(format!("CFLAGS={cflags}"));
+    }
+    let status = make.status().expect("Couldn't run make");
+    assert!(status.success(), "Building libalsaplay failed");
+
+    println!("cargo::rustc-link-search=native={out}");
+    println!("cargo::rustc-link-lib=static=alsaplay");
+    for lib in ["asound", "m", "pthread"] {
+        println!("cargo::rustc-link-lib={lib}");
+    }
+    println!("cargo::rerun-if-env-changed=ALSAPLAY_CFLAGS");
+    for source in SOURCES {
+        println!("cargo::rerun-if-changed={manifest}/{source}");
+    }
+}
@@ -0,0 +1,147 @@
+#include "control.h"
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Set in middle while it holds an update that hasn't been taken.
+#define FRESH 4u
+
+// Apply message to params, returning false if it isn't one we know.
+static bool parse_message(const char *message, struct control_params *params, double max_frequency) {
+    char name[16], value[32];
+    if (sscanf(message, "%15s %31s", name, value) != 2)
+        return false;
+
+    char *end;
+    double number = strtod(value, &end);
+    bool is_number = end != value && *end == '\0' && isfinite(number);
+    if (strcmp(name, "freq") == 0 && is_number && number > 0 && number < max_frequency)
+        params->frequency = number;
+    else if (strcmp(name, "gain") == 0 && is_number && number >= CONTROL_MIN_GAIN_DB && number <= CONTROL_MAX_GAIN_DB)
+        params->gain_db = number;
+    else if (strcmp(name, "mute") == 0 && (strcmp(value, "on") == 0 || strcmp(value, "off") == 0))
+        params->mute = strcmp(value, "on") == 0;
+    else
+        return false;
+    return true;
+}
+
+static void *control_thread(void *arg) {
+    struct control *control = arg;
+    char message[64];
+
+    for (;;) {
+        ssize_t length = recv(control->fd, message, sizeof(message) - 1, 0);
+        if (length == -1) {
+            if (errno != EINTR)
+                warn("recv %s", control->path);
+            continue;
+        }
+        message[length] = '\0';
+        message[strcspn(message, "\n")] = '\0';
+
+        if (!parse_message(message, &control->current, control->max_frequency)) {
+            warnx("%s: ignoring '%s', expected freq hz (below %.0f), gain db (%.0f to %.0f) or mute on|off", control->path, message,
+                    control->max_frequency, CONTROL_MIN_GAIN_DB, CONTROL_MAX_GAIN_DB);
+            continue;
+        }
+        printf("Control: %s\n", message);
+
+        // Publish, and take back whichever slot the audio loop isn't using.
+        control->slots[control->writing] = control->current;
+        control->writing = atomic_exchange_explicit(&control->middle, control->writing | FRESH, memory_order_acq_rel) & ~FRESH;
+    }
+    return NULL;
+}
+
+void control_open(struct control *control, const char *path, const struct control_params *initial, double max_frequency) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path))
+        errx(1, "%s: path too long for a socket", path);
+    strcpy(address.sun_path, path);
+
+    control->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (control->fd == -1)
+        err(1, "socket");
+    if (unlink(path) == -1 && errno != ENOENT)
+        err(1, "unlink %s", path);
+    if (bind(control->fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+        err(1, "bind %s", path);
+
+    control->path = path;
+    control->current = *initial;
+    control->max_frequency = max_frequency;
+    for (size_t i = 0; i < 3; ++i)
+        control->slots[i] = *initial;
+    control->writing = 0;
+    control->reading = 1;
+    atomic_init(&control->middle, 2);
+
+    errno = pthread_create(&control->thread, NULL, control_thread, control);
+    if (errno)
+        err(1, "pthread_create");
+    printf("Listening for control messages on %s\n", path);
+}
+
+void control_close(struct control *control) {
+    pthread_cancel(control->thread);
+    pthread_join(control->thread, NULL);
+    close(control->fd);
+    unlink(control->path);
+}
+
+bool control_poll(struct control *control, const struct control_params **params) {
+    if (!(atomic_load_explicit(&control->middle, memory_order_relaxed) & FRESH))
+        return false;
+
+    control->reading = atomic_exchange_explicit(&control->middle, control->reading, memory_order_acq_rel) & ~FRESH;
+    *params = &control->slots[control->reading];
+    return true;
+}
+
+void ramp_init(struct ramp *ramp, double value) {
+    *ramp = (struct ramp){ .value = value, .target = value };
+}
+
+void ramp_set(struct ramp *ramp, double target, size_t samples) {
+    ramp->target = target;
+    ramp->remaining = samples ? samples : 1;
+    ramp->step = (target - ramp->value) / ramp->remaining;
+}
+
+double ramp_advance(struct ramp *ramp, size_t samples) {
+    if (samples >= ramp->remaining) {
+        ramp->value = ramp->target;
+        ramp->remaining = 0;
+    } else {
+        ramp->value += ramp->step * samples;
+        ramp->remaining -= samples;
+    }
+    return ramp->value;
+}
+
+void ramp_apply(struct ramp *ramp, float *buffer, size_t frames) {
+    size_t i = 0;
+    if (ramp->remaining) {
+        size_t moving = frames < ramp->remaining ? frames : ramp->remaining;
+        float value = ramp->value, step = ramp->step;
+        for (; i < moving; ++i) {
+            value += step;
+            buffer[i] *= value;
+        }
+        ramp_advance(ramp, moving);
+    }
+
+    if (ramp->value == 1.0)
+        return;
+    float value = ramp->value;
+    for (; i < frames; ++i)
+        buffer[i] *= value;
+}
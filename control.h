@@ -0,0 +1,77 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Live parameter changes, sent as text datagrams to a Unix socket, eg
+//
+//   echo 'freq 880' | socat - UNIX-SENDTO:/tmp/alsa2.sock
+//
+// with one of "freq hz", "gain db" or "mute on|off" per datagram.
+//
+// A thread reads the socket and publishes each change through a triple
+// buffer: the thread and the audio loop each own a slot, and swap theirs with
+// the one in the middle with a single atomic exchange.  Neither side ever
+// waits for the other, and the audio loop always sees a whole set of
+// parameters, never half of an update.
+
+// Gains outside this range are rejected: above it the tone would clip hard
+// (and overflow to inf through the effects), below it is silence anyway.
+#define CONTROL_MIN_GAIN_DB -120.0
+#define CONTROL_MAX_GAIN_DB 24.0
+
+struct control_params {
+    double frequency;
+    double gain_db;
+    bool mute;
+};
+
+struct control {
+    int fd;
+    const char *path;
+    pthread_t thread;
+
+    struct control_params slots[3];
+    // The slot the thread writes to, only touched by the thread.
+    unsigned int writing;
+    // The slot the audio loop last took, only touched by it.
+    unsigned int reading;
+    // The slot in the middle, flagged while it holds an update the audio loop
+    // hasn't taken yet.
+    atomic_uint middle;
+    // What the thread has been sent so far, with frequencies limited to below
+    // max_frequency.
+    struct control_params current;
+    double max_frequency;
+};
+
+// Bind a datagram socket at path (replacing any stale one) and start reading
+// it, starting from initial.  Exits on error.
+void control_open(struct control *control, const char *path, const struct control_params *initial, double max_frequency);
+void control_close(struct control *control);
+
+// From the audio loop: if there's been an update since the last call, point
+// *params at the latest parameters and return true.  Wait-free.  *params
+// stays valid until the next call.
+bool control_poll(struct control *control, const struct control_params **params);
+
+// A parameter moving linearly to its target over a set number of samples, so
+// changes to it don't click.
+struct ramp {
+    double value;
+    double target;
+    double step;
+    size_t remaining;
+};
+
+void ramp_init(struct ramp *ramp, double value);
+void ramp_set(struct ramp *ramp, double target, size_t samples);
+// Move samples further along, returning the value reached.
+double ramp_advance(struct ramp *ramp, size_t samples);
+// Scale buffer by the ramp, a step per sample while it's moving.
+void ramp_apply(struct ramp *ramp, float *buffer, size_t frames);
+
+#endif
@@ -0,0 +1,94 @@
+#include "convert.h"
+
+#include <stdint.h>
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The _LE converters store samples in host byte order"
+#endif
+
+const snd_pcm_format_t convert_formats[] = {
+    SND_PCM_FORMAT_FLOAT_LE,
+    SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_S24_3LE,
+    SND_PCM_FORMAT_S16_LE,
+    SND_PCM_FORMAT_UNKNOWN,
+};
+
+// Packed 24 bit samples are three bytes, so have no natural C type.
+struct s24_3le {
+    uint8_t bytes[3];
+};
+
+// Compares and selects, which the compiler turns into min/max instructions
+// rather than branches, so these vectorise.  (Unlike fminf/fmaxf, which have
+// to return the other operand for a NaN, they don't need -ffinite-math-only.)
+static inline float clamp(float x) {
+    return x < -1.0f ? -1.0f : x > 1.0f ? 1.0f : x;
+}
+
+static inline float encode_float_le(float x) {
+    return x;
+}
+
+static inline int16_t encode_s16_le(float x) {
+    return (int16_t)(clamp(x) * INT16_MAX);
+}
+
+static inline int32_t encode_s32_le(float x) {
+    // float can't represent INT32_MAX, so scale in double to avoid overflow.
+    return (int32_t)((double)clamp(x) * INT32_MAX);
+}
+
+static inline struct s24_3le encode_s24_3le(float x) {
+    int32_t s = (int32_t)(clamp(x) * 8388607.0f);
+    return (struct s24_3le){{ (uint8_t)s, (uint8_t)(s >> 8), (uint8_t)(s >> 16) }};
+}
+
+// The channel count is a constant in each expansion, so the inner loop is
+// unrolled away.
+#define DEFINE_CONVERTER(name, sample_t, channels) \
+    static void convert_##name##_##channels(void *dest, const float *src, size_t frames) { \
+        sample_t *out = dest; \
+        for (size_t i = 0; i < frames; ++i) { \
+            const sample_t sample = encode_##name(src[i]); \
+            for (unsigned int c = 0; c < (channels); ++c) \
+                out[i * (channels) + c] = sample; \
+        } \
+    }
+
+#define DEFINE_CONVERTERS(name, sample_t) \
+    DEFINE_CONVERTER(name, sample_t, 1) \
+    DEFINE_CONVERTER(name, sample_t, 2) \
+    DEFINE_CONVERTER(name, sample_t, 3) \
+    DEFINE_CONVERTER(name, sample_t, 4) \
+    DEFINE_CONVERTER(name, sample_t, 5) \
+    DEFINE_CONVERTER(name, sample_t, 6) \
+    DEFINE_CONVERTER(name, sample_t, 7) \
+    DEFINE_CONVERTER(name, sample_t, 8) \
+    static const sample_convert_fn name##_converters[CONVERT_MAX_CHANNELS] = { \
+        convert_##name##_1, convert_##name##_2, convert_##name##_3, convert_##name##_4, \
+        convert_##name##_5, convert_##name##_6, convert_##name##_7, convert_##name##_8, \
+    };
+
+DEFINE_CONVERTERS(float_le, float)
+DEFINE_CONVERTERS(s16_le, int16_t)
+DEFINE_CONVERTERS(s24_3le, struct s24_3le)
+DEFINE_CONVERTERS(s32_le, int32_t)
+
+sample_convert_fn sample_converter(snd_pcm_format_t format, unsigned int channels) {
+    if (channels < 1 || channels > CONVERT_MAX_CHANNELS)
+        return NULL;
+
+    switch (format) {
+        case SND_PCM_FORMAT_FLOAT_LE:
+            return float_le_converters[channels - 1];
+        case SND_PCM_FORMAT_S16_LE:
+            return s16_le_converters[channels - 1];
+        case SND_PCM_FORMAT_S24_3LE:
+            return s24_3le_converters[channels - 1];
+        case SND_PCM_FORMAT_S32_LE:
+            return s32_le_converters[channels - 1];
+        default:
+            return NULL;
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <alsa/asoundlib.h>
+#include <stddef.h>
+
+#define CONVERT_MAX_CHANNELS 8
+
+// Convert frames mono float samples to interleaved frames in the device's
+// format, with every channel carrying the same signal.
+typedef void (*sample_convert_fn)(void *dest, const float *src, size_t frames);
+
+// Formats there are converters for, most preferred first, terminated by
+// SND_PCM_FORMAT_UNKNOWN.
+extern const snd_pcm_format_t convert_formats[];
+
+// Returns the converter for format with channels channels, or NULL if there
+// isn't one.  Each (format, channels) pair has its own specialised loop, so
+// there's no per-sample branching on either.
+sample_convert_fn sample_converter(snd_pcm_format_t format, unsigned int channels);
+
+#endif
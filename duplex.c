@@ -0,0 +1,291 @@
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <err.h>
+#include <limits.h>
+#include <stdio.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h> // For getopt
+
+#include "event_loop.h"
+#include "pcm_config.h"
+#include "stats.h"
+
+// Full duplex loopback.  The capture and playback PCMs are linked with
+// snd_pcm_link, so they start and stop together, and both are serviced from a
+// single wakeup on the capture descriptors.  Captured audio is copied straight
+// from the capture mmap area into the playback one, so the round trip is one
+// capture period plus whatever playback had queued: close to two periods.
+
+#define ALSA_CHECK(x) if ( (errval = (x)) < 0 ) errx(1, #x ": %s", snd_strerror(errval))
+
+// Per-wakeup logging, off by default as stdio on the audio path causes jitter.
+static bool verbose = false;
+#define VERBOSE(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
+
+// What both streams negotiated, which has to be the same for the copy to work.
+struct duplex_params {
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int rate;
+    snd_pcm_uframes_t buffer_size;
+    snd_pcm_uframes_t period_size;
+};
+
+static struct duplex_params get_params(snd_pcm_t *pcm_handle) {
+    int errval;
+    uint8_t hw_params_raw_data[snd_pcm_hw_params_sizeof()];
+    snd_pcm_hw_params_t *hwparams = (snd_pcm_hw_params_t *)hw_params_raw_data;
+    struct duplex_params params;
+
+    ALSA_CHECK(snd_pcm_hw_params_current(pcm_handle, hwparams));
+    ALSA_CHECK(snd_pcm_hw_params_get_format(hwparams, &params.format));
+    ALSA_CHECK(snd_pcm_hw_params_get_channels(hwparams, &params.channels));
+    ALSA_CHECK(snd_pcm_hw_params_get_rate(hwparams, &params.rate, NULL));
+    ALSA_CHECK(snd_pcm_hw_params_get_buffer_size(hwparams, &params.buffer_size));
+    ALSA_CHECK(snd_pcm_hw_params_get_period_size(hwparams, &params.period_size, NULL));
+    return params;
+}
+
+// Open the configured device for stream with mmap access.  The stream is
+// never started by ALSA itself, only by starting the linked pair.
+static snd_pcm_t *open_pcm(snd_pcm_stream_t stream, const struct pcm_config *config) {
+    int errval;
+    unsigned int rate = 44100;
+
+    printf("%s:\n", stream == SND_PCM_STREAM_CAPTURE ? "Capture" : "Playback");
+    snd_pcm_t *pcm_handle = pcm_config_open(NULL, config, stream, SND_PCM_NONBLOCK, SND_PCM_ACCESS_MMAP_INTERLEAVED, &rate);
+
+    uint8_t sw_params_raw_data[snd_pcm_sw_params_sizeof()];
+    snd_pcm_sw_params_t *swparams = (snd_pcm_sw_params_t *)sw_params_raw_data;
+    snd_pcm_uframes_t boundary;
+    ALSA_CHECK(snd_pcm_sw_params_current(pcm_handle, swparams));
+    ALSA_CHECK(snd_pcm_sw_params_get_boundary(swparams, &boundary));
+    ALSA_CHECK(snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams, boundary));
+    ALSA_CHECK(snd_pcm_sw_params(pcm_handle, swparams));
+    return pcm_handle;
+}
+
+static inline uint8_t *area_frame(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset) {
+    // Interleaved, so the first channel's area gives the start of each frame.
+    return (uint8_t *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+}
+
+// Queue frames of silence on playback, through the mmap area.
+static int queue_silence(snd_pcm_t *playback, snd_pcm_uframes_t frames, const struct duplex_params *params) {
+    while (frames > 0) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t chunk = frames;
+
+        int ret = snd_pcm_mmap_begin(playback, &areas, &offset, &chunk);
+        if (ret < 0)
+            return ret;
+        if (chunk == 0)
+            return -EPIPE;
+        snd_pcm_areas_silence(areas, offset, params->channels, chunk, params->format);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(playback, offset, chunk);
+        if (committed < 0)
+            return committed;
+        frames -= committed;
+    }
+    return 0;
+}
+
+// Copy up to frames frames from the capture mmap area straight into the
+// playback one, a contiguous stretch of both at a time.  Any processing would
+// be done here, on the mapped buffers, rather than in a copy of them.  Returns
+// the number of frames copied, or a negative error code for the caller to
+// recover from.
+static snd_pcm_sframes_t copy_available(snd_pcm_t *capture, snd_pcm_t *playback, snd_pcm_uframes_t frames, size_t frame_bytes) {
+    snd_pcm_uframes_t copied = 0;
+
+    while (copied < frames) {
+        const snd_pcm_channel_area_t *in_areas, *out_areas;
+        snd_pcm_uframes_t in_offset, out_offset;
+        snd_pcm_uframes_t in_frames = frames - copied;
+        snd_pcm_uframes_t out_frames = frames - copied;
+
+        int ret = snd_pcm_mmap_begin(capture, &in_areas, &in_offset, &in_frames);
+        if (ret < 0)
+            return ret;
+        ret = snd_pcm_mmap_begin(playback, &out_areas, &out_offset, &out_frames);
+        if (ret < 0)
+            return ret;
+
+        snd_pcm_uframes_t chunk = in_frames < out_frames ? in_frames : out_frames;
+        if (chunk == 0)
+            break;
+        memcpy(area_frame(out_areas, out_offset), area_frame(in_areas, in_offset), chunk * frame_bytes);
+
+        snd_pcm_sframes_t committed = snd_pcm_mmap_commit(playback, out_offset, chunk);
+        if (committed < 0)
+            return committed;
+        if ((snd_pcm_uframes_t)committed != chunk)
+            return -EPIPE;
+        committed = snd_pcm_mmap_commit(capture, in_offset, chunk);
+        if (committed < 0)
+            return committed;
+        if ((snd_pcm_uframes_t)committed != chunk)
+            return -EPIPE;
+
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+// Linked streams are prepared and started together, so this starts (or after
+// an xrun on either, restarts) both, with prefill frames of silence queued on
+// playback to set the round trip.
+static void start_linked(snd_pcm_t *capture, snd_pcm_t *playback, snd_pcm_uframes_t prefill, const struct duplex_params *params) {
+    int errval;
+
+    // Linking makes these act on both, but not every plugin honours that.
+    snd_pcm_t *pcms[] = { capture, playback };
+    for (size_t i = 0; i < 2; ++i) {
+        if (snd_pcm_state(pcms[i]) != SND_PCM_STATE_PREPARED)
+            ALSA_CHECK(pcm_config_reprepare(pcms[i]));
+    }
+    ALSA_CHECK(queue_silence(playback, prefill, params));
+    ALSA_CHECK(snd_pcm_start(capture));
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr, "Usage: %s [-C device] [-P periods] [-v] [-i ms] [-D device] [-f format] [-c count] [-B us] [-F us] [-A frames] [-N]\n", progname);
+    fprintf(stderr, "  -C device  Capture device (default the same as -D)\n");
+    fprintf(stderr, "  -P periods Periods of silence queued on playback at start (default 1)\n");
+    fprintf(stderr, "  -v         Log every wakeup and copy\n");
+    fprintf(stderr, "  -i ms      Print stats every ms milliseconds (they are also printed on SIGUSR1)\n");
+    pcm_config_usage(stderr);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *capture_device = NULL;
+    unsigned int prefill_periods = 1;
+    unsigned int stats_interval_ms = 0;
+    struct pcm_config config = {0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "C:P:vi:" PCM_CONFIG_OPTSTRING)) != -1) {
+        if (pcm_config_parse_option(&config, opt, optarg))
+            continue;
+
+        switch (opt) {
+            case 'C':
+                capture_device = optarg;
+                break;
+            case 'P':
+                prefill_periods = pcm_config_parse_number(opt, optarg, UINT_MAX);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'i':
+                stats_interval_ms = pcm_config_parse_number(opt, optarg, UINT_MAX);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (config.start_threshold)
+        errx(1, "-S doesn't apply, the streams are started together once playback is primed");
+
+    int errval;
+    struct pcm_config capture_config = config;
+    if (capture_device)
+        capture_config.device = capture_device;
+
+    snd_pcm_t *playback = open_pcm(SND_PCM_STREAM_PLAYBACK, &config);
+    snd_pcm_t *capture = open_pcm(SND_PCM_STREAM_CAPTURE, &capture_config);
+
+    const struct duplex_params params = get_params(playback);
+    const struct duplex_params capture_params = get_params(capture);
+    if (capture_params.format != params.format || capture_params.channels != params.channels
+            || capture_params.rate != params.rate || capture_params.period_size != params.period_size)
+        errx(1, "Capture negotiated %s, %u channels, %u Hz, %lu frame periods, which doesn't match playback",
+                snd_pcm_format_name(capture_params.format), capture_params.channels,
+                capture_params.rate, capture_params.period_size);
+
+    // Playback needs room for a captured period on top of the prefill.
+    snd_pcm_uframes_t prefill = prefill_periods * params.period_size;
+    if (prefill + params.period_size > params.buffer_size)
+        errx(1, "-P %u leaves less than a period of the %lu frame playback buffer free", prefill_periods, params.buffer_size);
+
+    if ((errval = snd_pcm_link(capture, playback)) < 0)
+        errx(1, "snd_pcm_link: %s (linked devices usually need to be on the same card)", snd_strerror(errval));
+
+    const size_t frame_bytes = snd_pcm_frames_to_bytes(playback, 1);
+    printf("Round trip about %lu frames (%.1f ms)\n",
+            prefill + params.period_size, 1000.0 * (prefill + params.period_size) / params.rate);
+
+    struct event_loop loop;
+    event_loop_init(&loop);
+    struct playback_stats stats;
+    stats_init(&stats, params.rate);
+    stats_watch(&stats, &loop, stats_interval_ms);
+
+    // Capture filling a period is our clock, and playback is serviced in the
+    // same wakeup, so only the capture descriptors are waited on.
+    struct event_source *capture_source = event_loop_add_pcm(&loop, capture, NULL);
+
+    start_linked(capture, playback, prefill, &params);
+
+    for(;;) {
+        struct event_source *ready[3];
+        size_t ready_count = event_loop_wait(&loop, ready, 3, -1);
+
+        unsigned short revents = 0;
+        for (size_t i = 0; i < ready_count; ++i) {
+            if (ready[i] == capture_source)
+                revents = capture_source->revents;
+            else
+                stats_handle_event(&stats, ready[i]);
+        }
+        if (!(revents & (POLLIN | POLLERR)))
+            continue;
+
+        struct timespec woken;
+        clock_gettime(CLOCK_MONOTONIC, &woken);
+        stats_add(&stats.wakeups, 1);
+
+        snd_pcm_sframes_t captured = snd_pcm_avail_update(capture);
+        snd_pcm_sframes_t room = snd_pcm_avail_update(playback);
+        snd_pcm_sframes_t copied = captured < 0 ? captured : room;
+        if (captured >= 0 && room >= 0) {
+            // Capture delay is what's waiting to be read, so the two add up to
+            // the round trip.
+            snd_pcm_sframes_t capture_delay, playback_delay;
+            if (snd_pcm_delay(capture, &capture_delay) == 0 && snd_pcm_delay(playback, &playback_delay) == 0)
+                stats_record_delay(&stats, capture_delay + playback_delay);
+
+            copied = copy_available(capture, playback, captured < room ? captured : room, frame_bytes);
+            VERBOSE("captured %ld, room %ld, copied %ld\n", captured, room, copied);
+        }
+
+        if (copied < 0) {
+            if (copied != -EPIPE && copied != -ESTRPIPE)
+                errx(1, "Duplex copy: %s", snd_strerror(copied));
+            stats_add(&stats.xruns, 1);
+            printf("Xrun, restarting both streams.\n");
+            start_linked(capture, playback, prefill, &params);
+            continue;
+        }
+
+        stats_record_latency(&stats, &woken);
+        stats_add(&stats.frames_written, copied);
+        if (copied < captured)
+            stats_add(&stats.short_writes, 1);
+    }
+
+    // Cleanup (though this loop runs indefinitely)
+    event_loop_close(&loop);
+    snd_pcm_unlink(capture);
+    snd_pcm_close(capture);
+    snd_pcm_close(playback);
+
+    return 0;
+}
@@ -0,0 +1,264 @@
+#include "effects.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LANES EFFECT_LANES
+
+typedef float vfloat __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t vint __attribute__((vector_size(LANES * sizeof(int32_t))));
+typedef uint32_t vuint __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+#define MAX_PARAMS 3
+
+enum biquad_shape {
+    LOWPASS,
+    HIGHPASS,
+    PEAK,
+    LOWSHELF,
+    HIGHSHELF,
+};
+
+static const struct {
+    const char *name;
+    enum effect_type type;
+    enum biquad_shape shape;
+    // How many parameters there must be, and may be.
+    size_t min_params, max_params;
+} effect_names[] = {
+    { "lowpass", EFFECT_BIQUAD, LOWPASS, 1, 2 },
+    { "highpass", EFFECT_BIQUAD, HIGHPASS, 1, 2 },
+    { "peak", EFFECT_BIQUAD, PEAK, 2, 3 },
+    { "lowshelf", EFFECT_BIQUAD, LOWSHELF, 2, 3 },
+    { "highshelf", EFFECT_BIQUAD, HIGHSHELF, 2, 3 },
+    { "limit", EFFECT_LIMITER, 0, 1, 2 },
+    { "dither", EFFECT_DITHER, 0, 0, 0 },
+};
+
+void effect_chain_usage(FILE *out) {
+    fprintf(out, "Effects, applied in the order given:\n");
+    fprintf(out, "  lowpass:hz[:q] highpass:hz[:q]     Second order filters\n");
+    fprintf(out, "  peak:hz:db[:q] lowshelf:hz:db[:q] highshelf:hz:db[:q]\n");
+    fprintf(out, "                                     EQ, q defaulting to 0.707\n");
+    fprintf(out, "  limit:db[:release_ms]              Peak limiter at db below full scale (release 50ms)\n");
+    fprintf(out, "  dither                             TPDF dither at the output format's LSB\n");
+}
+
+// Coefficients from the RBJ audio EQ cookbook.
+static struct biquad biquad_design(enum biquad_shape shape, double frequency, double db, double q, unsigned int rate) {
+    double w0 = 2 * M_PI * frequency / rate;
+    double cosw = cos(w0);
+    double alpha = sin(w0) / (2 * q);
+    double a = pow(10, db / 40);
+    double sqrt_a_alpha = 2 * sqrt(a) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+
+    switch (shape) {
+        case LOWPASS:
+            b0 = b2 = (1 - cosw) / 2;
+            b1 = 1 - cosw;
+            a0 = 1 + alpha;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha;
+            break;
+        case HIGHPASS:
+            b0 = b2 = (1 + cosw) / 2;
+            b1 = -(1 + cosw);
+            a0 = 1 + alpha;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha;
+            break;
+        case PEAK:
+            b0 = 1 + alpha * a;
+            b1 = -2 * cosw;
+            b2 = 1 - alpha * a;
+            a0 = 1 + alpha / a;
+            a1 = -2 * cosw;
+            a2 = 1 - alpha / a;
+            break;
+        case LOWSHELF:
+            b0 = a * ((a + 1) - (a - 1) * cosw + sqrt_a_alpha);
+            b1 = 2 * a * ((a - 1) - (a + 1) * cosw);
+            b2 = a * ((a + 1) - (a - 1) * cosw - sqrt_a_alpha);
+            a0 = (a + 1) + (a - 1) * cosw + sqrt_a_alpha;
+            a1 = -2 * ((a - 1) + (a + 1) * cosw);
+            a2 = (a + 1) + (a - 1) * cosw - sqrt_a_alpha;
+            break;
+        case HIGHSHELF:
+        default:
+            b0 = a * ((a + 1) + (a - 1) * cosw + sqrt_a_alpha);
+            b1 = -2 * a * ((a - 1) + (a + 1) * cosw);
+            b2 = a * ((a + 1) + (a - 1) * cosw - sqrt_a_alpha);
+            a0 = (a + 1) - (a - 1) * cosw + sqrt_a_alpha;
+            a1 = 2 * ((a - 1) - (a + 1) * cosw);
+            a2 = (a + 1) - (a - 1) * cosw - sqrt_a_alpha;
+            break;
+    }
+
+    return (struct biquad){
+        .b0 = b0 / a0, .b1 = b1 / a0, .b2 = b2 / a0,
+        .a1 = a1 / a0, .a2 = a2 / a0,
+    };
+}
+
+void effect_chain_add(struct effect_chain *chain, const char *spec, unsigned int rate, snd_pcm_format_t format) {
+    if (chain->count == EFFECT_CHAIN_MAX)
+        errx(1, "At most %d effects are supported", EFFECT_CHAIN_MAX);
+
+    size_t name_length = strcspn(spec, ":");
+    size_t i = 0;
+    while (i < sizeof(effect_names) / sizeof(*effect_names)
+            && (strlen(effect_names[i].name) != name_length || strncmp(effect_names[i].name, spec, name_length) != 0))
+        ++i;
+    if (i == sizeof(effect_names) / sizeof(*effect_names))
+        errx(1, "Unknown effect '%s'", spec);
+
+    double params[MAX_PARAMS];
+    size_t count = 0;
+    for (const char *p = spec + name_length; *p == ':'; ) {
+        char *end;
+        if (count == effect_names[i].max_params)
+            errx(1, "%s: too many parameters", spec);
+        params[count++] = strtod(p + 1, &end);
+        if (end == p + 1 || (*end != ':' && *end != '\0'))
+            errx(1, "%s: invalid parameter", spec);
+        p = end;
+    }
+    if (count < effect_names[i].min_params)
+        errx(1, "%s: too few parameters", spec);
+
+    struct effect *effect = &chain->effects[chain->count++];
+    memset(effect, 0, sizeof(*effect));
+    effect->type = effect_names[i].type;
+    switch (effect->type) {
+        case EFFECT_BIQUAD: {
+            // Filters only have a frequency and q, EQ has a gain before q.
+            enum biquad_shape shape = effect_names[i].shape;
+            bool has_gain = shape != LOWPASS && shape != HIGHPASS;
+            double frequency = params[0];
+            double db = has_gain ? params[1] : 0.0;
+            double q = count > 1 + (size_t)has_gain ? params[1 + has_gain] : M_SQRT1_2;
+            if (frequency <= 0 || frequency >= rate / 2.0 || q <= 0)
+                errx(1, "%s: frequency must be below %u Hz, and q positive", spec, rate / 2);
+            effect->biquad = biquad_design(shape, frequency, db, q, rate);
+            break;
+        }
+        case EFFECT_LIMITER: {
+            double release_ms = count > 1 ? params[1] : 50.0;
+            if (release_ms <= 0)
+                errx(1, "%s: release must be positive", spec);
+            effect->limiter = (struct limiter){
+                .threshold = pow(10, -fabs(params[0]) / 20),
+                .release = 1 - exp(-LANES / (rate * release_ms / 1000)),
+                .gain = 1.0f,
+            };
+            break;
+        }
+        case EFFECT_DITHER: {
+            if (snd_pcm_format_float(format) == 1)
+                errx(1, "dither is only for integer formats, not %s", snd_pcm_format_name(format));
+            effect->dither.lsb = ldexp(1.0, 1 - snd_pcm_format_width(format));
+            for (int lane = 0; lane < LANES; ++lane)
+                effect->dither.state[lane] = 0x9e3779b9u * (lane + 1);
+            break;
+        }
+    }
+}
+
+// Up to LANES samples of buffer, zero padded.  (Vectors are passed by pointer,
+// as passing them by value depends on the target's ABI.)
+static inline __attribute__((always_inline)) void load(vfloat *x, const float *buffer, size_t n) {
+    *x = (vfloat){0};
+    memcpy(x, buffer, n * sizeof(float));
+}
+
+static inline __attribute__((always_inline)) void biquad_process(struct biquad *f, float *buffer, size_t frames) {
+    float z1 = f->z1, z2 = f->z2;
+    for (size_t i = 0; i < frames; ++i) {
+        float x = buffer[i];
+        float y = f->b0 * x + z1;
+        z1 = f->b1 * x - f->a1 * y + z2;
+        z2 = f->b2 * x - f->a2 * y;
+        buffer[i] = y;
+    }
+    f->z1 = z1;
+    f->z2 = z2;
+}
+
+// Attack is instant, at the granularity of LANES samples: each vector gets a
+// gain that keeps its peak at the threshold.
+static inline __attribute__((always_inline)) void limiter_process(struct limiter *l, float *buffer, size_t frames) {
+    const vint abs_mask = (vint){0} + INT32_MAX;
+    float gain = l->gain;
+    for (size_t i = 0; i < frames; i += LANES) {
+        size_t n = frames - i < LANES ? frames - i : LANES;
+        vfloat x;
+        load(&x, buffer + i, n);
+
+        vfloat a = (vfloat)((vint)x & abs_mask);
+        float peak = 0.0f;
+        for (int lane = 0; lane < LANES; ++lane)
+            peak = a[lane] > peak ? a[lane] : peak;
+
+        gain += (1.0f - gain) * l->release;
+        if (peak * gain > l->threshold)
+            gain = l->threshold / peak;
+
+        x *= gain;
+        memcpy(buffer + i, &x, n * sizeof(float));
+    }
+    l->gain = gain;
+}
+
+static inline __attribute__((always_inline)) void xorshift(vuint *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+}
+
+// Triangular noise of +-1 LSB, from the difference of two uniform draws.
+static inline __attribute__((always_inline)) void dither_process(struct dither *d, float *buffer, size_t frames) {
+    const float scale = d->lsb / 16777216.0f;
+    vuint state;
+    memcpy(&state, d->state, sizeof(state));
+    for (size_t i = 0; i < frames; i += LANES) {
+        size_t n = frames - i < LANES ? frames - i : LANES;
+        vfloat x;
+        load(&x, buffer + i, n);
+
+        xorshift(&state);
+        vuint r1 = state;
+        xorshift(&state);
+        vint difference = (vint)(r1 >> 8) - (vint)(state >> 8);
+        x += __builtin_convertvector(difference, vfloat) * scale;
+
+        memcpy(buffer + i, &x, n * sizeof(float));
+    }
+    memcpy(d->state, &state, sizeof(state));
+}
+
+SIMD_CLONES
+void effect_chain_process(struct effect_chain *chain, float *buffer, size_t frames) {
+    for (size_t i = 0; i < chain->count; ++i) {
+        struct effect *effect = &chain->effects[i];
+        switch (effect->type) {
+            case EFFECT_BIQUAD:
+                biquad_process(&effect->biquad, buffer, frames);
+                break;
+            case EFFECT_LIMITER:
+                limiter_process(&effect->limiter, buffer, frames);
+                break;
+            case EFFECT_DITHER:
+                dither_process(&effect->dither, buffer, frames);
+                break;
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+#include <alsa/asoundlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A chain of effects run over each block of the mono signal, in order, just
+// before it's converted into the device's buffer (in mmap mode, straight into
+// the mmap area between snd_pcm_mmap_begin and commit).  Stages are given on
+// the command line as name:param:...
+//
+//   lowpass:hz[:q] highpass:hz[:q]    Second order filters
+//   peak:hz:db[:q] lowshelf:hz:db[:q] highshelf:hz:db[:q]
+//                                     RBJ cookbook EQ (q defaults to 0.707)
+//   limit:db[:release_ms]             Peak limiter at db below full scale
+//   dither                            TPDF dither at the output format's LSB
+//
+// The limiter and dither work LANES samples at a time with vector kernels.
+// Biquads are recursive, so run a sample at a time, but over a whole block with
+// the state held in registers.
+
+#define EFFECT_CHAIN_MAX 8
+#define EFFECT_LANES 8
+
+enum effect_type {
+    EFFECT_BIQUAD,
+    EFFECT_LIMITER,
+    EFFECT_DITHER,
+};
+
+struct biquad {
+    // Normalised so a0 is 1.
+    float b0, b1, b2, a1, a2;
+    // Transposed direct form II state.
+    float z1, z2;
+};
+
+struct limiter {
+    float threshold;
+    // Per LANES samples, how far the gain recovers towards 1.
+    float release;
+    float gain;
+};
+
+struct dither {
+    // One LSB of the output format, in [-1, 1] full scale.
+    float lsb;
+    // A xorshift generator per lane.
+    uint32_t state[EFFECT_LANES];
+};
+
+struct effect {
+    enum effect_type type;
+    union {
+        struct biquad biquad;
+        struct limiter limiter;
+        struct dither dither;
+    };
+};
+
+struct effect_chain {
+    struct effect effects[EFFECT_CHAIN_MAX];
+    size_t count;
+};
+
+// Append the effect spec describes to chain, for a stream at rate in format.
+// Exits on a malformed spec, or dither for a float format.
+void effect_chain_add(struct effect_chain *chain, const char *spec, unsigned int rate, snd_pcm_format_t format);
+// Run every stage over buffer in place.
+void effect_chain_process(struct effect_chain *chain, float *buffer, size_t frames);
+void effect_chain_usage(FILE *out);
+
+#endif
@@ -0,0 +1,162 @@
+#include "event_loop.h"
+
+#include <err.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define ALSA_CHECK(x) if ( (errval = (x)) < 0 ) errx(1, #x ": %s", snd_strerror(errval))
+
+#define EVENT_LOOP_MAX_EVENTS 64
+
+// What each registered descriptor's epoll data points to.
+struct event_fd {
+    struct event_source *source;
+    size_t index;
+};
+
+void event_loop_init(struct event_loop *loop) {
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1)
+        err(1, "epoll_create1");
+    loop->sources = NULL;
+}
+
+// A plain descriptor belongs to its source, a PCM's to ALSA.
+static void free_source(struct event_source *source) {
+    if (!source->pcm)
+        close(source->fds[0].fd);
+    free(source);
+}
+
+void event_loop_close(struct event_loop *loop) {
+    while (loop->sources) {
+        struct event_source *source = loop->sources;
+        loop->sources = source->next;
+        free_source(source);
+    }
+    close(loop->epoll_fd);
+}
+
+// Allocate a source with room for fd_count descriptors, which the caller fills
+// in before calling register_source.
+static struct event_source *alloc_source(struct event_loop *loop, size_t fd_count, void *user_data) {
+    struct event_source *source = calloc(1, sizeof(*source)
+            + fd_count * sizeof(struct pollfd)
+            + fd_count * sizeof(struct event_fd));
+    if (!source)
+        err(1, "calloc");
+
+    source->user_data = user_data;
+    source->fd_count = fd_count;
+    source->fds = (struct pollfd *)(source + 1);
+    source->entries = (struct event_fd *)(source->fds + fd_count);
+    source->next = loop->sources;
+    loop->sources = source;
+    return source;
+}
+
+static void register_source(struct event_loop *loop, struct event_source *source) {
+    for (size_t i = 0; i < source->fd_count; ++i) {
+        source->entries[i].source = source;
+        source->entries[i].index = i;
+
+        // poll and epoll share the same values for IN/OUT/ERR.
+        struct epoll_event event = {
+            .events = source->fds[i].events,
+            .data.ptr = &source->entries[i],
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, source->fds[i].fd, &event) == -1)
+            err(1, "epoll_ctl(%d)", source->fds[i].fd);
+    }
+}
+
+struct event_source *event_loop_add_pcm(struct event_loop *loop, snd_pcm_t *pcm_handle, void *user_data) {
+    int errval;
+    int fd_count = snd_pcm_poll_descriptors_count(pcm_handle);
+    ALSA_CHECK(fd_count);
+
+    struct event_source *source = alloc_source(loop, fd_count, user_data);
+    source->pcm = pcm_handle;
+    ALSA_CHECK(snd_pcm_poll_descriptors(pcm_handle, source->fds, fd_count));
+
+    register_source(loop, source);
+    return source;
+}
+
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd, short events, void *user_data) {
+    struct event_source *source = alloc_source(loop, 1, user_data);
+    source->fds[0].fd = fd;
+    source->fds[0].events = events;
+
+    register_source(loop, source);
+    return source;
+}
+
+void event_loop_remove(struct event_loop *loop, struct event_source *source) {
+    for (size_t i = 0; i < source->fd_count; ++i) {
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fds[i].fd, NULL) == -1)
+            err(1, "epoll_ctl(%d)", source->fds[i].fd);
+    }
+
+    struct event_source **link = &loop->sources;
+    while (*link != source)
+        link = &(*link)->next;
+    *link = source->next;
+    free_source(source);
+}
+
+size_t event_loop_wait(struct event_loop *loop, struct event_source **ready, size_t max_ready, int timeout_ms) {
+    int errval;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    int count = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+    if (count == -1) {
+        // Check for EINTR, which can happen if a signal is caught
+        if (errno == EINTR)
+            return 0;
+        err(1, "epoll_wait");
+    }
+
+    // A PCM may have several descriptors, so gather the events for all of them
+    // before asking ALSA what they mean.
+    size_t ready_count = 0;
+    for (int i = 0; i < count; ++i) {
+        struct event_fd *entry = events[i].data.ptr;
+        struct event_source *source = entry->source;
+
+        if (!source->pending) {
+            // Anything we don't have room for is level triggered, so will be
+            // reported again next time.
+            if (ready_count == max_ready)
+                continue;
+            for (size_t j = 0; j < source->fd_count; ++j)
+                source->fds[j].revents = 0;
+            source->pending = true;
+            ready[ready_count++] = source;
+        }
+
+        source->fds[entry->index].revents = events[i].events;
+    }
+
+    for (size_t i = 0; i < ready_count; ++i) {
+        struct event_source *source = ready[i];
+        source->pending = false;
+
+        if (source->pcm) {
+            uint64_t start = trace_begin();
+            ALSA_CHECK(snd_pcm_poll_descriptors_revents(
+                        source->pcm,
+                        source->fds,
+                        source->fd_count,
+                        &source->revents));
+            trace_end(TRACE_REVENTS, start, 0);
+        } else {
+            source->revents = source->fds[0].revents;
+        }
+    }
+
+    return ready_count;
+}
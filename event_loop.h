@@ -0,0 +1,51 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <alsa/asoundlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// An epoll based event loop that can multiplex any number of PCMs and plain
+// file descriptors.  Descriptors are registered once when a source is added,
+// rather than being rebuilt on every wakeup as with select().
+
+struct event_fd;
+
+struct event_source {
+    snd_pcm_t *pcm; // NULL for a plain file descriptor
+    void *user_data;
+
+    // After event_loop_wait, the events that are ready.  For PCMs these have
+    // already been through snd_pcm_poll_descriptors_revents, so POLLOUT means
+    // ALSA is ready for writing even if it's waiting on POLLIN of a status pipe.
+    unsigned short revents;
+
+    size_t fd_count;
+    struct pollfd *fds;
+    struct event_fd *entries;
+    bool pending;
+    struct event_source *next;
+};
+
+struct event_loop {
+    int epoll_fd;
+    struct event_source *sources;
+};
+
+void event_loop_init(struct event_loop *loop);
+void event_loop_close(struct event_loop *loop);
+
+struct event_source *event_loop_add_pcm(struct event_loop *loop, snd_pcm_t *pcm_handle, void *user_data);
+// The source takes ownership of fd, which is closed when it's removed, or when
+// the loop is closed.
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd, short events, void *user_data);
+// Unregister and free source (closing it if it's a plain descriptor), which
+// must be done before closing its PCM.
+void event_loop_remove(struct event_loop *loop, struct event_source *source);
+
+// Wait up to timeout_ms (-1 for forever) for sources to become ready, storing
+// up to max_ready of them in ready and returning how many there were.  Returns
+// 0 if interrupted by a signal.
+size_t event_loop_wait(struct event_loop *loop, struct event_source **ready, size_t max_ready, int timeout_ms);
+
+#endif
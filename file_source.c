@@ -0,0 +1,311 @@
+#include "file_source.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// How far ahead of what's playing a mapped file's pages are asked for.
+#define MAP_WINDOW (1 << 20)
+
+#define WAV_FORMAT_PCM 1
+#define WAV_FORMAT_FLOAT 3
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+static uint16_t get_u16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Read up to n bytes of the header into buf, returning how many there were.
+static size_t read_header(struct file_source *source, void *buf, size_t n) {
+    if (source->map) {
+        if (n > source->map_length - source->position)
+            n = source->map_length - source->position;
+        memcpy(buf, source->map + source->position, n);
+        source->position += n;
+        return n;
+    }
+
+    size_t done = 0;
+    while (done < n) {
+        ssize_t ret = read(source->fd, (uint8_t *)buf + done, n - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            err(1, "read");
+        if (ret == 0)
+            break;
+        done += ret;
+    }
+    return done;
+}
+
+static void skip_header(struct file_source *source, size_t n) {
+    uint8_t discard[256];
+    while (n > 0) {
+        size_t chunk = n < sizeof(discard) ? n : sizeof(discard);
+        if (read_header(source, discard, chunk) != chunk)
+            errx(1, "WAV file ends in its header");
+        n -= chunk;
+    }
+}
+
+static snd_pcm_format_t wav_format(unsigned int tag, unsigned int bits, unsigned int bytes) {
+    if (tag == WAV_FORMAT_FLOAT && bits == 32)
+        return SND_PCM_FORMAT_FLOAT_LE;
+    if (tag != WAV_FORMAT_PCM)
+        return SND_PCM_FORMAT_UNKNOWN;
+    if (bits == 16)
+        return SND_PCM_FORMAT_S16_LE;
+    if (bits == 24 && bytes == 3)
+        return SND_PCM_FORMAT_S24_3LE;
+    if (bits == 32)
+        return SND_PCM_FORMAT_S32_LE;
+    return SND_PCM_FORMAT_UNKNOWN;
+}
+
+// Parse the chunks after "RIFF....WAVE", up to the start of the data.  Returns
+// the length of the data, or SIZE_MAX if the header doesn't say, as when it's
+// been streamed.
+static size_t parse_wav(struct file_source *source) {
+    uint8_t chunk[8];
+    bool have_format = false;
+
+    for (;;) {
+        if (read_header(source, chunk, sizeof(chunk)) != sizeof(chunk))
+            errx(1, "WAV file has no data");
+        uint32_t size = get_u32(chunk + 4);
+
+        if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_format)
+                errx(1, "WAV file has no format before its data");
+            return size == 0 || size == UINT32_MAX ? SIZE_MAX : size;
+        }
+        if (memcmp(chunk, "fmt ", 4) != 0) {
+            skip_header(source, size + (size & 1));
+            continue;
+        }
+
+        uint8_t fmt[40] = {0};
+        size_t length = size < sizeof(fmt) ? size : sizeof(fmt);
+        if (size < 16 || read_header(source, fmt, length) != length)
+            errx(1, "WAV file has a truncated format");
+        skip_header(source, size - length + (size & 1));
+
+        unsigned int tag = get_u16(fmt);
+        // The real format is the first two bytes of the extensible format's GUID.
+        if (tag == WAV_FORMAT_EXTENSIBLE && size >= 26)
+            tag = get_u16(fmt + 24);
+        source->channels = get_u16(fmt + 2);
+        source->rate = get_u32(fmt + 4);
+        unsigned int block_align = get_u16(fmt + 12);
+        unsigned int bits = get_u16(fmt + 14);
+        source->format = source->channels ? wav_format(tag, bits, block_align / source->channels) : SND_PCM_FORMAT_UNKNOWN;
+        if (source->format == SND_PCM_FORMAT_UNKNOWN)
+            errx(1, "Unsupported WAV format %#x with %u bit samples", tag, bits);
+        have_format = true;
+    }
+}
+
+static void unlock(void *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+// Wait for buffer i to have been played, and return the length of what's
+// already in it: only non-zero for the first, which may start with what was
+// read looking for a header.
+static size_t wait_for_empty(struct read_ahead *ra, size_t i) {
+    size_t length;
+    // Closing cancels the thread, perhaps while it's waiting here.
+    pthread_mutex_lock(&ra->lock);
+    pthread_cleanup_push(unlock, &ra->lock);
+    while (ra->full[i])
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    length = ra->lengths[i];
+    pthread_cleanup_pop(1);
+    return length;
+}
+
+static void *read_ahead_thread(void *arg) {
+    struct file_source *source = arg;
+    struct read_ahead *ra = &source->read_ahead;
+    const size_t capacity = FILE_SOURCE_READ_AHEAD * source->frame_bytes;
+
+    for (size_t i = 0; ; i ^= 1) {
+        size_t length = wait_for_empty(ra, i);
+        bool eof = false;
+        while (length < capacity && !eof) {
+            size_t want = capacity - length;
+            if (want > source->data_end - source->position)
+                want = source->data_end - source->position;
+            ssize_t ret = want ? read(source->fd, ra->buffers[i] + length, want) : 0;
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                err(1, "read");
+            eof = ret == 0;
+            length += ret;
+            source->position += ret;
+        }
+        // A partial frame at the end is dropped.
+        length -= length % source->frame_bytes;
+
+        pthread_mutex_lock(&ra->lock);
+        ra->lengths[i] = length;
+        ra->full[i] = true;
+        ra->eof = eof;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        if (eof)
+            return NULL;
+    }
+}
+
+// Start reading ahead, with the first buffer starting with the prefix_length
+// bytes already read from prefix.
+static void start_read_ahead(struct file_source *source, const void *prefix, size_t prefix_length) {
+    struct read_ahead *ra = &source->read_ahead;
+    memset(ra, 0, sizeof(*ra));
+    for (size_t i = 0; i < 2; ++i) {
+        ra->buffers[i] = malloc(FILE_SOURCE_READ_AHEAD * source->frame_bytes);
+        if (!ra->buffers[i])
+            err(1, "malloc");
+    }
+    memcpy(ra->buffers[0], prefix, prefix_length);
+    ra->lengths[0] = prefix_length;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    errno = pthread_create(&ra->thread, NULL, read_ahead_thread, source);
+    if (errno != 0)
+        err(1, "pthread_create");
+}
+
+void file_source_open(struct file_source *source, const char *path, snd_pcm_format_t format, unsigned int channels, unsigned int rate) {
+    memset(source, 0, sizeof(*source));
+    source->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (source->fd == -1)
+        err(1, "%s", path);
+
+    struct stat st;
+    if (fstat(source->fd, &st) == -1)
+        err(1, "fstat %s", path);
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        source->map_length = st.st_size;
+        void *map = mmap(NULL, source->map_length, PROT_READ, MAP_SHARED, source->fd, 0);
+        if (map == MAP_FAILED)
+            err(1, "mmap %s", path);
+        // Played front to back, once, so pages can be read well ahead and
+        // dropped soon after.
+        if (madvise(map, source->map_length, MADV_SEQUENTIAL) == -1)
+            warn("madvise");
+        source->map = map;
+    }
+
+    uint8_t riff[12];
+    size_t riff_length = read_header(source, riff, sizeof(riff));
+    size_t data_length = SIZE_MAX;
+    bool wav = riff_length == sizeof(riff) && memcmp(riff, "RIFF", 4) == 0 && memcmp(riff + 8, "WAVE", 4) == 0;
+    if (wav) {
+        data_length = parse_wav(source);
+    } else {
+        source->format = format;
+        source->channels = channels;
+        source->rate = rate;
+    }
+    source->frame_bytes = snd_pcm_format_physical_width(source->format) / 8 * source->channels;
+    if (!source->frame_bytes)
+        errx(1, "%s: no channels", path);
+
+    if (source->map) {
+        // Raw data starts with what was read looking for a header.
+        if (!wav)
+            source->position = 0;
+        source->data_end = source->map_length;
+        if (data_length < source->data_end - source->position)
+            source->data_end = source->position + data_length;
+        source->advised = source->position & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    } else {
+        source->position = 0;
+        source->data_end = data_length;
+        start_read_ahead(source, riff, wav ? 0 : riff_length);
+    }
+
+    printf("Playing %s: %s, %u channels, %u Hz%s\n", path, snd_pcm_format_name(source->format),
+            source->channels, source->rate, source->map ? "" : ", read ahead");
+}
+
+void file_source_close(struct file_source *source) {
+    if (source->map) {
+        munmap((void *)source->map, source->map_length);
+    } else {
+        struct read_ahead *ra = &source->read_ahead;
+        pthread_cancel(ra->thread);
+        pthread_join(ra->thread, NULL);
+        pthread_mutex_destroy(&ra->lock);
+        pthread_cond_destroy(&ra->cond);
+        free(ra->buffers[0]);
+        free(ra->buffers[1]);
+    }
+    if (source->fd != STDIN_FILENO)
+        close(source->fd);
+}
+
+size_t file_source_peek(struct file_source *source, const void **frames, size_t max_frames) {
+    size_t available;
+
+    if (source->map) {
+        // Keep the next window on its way in, so playing doesn't wait on
+        // page faults.
+        if (source->advised < source->data_end && source->position + MAP_WINDOW > source->advised) {
+            size_t length = source->data_end - source->advised < MAP_WINDOW ? source->data_end - source->advised : MAP_WINDOW;
+            madvise((void *)(source->map + source->advised), length, MADV_WILLNEED);
+            source->advised += MAP_WINDOW;
+        }
+        available = (source->data_end - source->position) / source->frame_bytes;
+        *frames = source->map + source->position;
+    } else {
+        struct read_ahead *ra = &source->read_ahead;
+        pthread_mutex_lock(&ra->lock);
+        while (!ra->full[ra->playing] && !ra->eof)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        bool full = ra->full[ra->playing];
+        pthread_mutex_unlock(&ra->lock);
+        if (!full)
+            return 0;
+
+        available = (ra->lengths[ra->playing] - ra->offset) / source->frame_bytes;
+        *frames = ra->buffers[ra->playing] + ra->offset;
+    }
+
+    return available < max_frames ? available : max_frames;
+}
+
+void file_source_consume(struct file_source *source, size_t count) {
+    size_t bytes = count * source->frame_bytes;
+    if (source->map) {
+        source->position += bytes;
+        return;
+    }
+
+    struct read_ahead *ra = &source->read_ahead;
+    ra->offset += bytes;
+    if (ra->offset < ra->lengths[ra->playing])
+        return;
+
+    // Played all of it, so hand it back to be refilled.
+    pthread_mutex_lock(&ra->lock);
+    ra->full[ra->playing] = false;
+    ra->lengths[ra->playing] = 0;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    ra->playing ^= 1;
+    ra->offset = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef FILE_SOURCE_H
+#define FILE_SOURCE_H
+
+#include <alsa/asoundlib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Plays a WAV or raw PCM file, or stdin, and hands out the frames where they
+// already are, so they can be written to ALSA without being copied.
+//
+// A regular file is mmap'd and read sequentially.  Anything else (eg a pipe)
+// is read by a thread into two buffers in turn: one being filled while the
+// other is played.
+
+// Frames read ahead into each of a pipe's buffers.
+#define FILE_SOURCE_READ_AHEAD 65536
+
+struct read_ahead {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *buffers[2];
+    size_t lengths[2];
+    // Set by the thread when it has filled a buffer, and cleared once it's
+    // been played.
+    bool full[2];
+    // Set by the thread after filling its last buffer.
+    bool eof;
+    // The buffer being played, and how far into it.
+    size_t playing;
+    size_t offset;
+};
+
+struct file_source {
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int rate;
+    size_t frame_bytes;
+
+    int fd;
+    // Non-NULL for a mapped file, with what's left to play from position to
+    // data_end, and pages up to advised asked to be read ahead.
+    const uint8_t *map;
+    size_t map_length;
+    size_t position, data_end;
+    size_t advised;
+
+    // Otherwise read by a thread, which keeps position and data_end to itself
+    // (data_end being SIZE_MAX if the header doesn't say).
+    struct read_ahead read_ahead;
+};
+
+// Open path, or stdin for "-".  A WAV file's header gives its format; anything
+// else is taken to be raw PCM in format, with channels channels at rate.
+// Exits on error.
+void file_source_open(struct file_source *source, const char *path, snd_pcm_format_t format, unsigned int channels, unsigned int rate);
+void file_source_close(struct file_source *source);
+
+// Point *frames at up to max_frames frames of what's to be played next, and
+// return how many there are, blocking until the read ahead thread has some.
+// Returns zero at the end of the file.  They remain valid until consumed.
+size_t file_source_peek(struct file_source *source, const void **frames, size_t max_frames);
+// Mark count of the frames from the last peek as played.
+void file_source_consume(struct file_source *source, size_t count);
+
+#endif
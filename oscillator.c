@@ -0,0 +1,83 @@
+#include "oscillator.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LANES 8
+
+typedef float vfloat __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t vint __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+SIMD_CLONES
+void sine_fill(float *buffer, size_t buffer_size, double phase, double increment) {
+    const vint sign_bit = (vint){0} + INT32_MIN;
+    vfloat lane_offset;
+    for (int lane = 0; lane < LANES; ++lane)
+        lane_offset[lane] = lane * increment - floor(lane * increment);
+
+    size_t idx = 0;
+    for (; idx < buffer_size; idx += LANES) {
+        // The start of each vector is computed in double precision, so error
+        // doesn't accumulate across the buffer.
+        double start = phase + idx * increment;
+        start -= floor(start + 0.5);
+
+        vfloat x = (float)start + lane_offset;
+        // start + lane_offset >= -0.5, so truncation is floor here.
+        x -= __builtin_convertvector(__builtin_convertvector(x + 0.5f, vint), vfloat);
+
+        // Fold into b in [0, 0.25] using
+        // sin(2*pi*x) = sign(x) * sin(2*pi*min(|x|, 0.5 - |x|)).
+        vint sign = (vint)x & sign_bit;
+        vfloat a = (vfloat)((vint)x & ~sign_bit);
+        vint upper = a > 0.25f;
+        vfloat b = (vfloat)(((vint)a & ~upper) | ((vint)(0.5f - a) & upper));
+
+        // Taylor series to theta^11, truncation error < 6e-8 over [0, pi/2].
+        vfloat theta = b * (float)(2.0 * M_PI);
+        vfloat t2 = theta * theta;
+        vfloat p = t2 * (-1.0f / 39916800.0f) + 1.0f / 362880.0f;
+        p = p * t2 - 1.0f / 5040.0f;
+        p = p * t2 + 1.0f / 120.0f;
+        p = p * t2 - 1.0f / 6.0f;
+        p = p * t2 + 1.0f;
+        p = p * theta;
+
+        vfloat samples = (vfloat)((vint)p ^ sign);
+        size_t remaining = buffer_size - idx;
+        memcpy(&buffer[idx], &samples, (remaining < LANES ? remaining : LANES) * sizeof(float));
+    }
+}
+
+// 2^64, for converting between cycles and the fixed point phase.
+#define PHASE_ONE 18446744073709551616.0
+
+void oscillator_init(struct oscillator *osc, double frequency, unsigned int rate, const struct wavetable *table, enum wavetable_interp interp) {
+    osc->phase = 0;
+    oscillator_set_frequency(osc, frequency, rate);
+    osc->table = table;
+    osc->interp = interp;
+}
+
+void oscillator_set_frequency(struct oscillator *osc, double frequency, unsigned int rate) {
+    double cycles = frequency / rate;
+    osc->increment = (uint64_t)((cycles - floor(cycles)) * PHASE_ONE);
+}
+
+void oscillator_fill(struct oscillator *osc, float *buffer, size_t frames) {
+    double phase = osc->phase / PHASE_ONE;
+    double increment = osc->increment / PHASE_ONE;
+
+    if (osc->table)
+        wavetable_fill(osc->table, osc->interp, buffer, frames, phase, increment);
+    else
+        sine_fill(buffer, frames, phase, increment);
+    osc->phase += osc->increment * frames;
+}
@@ -0,0 +1,35 @@
+#ifndef OSCILLATOR_H
+#define OSCILLATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wavetable.h"
+
+// Fill buffer with sin(2*pi*(phase + idx * increment)) for idx in
+// [0, buffer_size), with phase and increment measured in cycles.
+//
+// This evaluates a polynomial approximation several samples at a time, with an
+// absolute error below 1e-6 compared to sin().  On
+// x86 the widest available SIMD variant (AVX2/SSE) is picked at runtime.
+void sine_fill(float *buffer, size_t buffer_size, double phase, double increment);
+
+// A tone, with its own phase so each stream or voice can run independently.
+// The phase is a 64 bit fixed point fraction of a cycle, so it wraps exactly
+// by overflowing, and stays as precise however long it runs.
+struct oscillator {
+    uint64_t phase;
+    uint64_t increment;
+    // NULL for a sine wave from sine_fill.
+    const struct wavetable *table;
+    enum wavetable_interp interp;
+};
+
+void oscillator_init(struct oscillator *osc, double frequency, unsigned int rate, const struct wavetable *table, enum wavetable_interp interp);
+// Change the frequency from the next sample on, carrying on from the current
+// phase so there's no discontinuity.
+void oscillator_set_frequency(struct oscillator *osc, double frequency, unsigned int rate);
+// Fill buffer with the next frames samples of the tone.
+void oscillator_fill(struct oscillator *osc, float *buffer, size_t frames);
+
+#endif
@@ -0,0 +1,289 @@
+#include "pcm_config.h"
+#include "convert.h"
+
+#include <err.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALSA_CHECK(x) if ( (errval = (x)) < 0 ) errx(1, #x ": %s", snd_strerror(errval))
+
+// strtoul would take "-1" as ULONG_MAX, so a sign is rejected too.
+unsigned long pcm_config_parse_number(int opt, const char *arg, unsigned long max) {
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 0);
+    if (errno != 0 || *arg == '\0' || *end != '\0' || strchr(arg, '-'))
+        errx(1, "-%c: invalid number '%s'", opt, arg);
+    if (value > max)
+        errx(1, "-%c: %s is too large, the most is %lu", opt, arg, max);
+    return value;
+}
+
+bool pcm_config_parse_option(struct pcm_config *config, int opt, const char *arg) {
+    switch (opt) {
+        case 'D':
+            config->device = arg;
+            return true;
+        case 'f':
+            config->format = snd_pcm_format_value(arg);
+            if (!sample_converter(config->format, 1))
+                errx(1, "-f: unsupported format '%s'", arg);
+            return true;
+        case 'c':
+            config->channels = pcm_config_parse_number(opt, arg, UINT_MAX);
+            if (!sample_converter(SND_PCM_FORMAT_FLOAT_LE, config->channels))
+                errx(1, "-c: between 1 and %d channels are supported", CONVERT_MAX_CHANNELS);
+            return true;
+        case 'B':
+            config->buffer_time_us = pcm_config_parse_number(opt, arg, UINT_MAX);
+            return true;
+        case 'F':
+            config->period_time_us = pcm_config_parse_number(opt, arg, UINT_MAX);
+            return true;
+        case 'A':
+            config->avail_min = pcm_config_parse_number(opt, arg, ULONG_MAX);
+            return true;
+        case 'S':
+            config->start_threshold = pcm_config_parse_number(opt, arg, ULONG_MAX);
+            return true;
+        case 'N':
+            config->no_dump = true;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void pcm_config_usage(FILE *out) {
+    fprintf(out, "  -D device  ALSA device to open (default \"default\")\n");
+    fprintf(out, "  -f format  Sample format: FLOAT_LE, S32_LE, S24_3LE or S16_LE\n");
+    fprintf(out, "  -c count   Number of channels (1-%d)\n", CONVERT_MAX_CHANNELS);
+    fprintf(out, "  -B us      Buffer time in microseconds\n");
+    fprintf(out, "  -F us      Period time in microseconds\n");
+    fprintf(out, "  -A frames  Minimum frames available before waking up (avail_min)\n");
+    fprintf(out, "  -S frames  Frames queued before playback starts (start_threshold)\n");
+    fprintf(out, "  -N         Don't dump the PCM setup after opening\n");
+}
+
+const char *pcm_config_device(const struct pcm_config *config) {
+    return config->device ? config->device : "default";
+}
+
+// Call before snd_pcm_hw_params().
+static void apply_hw_params(snd_pcm_t *pcm_handle, snd_pcm_hw_params_t *hwparams, const struct pcm_config *config) {
+    int errval;
+
+    // Without a format, take the first one the device can do natively, so a hw:
+    // device doesn't need the plug layer to convert for it.
+    snd_pcm_format_t format = config->format;
+    for (size_t i = 0; !format && convert_formats[i] != SND_PCM_FORMAT_UNKNOWN; ++i) {
+        if (snd_pcm_hw_params_test_format(pcm_handle, hwparams, convert_formats[i]) == 0)
+            format = convert_formats[i];
+    }
+    if (!format)
+        errx(1, "Device supports none of the sample formats there are converters for");
+    ALSA_CHECK(snd_pcm_hw_params_set_format(pcm_handle, hwparams, format));
+
+    if (config->channels) {
+        ALSA_CHECK(snd_pcm_hw_params_set_channels(pcm_handle, hwparams, config->channels));
+    } else {
+        unsigned int channels = 1;
+        ALSA_CHECK(snd_pcm_hw_params_set_channels_near(pcm_handle, hwparams, &channels));
+    }
+
+    // As in aplay, the period is set first so the buffer can be rounded to a
+    // whole number of periods.
+    if (config->period_time_us) {
+        unsigned int period_time = config->period_time_us;
+        ALSA_CHECK(snd_pcm_hw_params_set_period_time_near(pcm_handle, hwparams, &period_time, NULL));
+    }
+
+    if (config->buffer_time_us) {
+        unsigned int buffer_time = config->buffer_time_us;
+        ALSA_CHECK(snd_pcm_hw_params_set_buffer_time_near(pcm_handle, hwparams, &buffer_time, NULL));
+    }
+}
+
+// Call after snd_pcm_hw_params(), as sw_params depend on the negotiated buffer.
+static void apply_sw_params(snd_pcm_t *pcm_handle, const struct pcm_config *config) {
+    int errval;
+
+    if (!config->avail_min && !config->start_threshold)
+        return;
+
+    uint8_t sw_params_raw_data[snd_pcm_sw_params_sizeof()];
+    snd_pcm_sw_params_t *swparams = (snd_pcm_sw_params_t *)sw_params_raw_data;
+
+    ALSA_CHECK(snd_pcm_sw_params_current(pcm_handle, swparams));
+    if (config->avail_min)
+        ALSA_CHECK(snd_pcm_sw_params_set_avail_min(pcm_handle, swparams, config->avail_min));
+    if (config->start_threshold)
+        ALSA_CHECK(snd_pcm_sw_params_set_start_threshold(pcm_handle, swparams, config->start_threshold));
+    ALSA_CHECK(snd_pcm_sw_params(pcm_handle, swparams));
+}
+
+// Everything but the device, which the entry keeps its own copy of.
+static bool same_request(const struct pcm_config *a, const struct pcm_config *b) {
+    return a->format == b->format
+        && a->channels == b->channels
+        && a->buffer_time_us == b->buffer_time_us
+        && a->period_time_us == b->period_time_us
+        && a->avail_min == b->avail_min
+        && a->start_threshold == b->start_threshold
+        && a->native_rate == b->native_rate;
+}
+
+static struct pcm_cache_entry *cache_find(struct pcm_cache *cache, const char *device, snd_pcm_stream_t stream, snd_pcm_access_t access, unsigned int rate, const struct pcm_config *config) {
+    for (size_t i = 0; i < PCM_CACHE_ENTRIES; ++i) {
+        struct pcm_cache_entry *entry = &cache->entries[i];
+        if (entry->device && strcmp(entry->device, device) == 0
+                && entry->stream == stream && entry->access == access && entry->rate == rate
+                && same_request(&entry->config, config))
+            return entry;
+    }
+    return NULL;
+}
+
+static void cache_evict(struct pcm_cache_entry *entry) {
+    free(entry->device);
+    entry->device = NULL;
+    snd_pcm_hw_params_free(entry->hwparams);
+    snd_pcm_sw_params_free(entry->swparams);
+}
+
+// Keep a copy of what pcm_handle has just negotiated.
+static void cache_store(struct pcm_cache *cache, snd_pcm_t *pcm_handle, const char *device, snd_pcm_stream_t stream, snd_pcm_access_t access, unsigned int rate, const struct pcm_config *config) {
+    int errval;
+    struct pcm_cache_entry *entry = NULL;
+    for (size_t i = 0; !entry && i < PCM_CACHE_ENTRIES; ++i) {
+        if (!cache->entries[i].device)
+            entry = &cache->entries[i];
+    }
+    if (!entry) {
+        entry = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % PCM_CACHE_ENTRIES;
+        cache_evict(entry);
+    }
+
+    ALSA_CHECK(snd_pcm_hw_params_malloc(&entry->hwparams));
+    ALSA_CHECK(snd_pcm_sw_params_malloc(&entry->swparams));
+    ALSA_CHECK(snd_pcm_hw_params_current(pcm_handle, entry->hwparams));
+    ALSA_CHECK(snd_pcm_sw_params_current(pcm_handle, entry->swparams));
+    entry->device = strdup(device);
+    if (!entry->device)
+        err(1, "strdup");
+    entry->stream = stream;
+    entry->access = access;
+    entry->rate = rate;
+    entry->config = *config;
+    entry->config.device = NULL;
+}
+
+// Install the parameters in entry, which are already fully refined so the
+// driver only has to check them.  Returns a negative error code if the device
+// won't take them any more (eg it's been replaced by a different one).
+static int install_cached(snd_pcm_t *pcm_handle, const struct pcm_cache_entry *entry) {
+    // Installing refines the parameters in place, so don't hand it the cached ones.
+    uint8_t hw_params_raw_data[snd_pcm_hw_params_sizeof()];
+    snd_pcm_hw_params_t *hwparams = (snd_pcm_hw_params_t *)hw_params_raw_data;
+    uint8_t sw_params_raw_data[snd_pcm_sw_params_sizeof()];
+    snd_pcm_sw_params_t *swparams = (snd_pcm_sw_params_t *)sw_params_raw_data;
+    snd_pcm_hw_params_copy(hwparams, entry->hwparams);
+    snd_pcm_sw_params_copy(swparams, entry->swparams);
+
+    int ret = snd_pcm_hw_params(pcm_handle, hwparams);
+    if (ret < 0)
+        return ret;
+    return snd_pcm_sw_params(pcm_handle, swparams);
+}
+
+snd_pcm_t *pcm_config_open(struct pcm_cache *cache, const struct pcm_config *config, snd_pcm_stream_t stream, int mode, snd_pcm_access_t access, unsigned int *rate) {
+    int errval;
+    const char *device = pcm_config_device(config);
+    const unsigned int requested_rate = *rate;
+    snd_pcm_t *pcm_handle;
+
+    ALSA_CHECK(snd_pcm_open(&pcm_handle, device, stream, mode));
+
+    struct pcm_cache_entry *entry = cache ? cache_find(cache, device, stream, access, requested_rate, config) : NULL;
+    if (entry && (errval = install_cached(pcm_handle, entry)) < 0) {
+        printf("Cached parameters for %s no longer apply (%s), negotiating again\n", device, snd_strerror(errval));
+        cache_evict(entry);
+        entry = NULL;
+    }
+
+    uint8_t hw_params_raw_data[snd_pcm_hw_params_sizeof()];
+    snd_pcm_hw_params_t *hwparams = (snd_pcm_hw_params_t *)hw_params_raw_data;
+    if (entry) {
+        printf("Using cached parameters for %s\n", device);
+        ALSA_CHECK(snd_pcm_hw_params_current(pcm_handle, hwparams));
+    } else {
+        ALSA_CHECK(snd_pcm_hw_params_any(pcm_handle, hwparams));
+        ALSA_CHECK(snd_pcm_hw_params_set_access(pcm_handle, hwparams, access));
+        if (config->native_rate)
+            ALSA_CHECK(snd_pcm_hw_params_set_rate_resample(pcm_handle, hwparams, 0));
+        ALSA_CHECK(snd_pcm_hw_params_set_rate_near(pcm_handle, hwparams, rate, NULL));
+        apply_hw_params(pcm_handle, hwparams, config);
+        ALSA_CHECK(snd_pcm_hw_params(pcm_handle, hwparams));
+        apply_sw_params(pcm_handle, config);
+        if (cache)
+            cache_store(cache, pcm_handle, device, stream, access, requested_rate, config);
+    }
+    ALSA_CHECK(snd_pcm_hw_params_get_rate(hwparams, rate, NULL));
+
+    pcm_config_print(pcm_handle);
+    if (!config->no_dump) {
+        snd_output_t *output;
+        ALSA_CHECK(snd_output_stdio_attach(&output, stdout, 0));
+        ALSA_CHECK(snd_pcm_dump(pcm_handle, output));
+        snd_output_close(output);
+    }
+
+    return pcm_handle;
+}
+
+int pcm_config_reprepare(snd_pcm_t *pcm_handle) {
+    int ret = snd_pcm_drop(pcm_handle);
+    if (ret < 0)
+        return ret;
+    return snd_pcm_prepare(pcm_handle);
+}
+
+void pcm_cache_clear(struct pcm_cache *cache) {
+    for (size_t i = 0; i < PCM_CACHE_ENTRIES; ++i) {
+        if (cache->entries[i].device)
+            cache_evict(&cache->entries[i]);
+    }
+    cache->next = 0;
+}
+
+void pcm_config_print(snd_pcm_t *pcm_handle) {
+    int errval;
+
+    uint8_t hw_params_raw_data[snd_pcm_hw_params_sizeof()];
+    snd_pcm_hw_params_t *hwparams = (snd_pcm_hw_params_t *)hw_params_raw_data;
+    uint8_t sw_params_raw_data[snd_pcm_sw_params_sizeof()];
+    snd_pcm_sw_params_t *swparams = (snd_pcm_sw_params_t *)sw_params_raw_data;
+
+    ALSA_CHECK(snd_pcm_hw_params_current(pcm_handle, hwparams));
+    ALSA_CHECK(snd_pcm_sw_params_current(pcm_handle, swparams));
+
+    snd_pcm_format_t format;
+    unsigned int rate, channels;
+    snd_pcm_uframes_t buffer_size, period_size, avail_min, start_threshold;
+    ALSA_CHECK(snd_pcm_hw_params_get_format(hwparams, &format));
+    ALSA_CHECK(snd_pcm_hw_params_get_channels(hwparams, &channels));
+    ALSA_CHECK(snd_pcm_hw_params_get_rate(hwparams, &rate, NULL));
+    ALSA_CHECK(snd_pcm_hw_params_get_buffer_size(hwparams, &buffer_size));
+    ALSA_CHECK(snd_pcm_hw_params_get_period_size(hwparams, &period_size, NULL));
+    ALSA_CHECK(snd_pcm_sw_params_get_avail_min(swparams, &avail_min));
+    ALSA_CHECK(snd_pcm_sw_params_get_start_threshold(swparams, &start_threshold));
+
+    printf("Negotiated: %s, %u channels, %u Hz\n", snd_pcm_format_name(format), channels, rate);
+    printf("Negotiated: buffer %lu frames (%.1f ms), period %lu frames (%.1f ms), avail_min %lu, start_threshold %lu\n",
+            buffer_size, 1000.0 * buffer_size / rate,
+            period_size, 1000.0 * period_size / rate,
+            avail_min, start_threshold);
+}
@@ -0,0 +1,73 @@
+#ifndef PCM_CONFIG_H
+#define PCM_CONFIG_H
+
+#include <alsa/asoundlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// PCM parameters requested on the command line.  Zero means "leave it at
+// whatever ALSA picks", except for the format and channels, which are picked
+// from what there are converters for.  (Format zero is S8, which there's no
+// converter for, so can't be asked for.)
+struct pcm_config {
+    const char *device;
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int buffer_time_us;
+    unsigned int period_time_us;
+    snd_pcm_uframes_t avail_min;
+    snd_pcm_uframes_t start_threshold;
+    // Skip the snd_pcm_dump after opening.
+    bool no_dump;
+    // Take the device's own rate nearest the one asked for, rather than
+    // letting the plug layer resample to it (set by programs that resample
+    // themselves).
+    bool native_rate;
+};
+
+// Negotiated parameters, cached by device and what was asked for, so opening
+// the same configuration again installs them directly rather than refining
+// from snd_pcm_hw_params_any.  Zero initialised is empty.
+#define PCM_CACHE_ENTRIES 8
+
+struct pcm_cache_entry {
+    char *device; // NULL if unused
+    snd_pcm_stream_t stream;
+    snd_pcm_access_t access;
+    unsigned int rate;
+    struct pcm_config config;
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
+};
+
+struct pcm_cache {
+    struct pcm_cache_entry entries[PCM_CACHE_ENTRIES];
+    // The entry to replace when they're all in use.
+    size_t next;
+};
+
+// getopt() option characters handled by pcm_config_parse_option.
+#define PCM_CONFIG_OPTSTRING "D:f:c:B:F:A:S:N"
+
+// Parse arg, given for -opt, as a number of at most max, exiting with a
+// message if it isn't one.  For the programs' own numeric options too.
+unsigned long pcm_config_parse_number(int opt, const char *arg, unsigned long max);
+// Returns true if opt was one of PCM_CONFIG_OPTSTRING and has been stored.
+bool pcm_config_parse_option(struct pcm_config *config, int opt, const char *arg);
+void pcm_config_usage(FILE *out);
+// The device to open, "default" unless one was given.
+const char *pcm_config_device(const struct pcm_config *config);
+
+// Open the configured device for stream with access, at the rate nearest
+// *rate (which is updated to the one negotiated), and print the parameters.
+// With a cache, a configuration that has been negotiated before is installed
+// as it was, and a new one is added to the cache.
+snd_pcm_t *pcm_config_open(struct pcm_cache *cache, const struct pcm_config *config, snd_pcm_stream_t stream, int mode, snd_pcm_access_t access, unsigned int *rate);
+// Stop an open stream and prepare it again with the parameters it has, for a
+// restart without reopening or renegotiating.
+int pcm_config_reprepare(snd_pcm_t *pcm_handle);
+void pcm_cache_clear(struct pcm_cache *cache);
+// Print the format and buffering parameters that were actually negotiated.
+void pcm_config_print(snd_pcm_t *pcm_handle);
+
+#endif
@@ -0,0 +1,166 @@
+#include "resample.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+#define LANES 8
+// Input pulled from the source at a time.
+#define BLOCK 1024
+// Ratios that don't reduce to this few phases use the nearest that does,
+// which is off by a fraction of a cent.
+#define MAX_PHASES 1024
+
+typedef float vfloat __attribute__((vector_size(LANES * sizeof(float))));
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+// Taps per phase, the Kaiser window's beta (its stopband attenuation), and
+// where the passband ends as a fraction of the lower Nyquist frequency.
+static const struct {
+    const char *name;
+    size_t taps;
+    double beta;
+    double cutoff;
+} presets[] = {
+    [RESAMPLE_FAST] = { "fast", 16, 6.0, 0.80 },
+    [RESAMPLE_MEDIUM] = { "medium", 32, 8.5, 0.88 },
+    [RESAMPLE_BEST] = { "best", 64, 11.0, 0.93 },
+};
+
+int resample_quality_value(const char *name) {
+    for (size_t i = 0; i < sizeof(presets) / sizeof(*presets); ++i) {
+        if (strcmp(presets[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// The zeroth order modified Bessel function, for the Kaiser window.
+static double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; term > 1e-12 * sum; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static void *alloc_floats(size_t count) {
+    // aligned_alloc wants a multiple of the alignment.
+    size_t bytes = (count * sizeof(float) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    float *p = aligned_alloc(CACHE_LINE, bytes);
+    if (!p)
+        err(1, "aligned_alloc");
+    memset(p, 0, bytes);
+    return p;
+}
+
+void resampler_init(struct resampler *r, unsigned int in_rate, unsigned int out_rate, enum resample_quality quality) {
+    unsigned int divisor = gcd(in_rate, out_rate);
+    r->up = out_rate / divisor;
+    r->down = in_rate / divisor;
+    if (r->up > MAX_PHASES) {
+        r->down = lround((double)r->down * MAX_PHASES / r->up);
+        r->up = MAX_PHASES;
+    }
+    r->taps = presets[quality].taps;
+    // Otherwise one output sample could need input from beyond the next block.
+    if (r->down > r->up * r->taps)
+        errx(1, "Can't resample from %u Hz down to %u Hz", in_rate, out_rate);
+
+    // The prototype lowpass runs at up times the input rate, so its cutoff is
+    // the lower of the two Nyquist frequencies relative to that.
+    size_t length = r->taps * r->up;
+    double ratio = r->up < r->down ? (double)r->up / r->down : 1.0;
+    double cutoff = presets[quality].cutoff * 0.5 * ratio / r->up;
+    double beta = presets[quality].beta;
+    double centre = (length - 1) / 2.0;
+    double *prototype = malloc(length * sizeof(double));
+    if (!prototype)
+        err(1, "malloc");
+    double sum = 0.0;
+    for (size_t n = 0; n < length; ++n) {
+        double t = n - centre;
+        double sinc = t == 0.0 ? 1.0 : sin(2 * M_PI * cutoff * t) / (2 * M_PI * cutoff * t);
+        double w = t / centre;
+        double window = bessel_i0(beta * sqrt(fmax(0.0, 1.0 - w * w))) / bessel_i0(beta);
+        prototype[n] = sinc * window;
+        sum += prototype[n];
+    }
+
+    // Each phase sees one in up of the taps, so normalise for unity gain per
+    // phase.
+    r->filters = alloc_floats(length);
+    for (unsigned int phase = 0; phase < r->up; ++phase) {
+        for (size_t j = 0; j < r->taps; ++j)
+            r->filters[phase * r->taps + r->taps - 1 - j] = prototype[phase + j * r->up] * r->up / sum;
+    }
+    free(prototype);
+
+    // Starting from silence.
+    r->input = alloc_floats(r->taps - 1 + BLOCK);
+    r->input_len = r->taps - 1;
+    r->next = r->taps - 1;
+    r->phase = 0;
+}
+
+void resampler_free(struct resampler *r) {
+    free(r->filters);
+    free(r->input);
+    r->filters = NULL;
+    r->input = NULL;
+}
+
+// Keep the input the next output sample needs, and pull in another block.
+static void refill(struct resampler *r, resample_source_fn source, void *ctx) {
+    size_t start = r->next - (r->taps - 1);
+    memmove(r->input, r->input + start, (r->input_len - start) * sizeof(float));
+    r->input_len -= start;
+    r->next -= start;
+    source(ctx, r->input + r->input_len, BLOCK);
+    r->input_len += BLOCK;
+}
+
+static inline __attribute__((always_inline)) float dot(const float *x, const float *h, size_t taps) {
+    vfloat sum = {0};
+    for (size_t i = 0; i < taps; i += LANES) {
+        vfloat xv, hv;
+        memcpy(&xv, x + i, sizeof(xv));
+        memcpy(&hv, h + i, sizeof(hv));
+        sum += xv * hv;
+    }
+    float total = 0.0f;
+    for (int lane = 0; lane < LANES; ++lane)
+        total += sum[lane];
+    return total;
+}
+
+SIMD_CLONES
+void resampler_fill(struct resampler *r, float *out, size_t frames, resample_source_fn source, void *ctx) {
+    for (size_t i = 0; i < frames; ++i) {
+        if (r->next >= r->input_len)
+            refill(r, source, ctx);
+
+        out[i] = dot(r->input + r->next + 1 - r->taps, r->filters + r->phase * r->taps, r->taps);
+
+        r->phase += r->down;
+        r->next += r->phase / r->up;
+        r->phase %= r->up;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A polyphase resampler, for playing content generated at a fixed rate to a
+// device opened at its native one, instead of through the plug plugin's
+// generic resampler.  The ratio between the rates is reduced to up/down, and
+// each output sample is one dot product of the input against one of up
+// windowed sinc filters.
+
+enum resample_quality {
+    RESAMPLE_FAST,
+    RESAMPLE_MEDIUM,
+    RESAMPLE_BEST,
+};
+
+// Where the resampler pulls its input from: fill buffer with the next frames
+// samples.
+typedef void (*resample_source_fn)(void *ctx, float *buffer, size_t frames);
+
+struct resampler {
+    unsigned int up, down;
+    // Per phase, a multiple of the SIMD width.
+    size_t taps;
+    // up filters of taps coefficients each, reversed so they line up with the
+    // input they're applied to.
+    float *filters;
+    // The input, starting with the last taps - 1 samples of the previous block.
+    float *input;
+    size_t input_len;
+    // The newest input sample the next output sample uses, and which filter.
+    size_t next;
+    unsigned int phase;
+};
+
+// Returns -1 for an unknown name.
+int resample_quality_value(const char *name);
+
+// Set up resampling from in_rate to out_rate, exiting on allocation failure.
+void resampler_init(struct resampler *r, unsigned int in_rate, unsigned int out_rate, enum resample_quality quality);
+void resampler_free(struct resampler *r);
+
+// Fill out with frames resampled samples, pulling as much input from source
+// as that takes.
+void resampler_fill(struct resampler *r, float *out, size_t frames, resample_source_fn source, void *ctx);
+
+#endif
@@ -0,0 +1,301 @@
+//! Playback through libalsaplay, the C core shared with `alsa` and `alsa2` (see alsaplay.h), which
+//! build.rs builds with the Makefile.  A tone (resampled or not) is played through the same open,
+//! write loop and xrun recovery as the C programs; only the modes that need this crate's own async
+//! writers (`-l`, `-M`, `-R` and `-O`) don't.
+
+use std::ffi::{CString, c_char, c_int, c_long, c_uint, c_ulong, c_void};
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+
+#[repr(C)]
+struct RawPlayer {
+    _private: [u8; 0],
+}
+
+/// As `struct alsaplay_stats`.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+pub struct Stats {
+    pub wakeups: c_ulong,
+    pub frames_written: c_ulong,
+    pub short_writes: c_ulong,
+    pub xruns: c_ulong,
+    pub min_delay: c_long,
+    pub max_delay: c_long,
+}
+
+/// As `struct alsaplay_config`.
+#[repr(C)]
+struct RawConfig {
+    device: *const c_char,
+    format: *const c_char,
+    channels: c_uint,
+    buffer_time_us: c_uint,
+    period_time_us: c_uint,
+    avail_min: c_ulong,
+    start_threshold: c_ulong,
+    no_dump: bool,
+}
+
+type FillFn = unsafe extern "C" fn(user_data: *mut c_void, buffer: *mut f32, frames: usize);
+
+unsafe extern "C" {
+    fn alsaplay_new() -> *mut RawPlayer;
+    fn alsaplay_set_config(play: *mut RawPlayer, config: *const RawConfig);
+    fn alsaplay_open(play: *mut RawPlayer, rate: c_uint, flags: c_uint);
+    fn alsaplay_rate(play: *const RawPlayer) -> c_uint;
+    fn alsaplay_channels(play: *const RawPlayer) -> c_uint;
+    fn alsaplay_period_size(play: *const RawPlayer) -> usize;
+    fn alsaplay_wake_on_timer(play: *mut RawPlayer, watermark_us: c_uint);
+    fn alsaplay_trace(path: *const c_char);
+    fn alsaplay_pump(
+        play: *mut RawPlayer,
+        fill: FillFn,
+        user_data: *mut c_void,
+        timeout_ms: c_int,
+    ) -> c_long;
+    fn alsaplay_stats(play: *const RawPlayer, stats: *mut Stats);
+    fn alsaplay_print_stats(play: *mut RawPlayer);
+    fn alsaplay_close(play: *mut RawPlayer);
+}
+
+/// As `enum alsaplay_flags`.
+pub const PLANAR: c_uint = 1 << 1;
+pub const NATIVE_RATE: c_uint = 1 << 3;
+
+/// A playback PCM opened by the C core.  Errors are fatal, as they are in the C programs.
+#[derive(Debug)]
+pub struct Player {
+    raw: std::ptr::NonNull<RawPlayer>,
+}
+
+// SAFETY: The C core has no thread affinity, and a `Player` is only used through `&mut self`, so by
+// one thread at a time.
+unsafe impl Send for Player {}
+
+fn format_name(format: alsa::pcm::Format) -> &'static str {
+    use alsa::pcm::Format;
+
+    match format {
+        Format::FloatLE => "FLOAT_LE",
+        Format::S32LE => "S32_LE",
+        Format::S243LE => "S24_3LE",
+        Format::S16LE => "S16_LE",
+        format => panic!("No converter for {format:?}"),
+    }
+}
+
+impl Player {
+    /// Open `device` with the parameters in `config` at the rate nearest `rate`, generating a block
+    /// ahead.
+    pub fn open(device: &str, config: &crate::options::PcmConfig, rate: u32) -> Self {
+        // SAFETY: No preconditions, it exits rather than returning null.
+        let raw = std::ptr::NonNull::new(unsafe { alsaplay_new() }).expect("alsaplay_new failed");
+        let player = Self { raw };
+
+        let device = CString::new(device).expect("NUL in device name");
+        let format = config
+            .format
+            .map(|format| CString::new(format_name(format)).expect("NUL in format name"));
+        let raw_config = RawConfig {
+            device: device.as_ptr(),
+            format: format
+                .as_ref()
+                .map_or(std::ptr::null(), |format| format.as_ptr()),
+            channels: config.channels.unwrap_or(0),
+            buffer_time_us: config.buffer_time_us.unwrap_or(0),
+            period_time_us: config.period_time_us.unwrap_or(0),
+            avail_min: config.avail_min.map_or(0, |frames| frames as c_ulong),
+            start_threshold: config.start_threshold.map_or(0, |frames| frames as c_ulong),
+            no_dump: config.no_dump,
+        };
+        // SAFETY: `raw` is a fresh player, and `raw_config`'s strings live until after the call,
+        // which copies them.
+        unsafe { alsaplay_set_config(raw.as_ptr(), &raw_config) };
+
+        let mut flags = 0;
+        if config.planar {
+            flags |= PLANAR;
+        }
+        if config.native_rate {
+            flags |= NATIVE_RATE;
+        }
+        // SAFETY: `raw` is a fresh, configured player.
+        unsafe { alsaplay_open(raw.as_ptr(), rate, flags) };
+        player
+    }
+
+    /// Wake on a timer when `watermark` is left in the buffer, rather than when ALSA says there's
+    /// room.
+    pub fn wake_on_timer(&mut self, watermark: std::time::Duration) {
+        let watermark_us = watermark.as_micros().try_into().unwrap_or(c_uint::MAX);
+        // SAFETY: `raw` is a valid, open player.
+        unsafe { alsaplay_wake_on_timer(self.raw.as_ptr(), watermark_us) };
+    }
+
+    pub fn rate(&self) -> u32 {
+        // SAFETY: `raw` is a valid, open player.
+        unsafe { alsaplay_rate(self.raw.as_ptr()) }
+    }
+
+    pub fn channels(&self) -> u32 {
+        // SAFETY: `raw` is a valid, open player.
+        unsafe { alsaplay_channels(self.raw.as_ptr()) }
+    }
+
+    pub fn period_size(&self) -> usize {
+        // SAFETY: `raw` is a valid, open player.
+        unsafe { alsaplay_period_size(self.raw.as_ptr()) }
+    }
+
+    /// Wait up to `timeout` for room, and fill it from `fill`, returning the frames written.
+    pub fn pump<F: FnMut(&mut [f32])>(
+        &mut self,
+        fill: &mut F,
+        timeout: std::time::Duration,
+    ) -> usize {
+        unsafe extern "C" fn trampoline<F: FnMut(&mut [f32])>(
+            user_data: *mut c_void,
+            buffer: *mut f32,
+            frames: usize,
+        ) {
+            // SAFETY: `user_data` is the `&mut F` passed to `alsaplay_pump` below, and `buffer`
+            // holds `frames` samples, only for the duration of this call.
+            let (fill, buffer) = unsafe {
+                (
+                    &mut *user_data.cast::<F>(),
+                    std::slice::from_raw_parts_mut(buffer, frames),
+                )
+            };
+            fill(buffer);
+        }
+
+        let timeout_ms = timeout.as_millis().try_into().unwrap_or(c_int::MAX);
+        // SAFETY: `raw` is a valid, open player, and `fill` outlives the call.
+        let written = unsafe {
+            alsaplay_pump(
+                self.raw.as_ptr(),
+                trampoline::<F>,
+                (fill as *mut F).cast(),
+                timeout_ms,
+            )
+        };
+        // Nothing is watched with alsaplay_watch_fd, so it's never ALSAPLAY_FD_READY.
+        written as usize
+    }
+
+    pub fn stats(&self) -> Stats {
+        let mut stats = Stats::default();
+        // SAFETY: `raw` is a valid player, and `stats` a valid `Stats` to write to.
+        unsafe { alsaplay_stats(self.raw.as_ptr(), &mut stats) };
+        stats
+    }
+
+    /// Print the stats in the C programs' format, as the latency benchmark reads.
+    pub fn print_stats(&mut self) {
+        // SAFETY: `raw` is a valid, open player.
+        unsafe { alsaplay_print_stats(self.raw.as_ptr()) };
+    }
+}
+
+impl Drop for Player {
+    fn drop(&mut self) {
+        // SAFETY: `raw` is valid, and not used again.
+        unsafe { alsaplay_close(self.raw.as_ptr()) };
+    }
+}
+
+/// Trace the C core's stages into a ring in `path`, as `crate::trace::open` does this crate's.
+pub fn trace(path: &std::path::Path) {
+    use std::os::unix::ffi::OsStrExt as _;
+
+    let path = CString::new(path.as_os_str().as_bytes()).expect("NUL in trace path");
+    // SAFETY: `path` is a valid string, which the C side doesn't keep.
+    unsafe { alsaplay_trace(path.as_ptr()) };
+}
+
+/// Play the tone `options` asks for (which `Options::plays_through_core`) through the C core, from
+/// its own thread, until the returned future is dropped.  Stats are printed when asked for (on SIGUSR1 or every `-i`), between
+/// wakeups.
+pub async fn play(options: &crate::options::Options) {
+    let stop = Arc::new(AtomicBool::new(false));
+    let dump = Arc::new(AtomicBool::new(false));
+
+    /// Stops and joins the audio thread, however `play` ends.
+    struct Running {
+        stop: Arc<AtomicBool>,
+        thread: Option<std::thread::JoinHandle<()>>,
+    }
+    impl Drop for Running {
+        fn drop(&mut self) {
+            self.stop.store(true, Ordering::Relaxed);
+            if let Some(thread) = self.thread.take() {
+                let _ = thread.join();
+            }
+        }
+    }
+
+    let mut player = Player::open(&options.device, &options.pcm, crate::SOURCE_RATE);
+    println!(
+        "libalsaplay: {} Hz, {} channels, {} frame periods",
+        player.rate(),
+        player.channels(),
+        player.period_size()
+    );
+    if let Some(watermark) = options.timer_watermark {
+        player.wake_on_timer(watermark);
+    }
+    // There are no mixed sources, whose underruns are all the stats would be used for.
+    let mut producer = crate::Producer::new(options, 0, player.rate() as f32, &Default::default());
+
+    let _running = Running {
+        stop: stop.clone(),
+        thread: Some(std::thread::spawn({
+            let stop = stop.clone();
+            let dump = dump.clone();
+            move || {
+                let mut fill = |buffer: &mut [f32]| producer.fill(buffer);
+                while !stop.load(Ordering::Relaxed) {
+                    let written = player.pump(&mut fill, std::time::Duration::from_millis(100));
+                    if crate::stats::verbose() && written > 0 {
+                        println!("{written}");
+                    }
+                    if dump.swap(false, Ordering::Relaxed) {
+                        player.print_stats();
+                    }
+                }
+
+                let stats = player.stats();
+                println!(
+                    "libalsaplay: {} frames in {} wakeups, {} short writes, {} xruns",
+                    stats.frames_written, stats.wakeups, stats.short_writes, stats.xruns
+                );
+                if stats.min_delay <= stats.max_delay {
+                    println!(
+                        "libalsaplay: delay {}..{} frames since the last stats",
+                        stats.min_delay, stats.max_delay
+                    );
+                }
+            }
+        })),
+    };
+
+    use tokio::signal::unix::{SignalKind, signal};
+    let mut usr1 = signal(SignalKind::user_defined1()).expect("Couldn't handle SIGUSR1");
+    let mut interval = options.stats_interval.map(tokio::time::interval);
+    loop {
+        let tick = async {
+            match &mut interval {
+                Some(interval) => {
+                    interval.tick().await;
+                }
+                None => std::future::pending().await,
+            }
+        };
+        tokio::select! {
+            _ = usr1.recv() => {}
+            _ = tick => {}
+        }
+        dump.store(true, Ordering::Relaxed);
+    }
+}
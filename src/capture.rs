@@ -0,0 +1,163 @@
+//! Recording, with the same poll based async machinery as playback.
+//!
+//! Reads go into buffers the caller owns, so nothing is allocated per call.  `Periods` wraps that
+//! up as a `Stream` of period sized chunks, which can be handed back to be refilled.
+
+use std::sync::Arc;
+
+use crate::pool::BlockPool;
+use crate::stats::Stats;
+
+/// Periods allocated for `Periods` up front, enough for one being filled while a few are used.
+const POOL_PERIODS: usize = 4;
+
+pub struct AlsaCapture {
+    pcm: alsa::PCM,
+    poll: crate::AlsaPoll,
+    period_size: usize,
+    channels: usize,
+    stats: Arc<Stats>,
+}
+
+impl AlsaCapture {
+    pub fn new(pcm: alsa::PCM, negotiated: &crate::Negotiated) -> Self {
+        let poll = crate::AlsaPoll::new(&pcm);
+        Self {
+            pcm,
+            poll,
+            period_size: negotiated.period_size,
+            channels: negotiated.channels,
+            stats: Default::default(),
+        }
+    }
+
+    /// Recover from an overrun, and restart the stream, since unlike playback nothing else will.
+    fn recover(&self, err: alsa::Error) -> std::io::Result<()> {
+        crate::recover_pcm(&self.pcm, err, &self.stats)?;
+        self.start()
+    }
+
+    /// Capture doesn't start by itself on the first read like playback does on a write, since we
+    /// wait for data before reading.
+    fn start(&self) -> std::io::Result<()> {
+        if self.pcm.state() == alsa::pcm::State::Prepared {
+            self.pcm.start().map_err(std::io::Error::other)?;
+        }
+        Ok(())
+    }
+}
+
+pub struct AlsaReader<'c, Sample>(&'c AlsaCapture, alsa::pcm::IO<'c, Sample>)
+where
+    Sample: alsa::pcm::IoFormat;
+
+impl<'c, Sample: alsa::pcm::IoFormat> AlsaReader<'c, Sample> {
+    pub fn new(capture: &'c AlsaCapture) -> Self {
+        Self(capture, capture.pcm.io_checked().expect("Wrong format"))
+    }
+
+    /// Read as many whole frames into `buf` as ALSA has captured, waiting for at least one.
+    /// Returns how many samples were read.
+    pub fn poll_read(
+        &self,
+        cx: &mut std::task::Context<'_>,
+        buf: &mut [Sample],
+    ) -> std::task::Poll<std::io::Result<usize>> {
+        let capture = self.0;
+        let channels = capture.channels;
+        assert!(buf.len() >= channels, "Buffer is smaller than a frame");
+        capture.start()?;
+
+        // Made from just the kind, as one with a message would allocate.
+        let would_block = || Err(std::io::ErrorKind::WouldBlock.into());
+
+        capture.poll.poll_ready(&capture.pcm, cx, |flags| {
+            if !flags.contains(alsa::poll::Flags::IN) {
+                return would_block();
+            }
+            capture.stats.record_wakeup();
+
+            let frames = match capture.pcm.avail_update() {
+                Ok(frames) => frames as usize,
+                Err(err) => {
+                    capture.recover(err)?;
+                    return would_block();
+                }
+            };
+            if let Ok(delay) = capture.pcm.delay() {
+                capture.stats.record_delay(delay);
+            }
+
+            let requested = std::cmp::min(frames, buf.len() / channels);
+            if requested == 0 {
+                return would_block();
+            }
+            match self.1.readi(&mut buf[..requested * channels]) {
+                Ok(count) => {
+                    capture.stats.record_write(requested, count);
+                    Ok(count * channels)
+                }
+                Err(err) => {
+                    capture.recover(err)?;
+                    would_block()
+                }
+            }
+        })
+    }
+}
+
+/// A `Stream` of whole periods.  Chunks come from a pool allocated up front, and handed back with
+/// `recycle` are refilled, so as long as only a few are held at a time nothing is allocated.
+pub struct Periods<'c, Sample: alsa::pcm::IoFormat> {
+    reader: AlsaReader<'c, Sample>,
+    /// The chunk being filled, and how much of it has been.
+    current: Vec<Sample>,
+    filled: usize,
+    free: BlockPool<Sample>,
+}
+
+impl<'c, Sample: alsa::pcm::IoFormat + Default> Periods<'c, Sample> {
+    pub fn new(reader: AlsaReader<'c, Sample>) -> Self {
+        let period_len = reader.0.period_size * reader.0.channels;
+        Self {
+            reader,
+            current: Vec::new(),
+            filled: 0,
+            free: BlockPool::new(POOL_PERIODS, period_len),
+        }
+    }
+
+    fn period_len(&self) -> usize {
+        self.reader.0.period_size * self.reader.0.channels
+    }
+
+    /// Hand back a chunk this stream produced, to be reused.
+    pub fn recycle(&mut self, chunk: Vec<Sample>) {
+        self.free.give(chunk);
+    }
+}
+
+impl<Sample: alsa::pcm::IoFormat + Default + Unpin> futures::Stream for Periods<'_, Sample> {
+    type Item = std::io::Result<Vec<Sample>>;
+
+    fn poll_next(
+        self: std::pin::Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<Option<Self::Item>> {
+        let this = self.get_mut();
+        let period_len = this.period_len();
+        if this.current.is_empty() {
+            this.current = this.free.take();
+        }
+
+        while this.filled < period_len {
+            match std::task::ready!(this.reader.poll_read(cx, &mut this.current[this.filled..])) {
+                Ok(count) => this.filled += count,
+                Err(err) => return std::task::Poll::Ready(Some(Err(err))),
+            }
+        }
+
+        this.filled = 0;
+        std::task::Poll::Ready(Some(Ok(std::mem::take(&mut this.current))))
+    }
+}
@@ -0,0 +1,117 @@
+//! Where the frames written to a playback stream are heard, on `CLOCK_MONOTONIC`.
+//!
+//! A single `snd_pcm_status` call returns the available room, the delay, and the time those were
+//! true, so one `Snapshot` per wakeup replaces separate `avail_update`, `delay` and `avail`
+//! calls.  Anchoring the frames written against each snapshot's timestamp gives a `Clock` that
+//! can say when any frame is played, or which frame is playing at any time, for A/V sync.
+
+fn timespec_seconds(time: &libc::timespec) -> f64 {
+    time.tv_sec as f64 + time.tv_nsec as f64 * 1e-9
+}
+
+/// `CLOCK_MONOTONIC`, in seconds.  Devices are asked for timestamps from the same clock.
+pub fn monotonic_now() -> f64 {
+    let mut now = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    // SAFETY: `now` is a valid timespec to write to.
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut now) };
+    timespec_seconds(&now)
+}
+
+/// Enable hardware timestamps from `CLOCK_MONOTONIC`, which `snd_pcm_status` then returns
+/// alongside the delay they correspond to.
+pub fn enable_timestamps(pcm: &alsa::PCM) {
+    let swparams = pcm.sw_params_current().expect("Couldn't get sw params");
+    swparams
+        .set_tstamp_mode(true)
+        .expect("Couldn't enable timestamps");
+    swparams
+        .set_tstamp_type(alsa::pcm::TstampType::Monotonic)
+        .expect("Couldn't set timestamp type");
+    pcm.sw_params(&swparams).expect("Failed to set sw params");
+}
+
+/// What one `snd_pcm_status` call says about a stream.  Times are `CLOCK_MONOTONIC` seconds.
+#[derive(Debug, Clone, Copy)]
+pub struct Snapshot {
+    pub state: alsa::pcm::State,
+    pub avail: usize,
+    pub delay: alsa::pcm::Frames,
+    /// When `avail` and `delay` were measured.
+    pub htstamp: f64,
+    /// When the stream was last started or stopped.
+    pub trigger: f64,
+}
+
+impl Snapshot {
+    pub fn take(pcm: &alsa::PCM) -> alsa::Result<Self> {
+        let status = pcm.status()?;
+        Ok(Self {
+            state: status.get_state(),
+            avail: status.get_avail().max(0) as usize,
+            delay: status.get_delay(),
+            htstamp: timespec_seconds(&status.get_htstamp()),
+            trigger: timespec_seconds(&status.get_trigger_htstamp()),
+        })
+    }
+
+    /// Whether the stream needs recovering before it can be written to.
+    pub fn needs_recovery(&self) -> bool {
+        matches!(
+            self.state,
+            alsa::pcm::State::XRun | alsa::pcm::State::Suspended
+        )
+    }
+}
+
+/// Maps frame positions, counted from the first frame written, to when they're played.
+#[derive(Debug, Clone, Copy)]
+pub struct Clock {
+    rate: f64,
+    written: u64,
+    /// The frame being played at the last running snapshot, and when that was.  `None` until the
+    /// stream has started.
+    anchor: Option<(f64, f64)>,
+}
+
+impl Clock {
+    pub fn new(rate: f32) -> Self {
+        Self {
+            rate: rate as f64,
+            written: 0,
+            anchor: None,
+        }
+    }
+
+    /// Frames written in total.
+    pub fn written(&self) -> u64 {
+        self.written
+    }
+
+    pub fn wrote(&mut self, frames: usize) {
+        self.written += frames as u64;
+    }
+
+    /// Re-anchor to `snapshot`, taken since the last write.
+    pub fn update(&mut self, snapshot: &Snapshot) {
+        if snapshot.state == alsa::pcm::State::Running {
+            let playing = self.written as f64 - snapshot.delay as f64;
+            self.anchor = Some((playing, snapshot.htstamp));
+        }
+    }
+
+    /// When `frame` is, or was, played, or `None` before the stream has started.
+    pub fn time_of(&self, frame: u64) -> Option<f64> {
+        let (playing, at) = self.anchor?;
+        Some(at + (frame as f64 - playing) / self.rate)
+    }
+
+    /// Which frame is being played at `time`, fractionally, or `None` before the stream has
+    /// started.
+    pub fn frame_at(&self, time: f64) -> Option<f64> {
+        let (playing, at) = self.anchor?;
+        Some(playing + (time - at) * self.rate)
+    }
+}
@@ -0,0 +1,121 @@
+//! Conversion from the mono `f32` signal we generate to the device's sample format and channel
+//! count.
+
+pub const MAX_CHANNELS: usize = 8;
+
+/// A sample format we can write, along with how to encode a `[-1, 1]` float in it.
+pub trait Sample: alsa::pcm::IoFormat + Default + Send + Unpin + 'static {
+    fn from_f32(x: f32) -> Self;
+    fn to_f32(self) -> f32;
+}
+
+impl Sample for f32 {
+    #[inline(always)]
+    fn from_f32(x: f32) -> Self {
+        x
+    }
+
+    #[inline(always)]
+    fn to_f32(self) -> f32 {
+        self
+    }
+}
+
+impl Sample for i16 {
+    #[inline(always)]
+    fn from_f32(x: f32) -> Self {
+        // Float to int `as` casts saturate, so this needs no clamping.
+        (x * i16::MAX as f32) as i16
+    }
+
+    #[inline(always)]
+    fn to_f32(self) -> f32 {
+        self as f32 / 32768.0
+    }
+}
+
+impl Sample for i32 {
+    #[inline(always)]
+    fn from_f32(x: f32) -> Self {
+        // f32 can't represent i32::MAX, so scale in f64 to keep full scale exact.
+        (x as f64 * i32::MAX as f64) as i32
+    }
+
+    #[inline(always)]
+    fn to_f32(self) -> f32 {
+        (self as f64 / 2147483648.0) as f32
+    }
+}
+
+/// Packed 24 bit little endian samples, which have no native Rust type.
+#[repr(transparent)]
+#[derive(Debug, Default, Clone, Copy)]
+pub struct S24Packed([u8; 3]);
+
+impl alsa::pcm::IoFormat for S24Packed {
+    const FORMAT: alsa::pcm::Format = alsa::pcm::Format::S243LE;
+}
+
+impl Sample for S24Packed {
+    #[inline(always)]
+    fn from_f32(x: f32) -> Self {
+        let [b0, b1, b2, _] = ((x * 8388607.0) as i32)
+            .clamp(-8388608, 8388607)
+            .to_le_bytes();
+        S24Packed([b0, b1, b2])
+    }
+
+    #[inline(always)]
+    fn to_f32(self) -> f32 {
+        let [b0, b1, b2] = self.0;
+        // Shift back down to sign extend.
+        (i32::from_le_bytes([0, b0, b1, b2]) >> 8) as f32 / 8388608.0
+    }
+}
+
+/// Formats there are converters for, most preferred first.
+pub const FORMATS: [alsa::pcm::Format; 4] = [
+    alsa::pcm::Format::FloatLE,
+    alsa::pcm::Format::S32LE,
+    alsa::pcm::Format::S243LE,
+    alsa::pcm::Format::S16LE,
+];
+
+/// Parse an ALSA format name, as given to aplay.
+pub fn parse_format(name: &str) -> Option<alsa::pcm::Format> {
+    use alsa::pcm::Format;
+
+    match name.to_ascii_uppercase().as_str() {
+        "FLOAT_LE" => Some(Format::FloatLE),
+        "S32_LE" => Some(Format::S32LE),
+        "S24_3LE" => Some(Format::S243LE),
+        "S16_LE" => Some(Format::S16LE),
+        _ => None,
+    }
+}
+
+/// Converts mono samples into interleaved frames, with every channel carrying the same signal.
+pub type Converter<S> = fn(&mut [S], &[f32]);
+
+/// `CHANNELS` is a constant, so each instance's inner loop is unrolled and the whole thing
+/// vectorises without branching per sample.
+fn interleave<S: Sample, const CHANNELS: usize>(dest: &mut [S], src: &[f32]) {
+    for (frame, &x) in dest.chunks_exact_mut(CHANNELS).zip(src) {
+        frame.fill(S::from_f32(x));
+    }
+}
+
+/// The converter for `channels` channels of `S`.
+pub fn converter<S: Sample>(channels: usize) -> Converter<S> {
+    match channels {
+        1 => interleave::<S, 1>,
+        2 => interleave::<S, 2>,
+        3 => interleave::<S, 3>,
+        4 => interleave::<S, 4>,
+        5 => interleave::<S, 5>,
+        6 => interleave::<S, 6>,
+        7 => interleave::<S, 7>,
+        8 => interleave::<S, 8>,
+        _ => panic!("No converter for {channels} channels"),
+    }
+}
@@ -1,76 +1,413 @@
-fn generate_data(buffer: &mut [f32], rate: f32, phase: &mut f32) {
-    const FREQUENCY: f32 = 440.0;
-    for i in buffer {
-        *i = (*phase * std::f32::consts::TAU * FREQUENCY / rate).sin();
-        *phase += 1.0;
+mod alsaplay;
+mod capture;
+mod clock;
+mod convert;
+mod mixer;
+mod multi;
+mod options;
+mod osc;
+mod pipeline;
+mod pool;
+mod resample;
+mod ring;
+mod rt;
+mod stats;
+mod timer;
+mod trace;
+mod wavetable;
+
+const FREQUENCY: f32 = 440.0;
+/// The rate asked of ALSA, and that the signal is generated at when resampling.
+const SOURCE_RATE: u32 = 44100;
+
+/// An ALSA PCM's poll descriptor, registered with the tokio reactor.
+pub struct AlsaPoll {
+    async_fd: tokio::io::unix::AsyncFd<std::os::fd::RawFd>,
+    poll_fd: libc::pollfd,
+}
+
+impl AlsaPoll {
+    pub fn new(pcm: &alsa::PCM) -> Self {
+        let fds = alsa::poll::Descriptors::get(pcm).expect("Couldn't get ALSA PCM FDs");
+        let poll_fd = fds.first().unwrap();
+        let async_fd = tokio::io::unix::AsyncFd::new(poll_fd.fd).expect("couldn't get async fd");
+        Self {
+            async_fd,
+            poll_fd: *poll_fd,
+        }
     }
-    if *phase > rate {
-        *phase -= rate;
+
+    fn get_interest(&self) -> tokio::io::Interest {
+        use tokio::io::Interest;
+
+        // Even for write only use like this, alsa often requires read events, since it's asking
+        // you to wait on a status pipe rather than the underlying audio device.
+
+        if self.poll_fd.events & libc::POLLIN != 0 {
+            Interest::READABLE
+        } else if self.poll_fd.events & libc::POLLOUT != 0 {
+            Interest::WRITABLE
+        } else if self.poll_fd.events & libc::POLLERR != 0 {
+            Interest::ERROR
+        } else {
+            panic!("Unknown interest");
+        }
     }
+
+    /// Wait for the descriptor to become ready, then call `f` with the events ALSA says that
+    /// means for `pcm`.
+    ///
+    /// This uses the poll based `AsyncFd` API, which keeps the waker registered with the reactor
+    /// between calls, so it's safe to call from `poll_*` functions that don't hold a future
+    /// across polls.  `f` may return `WouldBlock` to go back to waiting on the fd.
+    pub fn poll_ready<R>(
+        &self,
+        pcm: &alsa::PCM,
+        cx: &mut std::task::Context<'_>,
+        mut f: impl FnMut(alsa::poll::Flags) -> std::io::Result<R>,
+    ) -> std::task::Poll<std::io::Result<R>> {
+        let interest = self.get_interest();
+        loop {
+            let mut guard = std::task::ready!(if interest.is_writable() {
+                self.async_fd.poll_write_ready(cx)
+            } else {
+                // Error events are delivered to readers as well.
+                self.async_fd.poll_read_ready(cx)
+            })
+            .expect("Failed to get asyncfd guard");
+
+            let io_result = guard.try_io(|_fd| {
+                let fds = [libc::pollfd {
+                    fd: self.poll_fd.fd,
+                    events: self.poll_fd.events,
+                    revents: if interest.is_readable() {
+                        libc::POLLIN
+                    } else {
+                        0
+                    } | if interest.is_writable() {
+                        libc::POLLOUT
+                    } else {
+                        0
+                    } | if interest.is_error() {
+                        libc::POLLERR
+                    } else {
+                        0
+                    },
+                }];
+
+                // Since ALSA may have asked for a POLLIN event for us to write (since it's
+                // actually waiting on a status pipe), we need to remap that back to OUT, some alsa
+                // plugins rely on this to perform some internal book keeping updates.  This does
+                // that.
+                let start = trace::begin();
+                let flags =
+                    alsa::poll::Descriptors::revents(pcm, &fds).expect("Failed to alsa revents");
+                trace::end(trace::Stage::Revents, start, 0);
+                f(flags)
+            });
+
+            match io_result {
+                Ok(result) => return std::task::Poll::Ready(result),
+                // Readiness has been cleared, so the next poll will register our waker.
+                Err(_would_block) => continue,
+            }
+        }
+    }
+}
+
+/// What wakes us up to write.
+enum Wakeup {
+    /// ALSA's poll descriptor.
+    Poll(AlsaPoll),
+    /// A timer armed to fire when the buffer drains down to a watermark.
+    Timer(timer::WakeupTimer),
 }
 
 pub struct AlsaPlayback {
     pcm: alsa::PCM,
-    async_fd: tokio::io::unix::AsyncFd<std::os::fd::RawFd>,
-    poll_fd: libc::pollfd,
+    wakeup: Wakeup,
     rate: f32,
+    period_size: usize,
+    channels: usize,
+    /// When ALSA last woke us to write, until that write happens.
+    woken: std::cell::Cell<Option<std::time::Instant>>,
+    /// The room the last status snapshot reported, less what's been written since.
+    room: std::cell::Cell<usize>,
+    clock: std::cell::Cell<clock::Clock>,
+    stats: std::sync::Arc<stats::Stats>,
 }
 
-impl AlsaPlayback {
-    pub fn new(device: &str) -> Self {
-        let pcm = alsa::PCM::new(device, alsa::Direction::Playback, true)
-            .expect("Failed to open device for playback");
+/// The parameters ALSA settled on.
+#[derive(Debug, Clone, Copy)]
+pub struct Negotiated {
+    pub rate: f32,
+    pub period_size: usize,
+    pub buffer_size: usize,
+    pub format: alsa::pcm::Format,
+    pub channels: usize,
+}
 
-        let hwparams = alsa::pcm::HwParams::any(&pcm).unwrap();
+/// Open `device` for `direction` and negotiate its parameters.
+fn open_pcm(
+    device: &str,
+    direction: alsa::Direction,
+    config: &options::PcmConfig,
+) -> (alsa::PCM, Negotiated) {
+    let pcm = alsa::PCM::new(device, direction, true)
+        .unwrap_or_else(|err| panic!("Failed to open {device} for {direction:?}: {err}"));
+
+    let hwparams = alsa::pcm::HwParams::any(&pcm).unwrap();
+    hwparams
+        .set_access(if config.planar {
+            alsa::pcm::Access::RWNonInterleaved
+        } else {
+            alsa::pcm::Access::RWInterleaved
+        })
+        .unwrap();
+
+    // Without a format, take the first one the device can do natively, so a hw: device doesn't
+    // need the plug layer to convert for it.
+    let format = config
+        .format
+        .or_else(|| {
+            convert::FORMATS
+                .into_iter()
+                .find(|&format| hwparams.test_format(format).is_ok())
+        })
+        .expect("Device supports none of the sample formats there are converters for");
+    hwparams.set_format(format).expect("Couldn't set format");
+
+    if config.native_rate {
         hwparams
-            .set_access(alsa::pcm::Access::RWInterleaved)
-            .unwrap();
-        hwparams.set_format(alsa::pcm::Format::FloatLE).unwrap();
+            .set_rate_resample(false)
+            .expect("Couldn't disable resampling");
+    }
+    hwparams
+        .set_rate_near(SOURCE_RATE, alsa::ValueOr::Nearest)
+        .unwrap();
+
+    match config.channels {
+        Some(channels) => hwparams
+            .set_channels(channels)
+            .expect("Couldn't set channels"),
+        None => {
+            hwparams
+                .set_channels_near(1)
+                .expect("Couldn't set channels");
+        }
+    }
 
+    // As in aplay, the period is set first so the buffer can be rounded to a whole number of
+    // periods.
+    if let Some(period_time) = config.period_time_us {
+        hwparams
+            .set_period_time_near(period_time, alsa::ValueOr::Nearest)
+            .expect("Couldn't set period time");
+    }
+    if let Some(buffer_time) = config.buffer_time_us {
         hwparams
-            .set_rate_near(44100, alsa::ValueOr::Nearest)
-            .unwrap();
+            .set_buffer_time_near(buffer_time, alsa::ValueOr::Nearest)
+            .expect("Couldn't set buffer time");
+    }
 
-        hwparams.set_channels(1).unwrap();
+    pcm.hw_params(&hwparams).expect("Failed to initialise ALSA");
 
-        pcm.hw_params(&hwparams).expect("Failed to initialise ALSA");
+    let rate = hwparams.get_rate().expect("Couldn't get rate") as f32;
+    let channels = hwparams.get_channels().expect("Couldn't get channels") as usize;
+    assert!(
+        (1..=convert::MAX_CHANNELS).contains(&channels),
+        "No converter for {channels} channels"
+    );
+    let period_size = hwparams
+        .get_period_size()
+        .expect("Couldn't get period size") as usize;
 
-        let rate = hwparams.get_rate().expect("Couldn't get rate") as f32;
+    let buffer_size = hwparams
+        .get_buffer_size()
+        .expect("Couldn't get buffer size");
 
-        drop(hwparams);
+    drop(hwparams);
 
-        let fds = alsa::poll::Descriptors::get(&pcm).expect("Couldn't get ALSA PCM FDs");
-        let poll_fd = fds.first().unwrap();
-        let async_fd = tokio::io::unix::AsyncFd::new(poll_fd.fd).expect("couldn't get async fd");
+    let swparams = pcm.sw_params_current().expect("Couldn't get sw params");
+    if let Some(avail_min) = config.avail_min {
+        swparams
+            .set_avail_min(avail_min)
+            .expect("Couldn't set avail_min");
+    }
+    if let Some(start_threshold) = config.start_threshold {
+        swparams
+            .set_start_threshold(start_threshold)
+            .expect("Couldn't set start_threshold");
+    }
+    pcm.sw_params(&swparams).expect("Failed to set sw params");
+
+    println!("Negotiated: {format:?}, {channels} channels, {rate} Hz");
+    println!(
+        "Negotiated: buffer {buffer_size} frames ({:.1} ms), period {period_size} frames ({:.1} ms), avail_min {}, start_threshold {}",
+        1000.0 * buffer_size as f32 / rate,
+        1000.0 * period_size as f32 / rate,
+        swparams.get_avail_min().expect("Couldn't get avail_min"),
+        swparams
+            .get_start_threshold()
+            .expect("Couldn't get start_threshold"),
+    );
+
+    drop(swparams);
+
+    (
+        pcm,
+        Negotiated {
+            rate,
+            period_size,
+            buffer_size: buffer_size as usize,
+            format,
+            channels,
+        },
+    )
+}
+
+/// Recover from an xrun or suspend with `snd_pcm_recover`, recording when it happened and how long
+/// recovery took.  Any other error is returned.
+fn recover_pcm(pcm: &alsa::PCM, err: alsa::Error, stats: &stats::Stats) -> std::io::Result<()> {
+    use alsa::pcm::State;
+
+    if !matches!(pcm.state(), State::XRun | State::Suspended) {
+        return Err(std::io::Error::other(err));
+    }
+
+    trace::instant(trace::Stage::Xrun);
+    let start = std::time::Instant::now();
+    pcm.try_recover(err, true).map_err(std::io::Error::other)?;
+    let recovery = start.elapsed();
+    stats.record_xrun(start, recovery);
+
+    if stats::verbose() {
+        println!("Recovered from {err} in {recovery:?}");
+    }
+    Ok(())
+}
+
+impl AlsaPlayback {
+    /// Play to `pcm`, waking when its poll descriptor says there's room, or with
+    /// `timer_watermark` on a timer that fires when that much audio is left in the buffer.
+    pub fn new(
+        pcm: alsa::PCM,
+        negotiated: &Negotiated,
+        timer_watermark: Option<std::time::Duration>,
+    ) -> Self {
+        let wakeup = match timer_watermark {
+            // The ALSA descriptors aren't registered with the reactor at all, so plugins that
+            // signal them far more often than we need can't wake us.
+            Some(watermark) => {
+                let watermark = (watermark.as_secs_f64() * negotiated.rate as f64) as usize;
+                // Each wakeup refills the buffer, so it must be able to take at least a period
+                // above the watermark, or we'd never sleep.
+                assert!(
+                    watermark + negotiated.period_size <= negotiated.buffer_size,
+                    "The timer watermark leaves less than a period of the {} frame buffer to refill",
+                    negotiated.buffer_size
+                );
+                println!("Timer mode, waking at {watermark} frames left");
+                Wakeup::Timer(
+                    timer::WakeupTimer::new(watermark as alsa::pcm::Frames, negotiated.rate)
+                        .expect("Couldn't create wakeup timer"),
+                )
+            }
+            None => Wakeup::Poll(AlsaPoll::new(&pcm)),
+        };
+        clock::enable_timestamps(&pcm);
 
         Self {
             pcm,
-            async_fd,
-            poll_fd: *poll_fd,
-            rate,
+            wakeup,
+            rate: negotiated.rate,
+            period_size: negotiated.period_size,
+            channels: negotiated.channels,
+            woken: Default::default(),
+            room: Default::default(),
+            clock: std::cell::Cell::new(clock::Clock::new(negotiated.rate)),
+            stats: Default::default(),
         }
     }
 
+    /// Where what's been written so far will be played, as of the last wakeup.
+    #[inline]
+    pub fn clock(&self) -> clock::Clock {
+        self.clock.get()
+    }
+
+    #[inline]
+    pub fn stats(&self) -> &std::sync::Arc<stats::Stats> {
+        &self.stats
+    }
+
     #[inline]
     fn get_rate(&self) -> f32 {
         self.rate
     }
 
-    fn get_interest(&self) -> tokio::io::Interest {
-        use tokio::io::Interest;
+    #[inline]
+    fn get_period_size(&self) -> usize {
+        self.period_size
+    }
 
-        // Even for write only use like this, alsa often requires read events, since it's asking
-        // you to wait on a status pipe rather than the underlying audio device.
+    #[inline]
+    fn get_channels(&self) -> usize {
+        self.channels
+    }
 
-        if self.poll_fd.events & libc::POLLIN != 0 {
-            Interest::READABLE
-        } else if self.poll_fd.events & libc::POLLOUT != 0 {
-            Interest::WRITABLE
-        } else if self.poll_fd.events & libc::POLLERR != 0 {
-            Interest::ERROR
-        } else {
-            panic!("Unknown interest");
+    fn recover(&self, err: alsa::Error) -> std::io::Result<()> {
+        recover_pcm(&self.pcm, err, &self.stats)
+    }
+
+    fn snapshot(&self) -> std::io::Result<clock::Snapshot> {
+        clock::Snapshot::take(&self.pcm).map_err(std::io::Error::other)
+    }
+
+    /// Take the one status snapshot of a wakeup, recovering from any xrun first, and record the
+    /// wakeup.  The room it reports is what writes go by until the next one.
+    fn on_wakeup(&self) -> std::io::Result<clock::Snapshot> {
+        trace::instant(trace::Stage::Wakeup);
+        let start = trace::begin();
+        let mut snapshot = self.snapshot()?;
+        if snapshot.needs_recovery() {
+            // An xrun costs a few milliseconds of silence while we prepare the stream again,
+            // after which writing restarts it.  avail_update reports it as the error that
+            // recovering expects.
+            if let Err(err) = self.pcm.avail_update() {
+                self.recover(err)?;
+            }
+            snapshot = self.snapshot()?;
         }
+        trace::end(trace::Stage::Avail, start, snapshot.avail);
+
+        self.stats.record_wakeup();
+        self.stats.record_delay(snapshot.delay);
+        self.room.set(snapshot.avail);
+        let mut clock = self.clock.get();
+        clock.update(&snapshot);
+        self.clock.set(clock);
+        Ok(snapshot)
+    }
+
+    /// Log a write of `count` frames, and when the clock says the last of them will be heard.
+    fn print_written(&self, count: usize) {
+        let clock = self.clock.get();
+        match clock.time_of(clock.written()) {
+            Some(at) => println!(
+                "{count}, heard in {:.2}ms",
+                1e3 * (at - clock::monotonic_now())
+            ),
+            None => println!("{count}"),
+        }
+    }
+
+    /// Record `frames` written to the room and the clock.
+    fn wrote(&self, frames: usize) {
+        self.room.set(self.room.get().saturating_sub(frames));
+        let mut clock = self.clock.get();
+        clock.wrote(frames);
+        self.clock.set(clock);
     }
 }
 
@@ -91,126 +428,307 @@ impl<'p, Sample: alsa::pcm::IoFormat> AlsaWriter<'p, Sample> {
         Self(playback, playback.pcm.io_checked().expect("Wrong format"))
     }
 
-    pub async fn write(&self, to_send: &[Sample]) -> std::io::Result<usize> {
-        let interest = self.0.get_interest();
-        let mut guard = self
-            .0
-            .async_fd
-            .ready(interest)
-            .await
-            .expect("Failed to get asyncfd guard");
-        let io_result = guard.try_io(|_fd| {
-            // As this is an example program for async i/o only, we are not handling XRUN or other
-            // failures, just aborting to keep the code clear to understand the primary point.
-
-            //let current_state = pcm.state();
-            //assert_eq!(current_state, alsa::pcm::State::Running);
-
-            let fds = [libc::pollfd {
-                fd: self.0.poll_fd.fd,
-                events: self.0.poll_fd.events,
-                revents: if interest.is_readable() {
-                    libc::POLLIN
-                } else {
-                    0
-                } | if interest.is_writable() {
-                    libc::POLLOUT
-                } else {
-                    0
-                } | if interest.is_error() {
-                    libc::POLLERR
-                } else {
-                    0
-                },
-            }];
-
-            // Since ALSA may have asked for a POLLIN event for us to write (since it's actually
-            // waiting on a status pipe), we need to remap that back to OUT, some alsa plugins
-            // rely on this to perform some internal book keeping updates.  This does that.
-            let flags = alsa::poll::Descriptors::revents(&self.0.pcm, &fds)
-                .expect("Failed to alsa revents");
-
-            self.0
-                .pcm
-                .avail_update()
-                .expect("Failed to update ALSA avail");
-
-            let delay = self.0.pcm.delay().expect("couldn't get delay");
-            let rate = self.0.get_rate();
-            let delay_ms = 1000.0 * delay as f32 / rate;
-
-            println!("flags={flags:?}  delay={delay_ms}ms");
+    /// Wait for ALSA to become writable, then call `f` to perform the I/O.  `f` may return
+    /// `WouldBlock` to go back to waiting.
+    fn poll_when_writable<R>(
+        &self,
+        cx: &mut std::task::Context<'_>,
+        mut f: impl FnMut() -> std::io::Result<R>,
+    ) -> std::task::Poll<std::io::Result<R>> {
+        let poll = match &self.0.wakeup {
+            Wakeup::Poll(poll) => poll,
+            Wakeup::Timer(timer) => return self.poll_when_timer_fires(cx, timer, f),
+        };
+
+        poll.poll_ready(&self.0.pcm, cx, |flags| {
+            let snapshot = self.0.on_wakeup()?;
+            if stats::verbose() {
+                let delay_ms = 1000.0 * snapshot.delay as f32 / self.0.get_rate();
+                println!("flags={flags:?}  delay={delay_ms}ms");
+            }
             if flags.contains(alsa::poll::Flags::OUT) {
-                let frames = self.0.pcm.avail().unwrap();
-                let count = self
-                    .1
-                    .writei(&to_send[..std::cmp::min(frames as usize, to_send.len())])
-                    .expect("write failed");
-                println!("{count}");
-                Ok(count)
+                // Keep the earliest wakeup if the last one didn't lead to a write.
+                if self.0.woken.get().is_none() {
+                    self.0.woken.set(Some(std::time::Instant::now()));
+                }
+                f()
             } else {
                 // ALSA is NOT ready for writing according to its internal logic (alsa_flags).
-                // Return WouldBlock to prevent the spin: this tells Tokio to re-poll the FD.
-                Err(std::io::Error::new(
-                    std::io::ErrorKind::WouldBlock,
-                    "ALSA not ready for write according to its revents flags",
-                ))
+                // Return WouldBlock to prevent the spin: this tells Tokio to re-poll the FD.  It's
+                // made from just the kind, as one with a message would allocate.
+                Err(std::io::ErrorKind::WouldBlock.into())
             }
-        });
+        })
+    }
+
+    /// Like `poll_when_writable`, but woken by `timer` rather than ALSA.  The timer is rearmed
+    /// after every call to `f`.
+    fn poll_when_timer_fires<R>(
+        &self,
+        cx: &mut std::task::Context<'_>,
+        timer: &timer::WakeupTimer,
+        mut f: impl FnMut() -> std::io::Result<R>,
+    ) -> std::task::Poll<std::io::Result<R>> {
+        loop {
+            std::task::ready!(timer.poll_fired(cx))?;
+
+            let mut taken = None;
+            let result = self.0.on_wakeup().and_then(|snapshot| {
+                taken = Some(snapshot);
+                if stats::verbose() {
+                    let delay_ms = 1000.0 * snapshot.delay as f32 / self.0.get_rate();
+                    println!("timer  delay={delay_ms}ms");
+                }
+                if self.0.woken.get().is_none() {
+                    self.0.woken.set(Some(std::time::Instant::now()));
+                }
+                f()
+            });
+            match taken {
+                // Whatever `f` wrote has used up that much of the snapshot's room.
+                Some(snapshot) => {
+                    timer.arm(&snapshot, snapshot.avail.saturating_sub(self.0.room.get()))?
+                }
+                None => timer.fire_now()?,
+            }
+
+            match result {
+                Err(err) if err.kind() == std::io::ErrorKind::WouldBlock => continue,
+                result => return std::task::Poll::Ready(result),
+            }
+        }
+    }
+
+    /// Write as many whole frames of `to_send` as the last wakeup's snapshot says there's room
+    /// for, without waiting, returning how many samples were written.  With no room, returns
+    /// `WouldBlock`, which from `poll_write` goes back to waiting on the descriptor.
+    pub fn write_now(&self, to_send: &[Sample]) -> std::io::Result<usize> {
+        let channels = self.0.get_channels();
+        let requested = std::cmp::min(self.0.room.get(), to_send.len() / channels);
+        if requested == 0 {
+            // Rather than a zero length writei, after which the descriptor would stay ready and
+            // we'd spin taking snapshots.
+            return Err(std::io::ErrorKind::WouldBlock.into());
+        }
+        let start = trace::begin();
+        let result = self.1.writei(&to_send[..requested * channels]);
+        trace::end(trace::Stage::Write, start, *result.as_ref().unwrap_or(&0));
+        let count = match result {
+            Ok(count) => count,
+            Err(err) => {
+                self.0.recover(err)?;
+                0
+            }
+        };
+        self.0.wrote(count);
+        self.0.stats.record_write(requested, count);
+        if let Some(woken) = self.0.woken.take() {
+            self.0.stats.record_latency(woken);
+        }
+        if stats::verbose() {
+            self.0.print_written(count);
+        }
+        Ok(count * channels)
+    }
+
+    /// Wait until ALSA is writable, then write as many whole frames of `to_send` as it has room
+    /// for, returning how many samples were written.
+    pub fn poll_write(
+        &self,
+        cx: &mut std::task::Context<'_>,
+        to_send: &[Sample],
+    ) -> std::task::Poll<std::io::Result<usize>> {
+        self.poll_when_writable(cx, || self.write_now(to_send))
+    }
 
-        match io_result {
-            Ok(Ok(count)) => Ok(count),
-            Ok(Err(err)) => Err(err),
-            Err(_would_block) => Ok(0),
+    pub async fn write(&self, to_send: &[Sample]) -> std::io::Result<usize> {
+        std::future::poll_fn(|cx| self.poll_write(cx, to_send)).await
+    }
+
+    /// For non-interleaved access: write as many frames from the start of each channel's plane
+    /// as the last wakeup's snapshot says there's room for, with `snd_pcm_writen`, without
+    /// waiting, returning how many frames were written.  With no room, returns `WouldBlock`, as
+    /// `write_now` does.
+    pub fn write_planar_now(&self, planes: &[&[Sample]]) -> std::io::Result<usize> {
+        assert_eq!(
+            planes.len(),
+            self.0.get_channels(),
+            "Need a plane per channel"
+        );
+        let len = planes.iter().map(|plane| plane.len()).min().unwrap_or(0);
+        let requested = std::cmp::min(self.0.room.get(), len);
+        if requested == 0 {
+            return Err(std::io::ErrorKind::WouldBlock.into());
+        }
+        let mut pointers = [std::ptr::null(); convert::MAX_CHANNELS];
+        for (pointer, plane) in pointers.iter_mut().zip(planes) {
+            *pointer = plane.as_ptr();
         }
+        let start = trace::begin();
+        // SAFETY: Every pointer is to a plane of at least `requested` samples.
+        let result = unsafe { self.1.writen(&pointers[..planes.len()], requested) };
+        trace::end(trace::Stage::Write, start, *result.as_ref().unwrap_or(&0));
+        let count = match result {
+            Ok(count) => count,
+            Err(err) => {
+                self.0.recover(err)?;
+                0
+            }
+        };
+        self.0.wrote(count);
+        self.0.stats.record_write(requested, count);
+        if let Some(woken) = self.0.woken.take() {
+            self.0.stats.record_latency(woken);
+        }
+        if stats::verbose() {
+            self.0.print_written(count);
+        }
+        Ok(count)
+    }
+
+    /// Wait until ALSA is writable, then write as `write_planar_now` does.
+    pub fn poll_write_planar(
+        &self,
+        cx: &mut std::task::Context<'_>,
+        planes: &[&[Sample]],
+    ) -> std::task::Poll<std::io::Result<usize>> {
+        self.poll_when_writable(cx, || self.write_planar_now(planes))
+    }
+
+    pub async fn write_planar(&self, planes: &[&[Sample]]) -> std::io::Result<usize> {
+        std::future::poll_fn(|cx| self.poll_write_planar(cx, planes)).await
+    }
+
+    /// Wait until ALSA can accept at least one period, and return how many frames can be written
+    /// without blocking, rounded down to a whole number of periods.
+    ///
+    /// Generating exactly this much keeps latency bounded by the ALSA buffer rather than by how
+    /// much we generate ahead of time.
+    pub fn poll_avail(
+        &self,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<usize>> {
+        let period_size = self.0.get_period_size();
+        self.poll_when_writable(cx, || {
+            let frames = self.0.room.get();
+            match frames - frames % period_size {
+                // Less than a period available.
+                0 => Err(std::io::ErrorKind::WouldBlock.into()),
+                frames => Ok(frames),
+            }
+        })
     }
 }
 
 const BUFFER_SIZE: usize = 65536;
 
+/// Buffers samples in a fixed size ring, and writes them to ALSA as it has room for them.
 pub struct AlsaBufferedWriter<'p, Sample>
 where
     Sample: alsa::pcm::IoFormat,
 {
     writer: AlsaWriter<'p, Sample>,
-    buffer: std::collections::VecDeque<Sample>,
+    producer: ring::Producer<Sample>,
+    consumer: ring::Consumer<Sample>,
 }
 
 impl<'p, Sample> AlsaBufferedWriter<'p, Sample>
 where
-    Sample: alsa::pcm::IoFormat,
+    Sample: alsa::pcm::IoFormat + Default,
 {
     pub fn new(writer: AlsaWriter<'p, Sample>) -> Self {
+        let (producer, consumer) = ring::ring_buffer(BUFFER_SIZE);
         Self {
             writer,
-            buffer: Default::default(),
+            producer,
+            consumer,
         }
     }
 
-    pub async fn ready(&mut self) -> std::io::Result<()> {
-        while self.buffer.len() >= BUFFER_SIZE {
-            let (to_send, _) = self.buffer.as_slices();
-            let count = self.writer.write(to_send).await?;
-            self.buffer.drain(..count);
+    /// Write the start of the ring to ALSA, continuing into the part after the wrap if the first
+    /// part was fully written.  Returns the number of samples written.
+    fn poll_drain_some(
+        &mut self,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<usize>> {
+        let channels = self.writer.0.get_channels();
+        let mut scratch = [Sample::default(); convert::MAX_CHANNELS];
+        let mut written = 0;
+        loop {
+            let to_send = self.consumer.as_frames(channels, &mut scratch);
+            if to_send.is_empty() {
+                break;
+            }
+            let count = match self.writer.poll_write(cx, to_send) {
+                std::task::Poll::Ready(result) => result?,
+                std::task::Poll::Pending if written > 0 => break,
+                std::task::Poll::Pending => return std::task::Poll::Pending,
+            };
+            if count == 0 {
+                // Only after recovering from an xrun, which leaves the descriptor ready.  Treat it
+                // as pending rather than spinning through `poll_ready`, but wake straight away,
+                // as no waker has been registered.
+                if written > 0 {
+                    break;
+                }
+                cx.waker().wake_by_ref();
+                return std::task::Poll::Pending;
+            }
+            let partial = count < to_send.len();
+            self.consumer.consume(count);
+            written += count;
+            if partial {
+                break;
+            }
         }
+        std::task::Poll::Ready(Ok(written))
+    }
 
-        Ok(())
+    /// Wait until there is room in the buffer for at least one more sample.
+    pub fn poll_ready(
+        &mut self,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        while self.producer.free_len() == 0 {
+            std::task::ready!(self.poll_drain_some(cx))?;
+        }
+        std::task::Poll::Ready(Ok(()))
     }
 
-    pub fn send(&mut self, sample: Sample) -> std::io::Result<()> {
-        self.buffer.push_back(sample);
-        Ok(())
+    /// Buffer as much of `samples` as will fit, making room by writing to ALSA if the buffer is
+    /// full.  Returns the number of samples accepted.
+    pub fn poll_write(
+        &mut self,
+        cx: &mut std::task::Context<'_>,
+        samples: &[Sample],
+    ) -> std::task::Poll<std::io::Result<usize>> {
+        std::task::ready!(self.poll_ready(cx))?;
+        std::task::Poll::Ready(Ok(self.producer.push_slice(samples)))
     }
 
-    pub async fn flush(&mut self) -> std::io::Result<()> {
-        while !self.buffer.is_empty() {
-            let (to_send, _) = self.buffer.as_slices();
-            let count = self.writer.write(to_send).await?;
-            self.buffer.drain(..count);
+    pub async fn write_all(&mut self, mut samples: &[Sample]) -> std::io::Result<()> {
+        while !samples.is_empty() {
+            let count = std::future::poll_fn(|cx| self.poll_write(cx, samples)).await?;
+            samples = &samples[count..];
         }
         Ok(())
     }
 
+    pub fn poll_flush(
+        &mut self,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        // A trailing partial frame can't be written, so stays buffered until it's completed.
+        while self.consumer.len() >= self.writer.0.get_channels() {
+            std::task::ready!(self.poll_drain_some(cx))?;
+        }
+        std::task::Poll::Ready(Ok(()))
+    }
+
+    pub async fn flush(&mut self) -> std::io::Result<()> {
+        std::future::poll_fn(|cx| self.poll_flush(cx)).await
+    }
+
     pub async fn close(&mut self) -> std::io::Result<()> {
         self.flush().await
         // TODO: Finish the stream
@@ -219,28 +737,28 @@ where
 
 impl<'p, Sample> futures::sink::Sink<Sample> for AlsaBufferedWriter<'p, Sample>
 where
-    Sample: alsa::pcm::IoFormat + Unpin,
+    Sample: alsa::pcm::IoFormat + Default + Unpin,
 {
     type Error = std::io::Error;
 
     fn poll_ready(
-        mut self: std::pin::Pin<&mut Self>,
+        self: std::pin::Pin<&mut Self>,
         cx: &mut std::task::Context<'_>,
     ) -> std::task::Poll<Result<(), Self::Error>> {
-        let p = std::pin::pin!(self.ready());
-        p.poll(cx)
+        self.get_mut().poll_ready(cx)
     }
 
     fn start_send(self: std::pin::Pin<&mut Self>, item: Sample) -> Result<(), Self::Error> {
-        std::pin::pin!(self).send(item)
+        let pushed = self.get_mut().producer.push_slice(&[item]);
+        assert_eq!(pushed, 1, "start_send called without poll_ready");
+        Ok(())
     }
 
     fn poll_flush(
-        mut self: std::pin::Pin<&mut Self>,
+        self: std::pin::Pin<&mut Self>,
         cx: &mut std::task::Context<'_>,
     ) -> std::task::Poll<Result<(), Self::Error>> {
-        let p = std::pin::pin!(self.flush());
-        p.poll(cx)
+        self.get_mut().poll_flush(cx)
     }
 
     fn poll_close(
@@ -251,41 +769,327 @@ where
     }
 }
 
-#[tokio::main]
-async fn main() {
-    const DEVICE_NAME: &str = "default";
-    let mut phase: f32 = 0.0;
+/// Where the mono signal we play comes from.
+#[derive(Debug)]
+enum Signal {
+    /// A single tone, generated in line.
+    Tone(osc::Oscillator),
+    /// Tones generated by separate tasks, and mixed.
+    Mix(mixer::Mixer),
+}
 
-    let alsa = AlsaPlayback::new(DEVICE_NAME);
+impl Signal {
+    /// With `sources` of zero, a single tone.  Otherwise spawn that many tasks producing the first
+    /// `sources` harmonics of `FREQUENCY`, each buffering up to `capacity` samples, mixed at equal
+    /// gain.  Tones are sine waves, or played from `table`.
+    fn new(
+        sources: usize,
+        capacity: usize,
+        rate: f32,
+        stats: &std::sync::Arc<stats::Stats>,
+        table: Option<std::sync::Arc<wavetable::Wavetable>>,
+    ) -> Self {
+        if sources == 0 {
+            return Signal::Tone(osc::Oscillator::new(FREQUENCY, rate, table));
+        }
 
-    let mut data = [0.0; 65536];
+        let mut mixer = mixer::Mixer::new(stats.clone());
+        for harmonic in 1..=sources {
+            let mut writer = mixer.add_source(capacity, 1.0 / sources as f32);
+            let frequency = FREQUENCY * harmonic as f32;
+            let mut tone = osc::Oscillator::new(frequency, rate, table.clone());
+            tokio::spawn(pool::track(async move {
+                let mut block = [0.0; 1024];
+                let mut underruns = 0;
+                let mut check = pool::PeriodCheck::default();
+                loop {
+                    check.period();
+                    tone.fill(&mut block);
+                    writer.write_all(&block).await;
+                    if stats::verbose() && writer.underruns() != underruns {
+                        underruns = writer.underruns();
+                        println!("source {frequency}Hz: {underruns} underruns");
+                    }
+                }
+            }));
+        }
+        Signal::Mix(mixer)
+    }
 
-    let writer = AlsaWriter::new(&alsa);
+    fn fill(&mut self, buffer: &mut [f32]) {
+        match self {
+            Signal::Tone(tone) => tone.fill(buffer),
+            Signal::Mix(mixer) => mixer.mix(buffer),
+        }
+    }
+}
 
-    let use_sink = true;
+/// The table to play `options.waveform` from, or `None` for sine waves.
+fn make_wavetable(options: &options::Options) -> Option<std::sync::Arc<wavetable::Wavetable>> {
+    (options.waveform != wavetable::Waveform::Sine).then(|| {
+        std::sync::Arc::new(wavetable::Wavetable::new(
+            options.waveform,
+            options.interpolation,
+        ))
+    })
+}
 
-    if use_sink {
-        let mut sink = AlsaBufferedWriter::new(writer);
+/// The signal, resampled to the device's rate when it's generated at a different one.
+#[derive(Debug)]
+struct Producer {
+    signal: Signal,
+    resampler: Option<resample::Resampler>,
+}
 
+impl Producer {
+    /// Generate the signal `options` asks for at `rate`, or with `-Q` at `SOURCE_RATE`,
+    /// resampled to `rate`.  `capacity` and `stats` are as for `Signal::new`.
+    fn new(
+        options: &options::Options,
+        capacity: usize,
+        rate: f32,
+        stats: &std::sync::Arc<stats::Stats>,
+    ) -> Self {
+        let resampler = options
+            .resample
+            .filter(|_| rate != SOURCE_RATE as f32)
+            .map(|quality| {
+                println!("Resampling from {SOURCE_RATE} Hz to {rate} Hz");
+                resample::Resampler::new(SOURCE_RATE, rate as u32, quality)
+            });
+        let signal_rate = match resampler {
+            Some(_) => SOURCE_RATE as f32,
+            None => rate,
+        };
+        let signal = Signal::new(
+            options.mix_sources,
+            capacity,
+            signal_rate,
+            stats,
+            make_wavetable(options),
+        );
+        Self { signal, resampler }
+    }
+
+    fn fill(&mut self, buffer: &mut [f32]) {
+        let start = trace::begin();
+        match &mut self.resampler {
+            Some(resampler) => resampler.fill(buffer, |input| self.signal.fill(input)),
+            None => self.signal.fill(buffer),
+        }
+        trace::end(trace::Stage::Generate, start, buffer.len());
+    }
+}
+
+/// Play a tone, or a mix of them, converted to `S`, through this crate's own writers, for the modes
+/// that need them rather than the C core (see `Options::plays_through_core`).
+async fn play<S: convert::Sample>(
+    pcm: alsa::PCM,
+    negotiated: Negotiated,
+    options: &options::Options,
+) {
+    let channels = negotiated.channels;
+    let convert = convert::converter::<S>(channels);
+    let mut mono = vec![0.0; 65536];
+    let mut data = vec![S::default(); mono.len() * channels];
+    let mut check = pool::PeriodCheck::default();
+
+    if let Some(priority) = options.realtime_priority {
+        let mut writer = rt::RtWriter::spawn(pcm, &negotiated, priority, BUFFER_SIZE * channels);
+        tokio::spawn(stats::report(
+            writer.stats().clone(),
+            writer.get_rate(),
+            options.stats_interval,
+        ));
+        let mut signal = Producer::new(options, 2 * mono.len(), writer.get_rate(), writer.stats());
+        loop {
+            check.period();
+            signal.fill(&mut mono);
+            convert(&mut data, &mono);
+            writer
+                .write_all(&data)
+                .await
+                .expect("Failed to queue samples");
+        }
+    }
+
+    let alsa = AlsaPlayback::new(pcm, &negotiated, options.timer_watermark);
+    tokio::spawn(stats::report(
+        alsa.stats().clone(),
+        alsa.get_rate(),
+        options.stats_interval,
+    ));
+
+    let mut signal = Producer::new(options, 2 * mono.len(), alsa.get_rate(), alsa.stats());
+    let writer = AlsaWriter::new(&alsa);
+
+    if options.pcm.planar && !options.low_latency {
+        // Each channel is converted into a contiguous plane of its own, handed to snd_pcm_writen
+        // as is, so there's no interleaving pass.
+        let convert = convert::converter::<S>(1);
+        let mut planes = vec![vec![S::default(); mono.len()]; channels];
         loop {
-            generate_data(&mut data, alsa.get_rate(), &mut phase);
-            println!("phase={phase}");
+            check.period();
+            signal.fill(&mut mono);
+            for plane in &mut planes {
+                convert(plane, &mono);
+            }
 
-            for i in data {
-                use futures::sink::SinkExt as _;
-                sink.feed(i).await.expect("Failed to sink sample");
+            let mut written = 0;
+            while written < mono.len() {
+                let mut parts: [&[S]; convert::MAX_CHANNELS] = [&[]; convert::MAX_CHANNELS];
+                for (part, plane) in parts.iter_mut().zip(&planes) {
+                    *part = &plane[written..];
+                }
+                written += writer
+                    .write_planar(&parts[..channels])
+                    .await
+                    .expect("Failed to write");
             }
         }
+    } else if options.low_latency {
+        // Only generate a period at a time, pulled through the pipeline once ALSA has room for
+        // it.
+        use futures::StreamExt as _;
+        use futures::future::Either;
+
+        let period_size = alsa.get_period_size();
+        let Producer {
+            signal: mut tone,
+            resampler,
+        } = signal;
+        let blocks = pipeline::generate(period_size, move |block| tone.fill(block));
+        let blocks = match resampler {
+            Some(resampler) => Either::Left(pipeline::Resample::new(
+                blocks,
+                resampler,
+                period_size,
+                period_size,
+            )),
+            None => Either::Right(blocks),
+        };
+        let blocks = match options.gain_db {
+            0.0 => Either::Right(blocks),
+            db => Either::Left(pipeline::Gain::new(blocks, db)),
+        };
+        blocks
+            .map(Ok)
+            .forward(pipeline::AlsaSink::new(
+                writer,
+                period_size,
+                options.pcm.planar,
+            ))
+            .await
+            .expect("Failed to write");
     } else {
         let mut buffered = AlsaBufferedWriter::new(writer);
         loop {
-            generate_data(&mut data, alsa.get_rate(), &mut phase);
-            println!("phase={phase}");
-
-            for i in data {
-                buffered.ready().await.expect("Failed to become ready");
-                buffered.send(i).expect("Failed to send sample");
+            check.period();
+            signal.fill(&mut mono);
+            convert(&mut data, &mono);
+            if stats::verbose() {
+                println!("{signal:?}");
             }
+
+            buffered
+                .write_all(&data)
+                .await
+                .expect("Failed to write samples");
         }
     }
 }
+
+/// Record from `pcm`, printing the peak level once a second.
+async fn monitor_capture<S: convert::Sample>(pcm: alsa::PCM, negotiated: Negotiated) {
+    use futures::StreamExt as _;
+
+    let capture = capture::AlsaCapture::new(pcm, &negotiated);
+    let mut periods = capture::Periods::new(capture::AlsaReader::<S>::new(&capture));
+    let mut peak = 0.0f32;
+    let mut frames = 0;
+    let mut check = pool::PeriodCheck::default();
+
+    while let Some(chunk) = periods.next().await {
+        check.period();
+        let chunk = chunk.expect("Failed to capture");
+        peak = chunk
+            .iter()
+            .fold(peak, |peak, &sample| peak.max(sample.to_f32().abs()));
+        frames += chunk.len() / negotiated.channels;
+        periods.recycle(chunk);
+
+        if frames as f32 >= negotiated.rate {
+            println!("capture: peak {:.1} dBFS", 20.0 * peak.log10());
+            peak = 0.0;
+            frames = 0;
+        }
+    }
+}
+
+#[tokio::main]
+async fn main() {
+    use alsa::pcm::Format;
+
+    let options = options::Options::from_args();
+    stats::set_verbose(options.verbose);
+    if let Some(path) = &options.trace {
+        if options.plays_through_core() {
+            alsaplay::trace(path);
+        } else {
+            trace::open(path);
+        }
+    }
+
+    let playback = async {
+        if options.plays_through_core() {
+            return alsaplay::play(&options).await;
+        }
+        if !options.output_devices.is_empty() {
+            return multi::play(&options).await;
+        }
+
+        let (pcm, negotiated) = open_pcm(&options.device, alsa::Direction::Playback, &options.pcm);
+        match negotiated.format {
+            Format::FloatLE => play::<f32>(pcm, negotiated, &options).await,
+            Format::S32LE => play::<i32>(pcm, negotiated, &options).await,
+            Format::S243LE => play::<convert::S24Packed>(pcm, negotiated, &options).await,
+            Format::S16LE => play::<i16>(pcm, negotiated, &options).await,
+            format => panic!("No converter for {format:?}"),
+        }
+    };
+
+    // PCMs aren't Sync, so capture runs alongside playback in this task rather than being
+    // spawned.
+    let capture = async {
+        let Some(device) = &options.capture_device else {
+            return;
+        };
+        let (pcm, negotiated) = open_pcm(device, alsa::Direction::Capture, &options.pcm);
+        match negotiated.format {
+            Format::FloatLE => monitor_capture::<f32>(pcm, negotiated).await,
+            Format::S32LE => monitor_capture::<i32>(pcm, negotiated).await,
+            Format::S243LE => monitor_capture::<convert::S24Packed>(pcm, negotiated).await,
+            Format::S16LE => monitor_capture::<i16>(pcm, negotiated).await,
+            format => panic!("No converter for {format:?}"),
+        }
+    };
+
+    // On SIGTERM or SIGINT, return from main rather than being killed, so the devices are closed
+    // and builds instrumented for PGO write out their profiles.
+    let stop = async {
+        use tokio::signal::unix::{SignalKind, signal};
+
+        let mut terminate = signal(SignalKind::terminate()).expect("Couldn't handle SIGTERM");
+        let mut interrupt = signal(SignalKind::interrupt()).expect("Couldn't handle SIGINT");
+        tokio::select! {
+            _ = terminate.recv() => {}
+            _ = interrupt.recv() => {}
+        }
+    };
+
+    // Everything either does once it's running is on the audio path, so shouldn't allocate.
+    tokio::select! {
+        _ = futures::future::join(pool::track(playback), pool::track(capture)) => {}
+        _ = stop => {}
+    }
+}
@@ -0,0 +1,136 @@
+//! Mixes any number of independently produced mono streams into the one we play.
+//!
+//! Each source is fed through its own SPSC ring, from whatever task or thread produces it, and
+//! has its own gain.  A source that can't keep up doesn't hold the others back: whatever it's
+//! missing is mixed as silence, and counted as an underrun.
+
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+use crate::ring;
+use crate::stats::Stats;
+
+struct Shared {
+    /// Woken by the mixer whenever it frees up space in the ring.
+    space: futures::task::AtomicWaker,
+    underruns: AtomicU64,
+    /// Set once the producer is dropped, after which the source is removed once drained.
+    closed: AtomicBool,
+}
+
+struct Source {
+    consumer: ring::Consumer<f32>,
+    gain: f32,
+    shared: Arc<Shared>,
+}
+
+/// The producing end of one of the mixer's sources.
+pub struct SourceWriter {
+    producer: ring::Producer<f32>,
+    shared: Arc<Shared>,
+}
+
+impl SourceWriter {
+    /// How many times the mixer has run out of samples from this source.
+    pub fn underruns(&self) -> u64 {
+        self.shared.underruns.load(Ordering::Relaxed)
+    }
+
+    /// Queue as much of `samples` as there is room for, waiting for the mixer to make room if the
+    /// queue is full.  Returns the number of samples queued.
+    pub fn poll_write(
+        &mut self,
+        cx: &mut std::task::Context<'_>,
+        samples: &[f32],
+    ) -> std::task::Poll<usize> {
+        if self.producer.free_len() == 0 {
+            self.shared.space.register(cx.waker());
+            // Check again, in case the mixer made room before we registered.
+            if self.producer.free_len() == 0 {
+                return std::task::Poll::Pending;
+            }
+        }
+
+        std::task::Poll::Ready(self.producer.push_slice(samples))
+    }
+
+    pub async fn write_all(&mut self, mut samples: &[f32]) {
+        while !samples.is_empty() {
+            let count = std::future::poll_fn(|cx| self.poll_write(cx, samples)).await;
+            samples = &samples[count..];
+        }
+    }
+}
+
+impl Drop for SourceWriter {
+    fn drop(&mut self) {
+        self.shared.closed.store(true, Ordering::Release);
+    }
+}
+
+pub struct Mixer {
+    sources: Vec<Source>,
+    stats: Arc<Stats>,
+}
+
+impl std::fmt::Debug for Mixer {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "Mixer {{ sources: {} }}", self.sources.len())
+    }
+}
+
+impl Mixer {
+    /// Source underruns are counted in `stats` as well as per source.
+    pub fn new(stats: Arc<Stats>) -> Self {
+        Self {
+            sources: Vec::new(),
+            stats,
+        }
+    }
+
+    /// Add a source buffering up to `capacity` samples, mixed in at `gain`.
+    pub fn add_source(&mut self, capacity: usize, gain: f32) -> SourceWriter {
+        let (producer, consumer) = ring::ring_buffer(capacity);
+        let shared = Arc::new(Shared {
+            space: futures::task::AtomicWaker::new(),
+            underruns: AtomicU64::new(0),
+            closed: AtomicBool::new(false),
+        });
+        self.sources.push(Source {
+            consumer,
+            gain,
+            shared: shared.clone(),
+        });
+        SourceWriter { producer, shared }
+    }
+
+    /// Fill `out` with the sum of every source's next `out.len()` samples, scaled by its gain.
+    pub fn mix(&mut self, out: &mut [f32]) {
+        out.fill(0.0);
+
+        for source in &mut self.sources {
+            let gain = source.gain;
+            let (first, second) = source.consumer.as_slices();
+            let mut mixed = 0;
+            for part in [first, second] {
+                let dest = &mut out[mixed..];
+                let count = std::cmp::min(part.len(), dest.len());
+                for (dest, &sample) in dest.iter_mut().zip(&part[..count]) {
+                    *dest += gain * sample;
+                }
+                mixed += count;
+            }
+
+            source.consumer.consume(mixed);
+            source.shared.space.wake();
+            if mixed < out.len() && !source.shared.closed.load(Ordering::Acquire) {
+                source.shared.underruns.fetch_add(1, Ordering::Relaxed);
+                self.stats.record_source_underrun();
+            }
+        }
+
+        self.sources.retain(|source| {
+            !source.shared.closed.load(Ordering::Acquire) || source.consumer.len() > 0
+        });
+    }
+}
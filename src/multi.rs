@@ -0,0 +1,276 @@
+//! Playing to several devices at once, each from its own worker thread.
+//!
+//! Every device gets a thread of its own, optionally pinned to a CPU and run at `SCHED_FIFO`, so
+//! one card's poll loop never waits behind another's.  Each card runs off its own crystal, so left
+//! alone they drift apart.  To stop that, every worker compares when its device says it was
+//! playing a frame against a `CLOCK_MONOTONIC` start time shared by all of them, and plays its
+//! tone a little faster or slower to stay locked to it.
+
+use std::sync::Arc;
+
+use crate::Negotiated;
+use crate::clock::{self, Snapshot};
+use crate::convert;
+use crate::osc;
+use crate::stats::{self, Stats};
+use crate::trace::{self, Stage};
+use crate::wavetable::Wavetable;
+
+/// How much of the timing error, in seconds, to correct the playback rate by, and how much of
+/// the error accumulated over each second.  Together these settle within a few seconds, without
+/// overshooting.
+const KP: f64 = 0.5;
+const KI: f64 = 0.05;
+/// The most the playback rate is corrected by, well beyond any real crystal's tolerance.
+const MAX_CORRECTION: f64 = 0.01;
+/// How often each worker measures its device's timing, in seconds.
+const MEASURE_INTERVAL: f64 = 0.1;
+
+/// Restrict the current thread to `cpu`.  Failure is reported but not fatal.
+fn pin_to_cpu(cpu: usize) {
+    // SAFETY: cpu_set_t is plain data, passed to libc along with its size.
+    let err = unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(cpu, &mut set);
+        libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set)
+    };
+    if err != 0 {
+        eprintln!(
+            "Couldn't pin to CPU {cpu}: {}",
+            std::io::Error::last_os_error()
+        );
+    }
+}
+
+/// Locks the content written to a device to the reference clock.  Content time is measured in
+/// seconds since the shared start, and each frame written carries `step` seconds of it.
+#[derive(Debug)]
+struct Drift {
+    nominal: f64,
+    step: f64,
+    /// The content time of the end of what's been written.
+    written: f64,
+    integral: f64,
+    locked: bool,
+    /// The last error measured, for reporting.
+    error: f64,
+}
+
+impl Drift {
+    fn new(rate: f32) -> Self {
+        let nominal = 1.0 / rate as f64;
+        Self {
+            nominal,
+            step: nominal,
+            written: 0.0,
+            integral: 0.0,
+            locked: false,
+            error: 0.0,
+        }
+    }
+
+    fn wrote(&mut self, frames: usize) {
+        self.written += frames as f64 * self.step;
+    }
+
+    /// The device was playing the frame `delay` frames before the end of what's been written at
+    /// `now`, in seconds since the shared start.  Correct the playback rate so the two converge.
+    /// The first measurement jumps straight there instead, and returns how many seconds of
+    /// content to skip.
+    fn measure(&mut self, now: f64, delay: alsa::pcm::Frames) -> f64 {
+        let playing = self.written - delay as f64 * self.step;
+        let error = now - playing;
+        if !self.locked {
+            self.locked = true;
+            self.written += error;
+            return error;
+        }
+
+        self.error = error;
+        self.integral =
+            (self.integral + KI * MEASURE_INTERVAL * error).clamp(-MAX_CORRECTION, MAX_CORRECTION);
+        let correction = (KP * error + self.integral).clamp(-MAX_CORRECTION, MAX_CORRECTION);
+        self.step = self.nominal * (1.0 + correction);
+        0.0
+    }
+
+    /// An xrun loses track of where the device is, so jump back into line on the next
+    /// measurement.  The integral, which has learnt the device's drift, is kept.
+    fn unlock(&mut self) {
+        self.locked = false;
+    }
+
+    /// How much faster than nominal content is being played.
+    fn ratio(&self) -> f64 {
+        self.step / self.nominal
+    }
+}
+
+fn recover(pcm: &alsa::PCM, err: alsa::Error, stats: &Stats) {
+    crate::recover_pcm(pcm, err, stats).expect("Failed to recover from ALSA error");
+}
+
+/// Play a tone to `pcm` indefinitely, locked to the reference clock from `start`.
+fn pump<S: convert::Sample>(
+    device: &str,
+    pcm: alsa::PCM,
+    negotiated: Negotiated,
+    start: f64,
+    table: Option<Arc<Wavetable>>,
+    stats: &Stats,
+) {
+    let Negotiated {
+        rate,
+        channels,
+        buffer_size,
+        ..
+    } = negotiated;
+    let io = pcm.io_checked::<S>().expect("Wrong format");
+    let convert = convert::converter::<S>(channels);
+    // Allocated up front, so nothing allocates once we're running.
+    let mut mono = vec![0.0; buffer_size];
+    let mut data = vec![S::default(); buffer_size * channels];
+    let mut tone = osc::Oscillator::new(crate::FREQUENCY, rate, table);
+    let mut drift = Drift::new(rate);
+    let mut next_measure = clock::monotonic_now();
+    let mut measurements = 0u64;
+    let mut check = crate::pool::PeriodCheck::default();
+
+    loop {
+        check.period();
+        // The timeout is just so a stuck device is noticed, as the stats stop changing.
+        if let Err(err) = pcm.wait(Some(100)) {
+            recover(&pcm, err, stats);
+            drift.unlock();
+            continue;
+        }
+
+        let woken = std::time::Instant::now();
+        stats.record_wakeup();
+        trace::instant(Stage::Wakeup);
+        let traced = trace::begin();
+        let frames = match pcm.avail_update() {
+            Ok(avail) => std::cmp::min(avail as usize, buffer_size),
+            Err(err) => {
+                recover(&pcm, err, stats);
+                drift.unlock();
+                continue;
+            }
+        };
+        trace::end(Stage::Avail, traced, frames);
+        if frames == 0 {
+            continue;
+        }
+
+        let traced = trace::begin();
+        tone.fill(&mut mono[..frames]);
+        trace::end(Stage::Generate, traced, frames);
+        convert(&mut data[..frames * channels], &mono[..frames]);
+        let traced = trace::begin();
+        let result = io.writei(&data[..frames * channels]);
+        trace::end(Stage::Write, traced, *result.as_ref().unwrap_or(&0));
+        match result {
+            Ok(count) => {
+                stats.record_write(frames, count);
+                stats.record_latency(woken);
+                drift.wrote(count);
+            }
+            Err(err) => {
+                recover(&pcm, err, stats);
+                drift.unlock();
+                continue;
+            }
+        }
+
+        let now = clock::monotonic_now();
+        if now < next_measure {
+            continue;
+        }
+        next_measure = now + MEASURE_INTERVAL;
+        let Ok(snapshot) = Snapshot::take(&pcm) else {
+            continue;
+        };
+        // There's no timestamp until the device has started.
+        if snapshot.state != alsa::pcm::State::Running {
+            continue;
+        }
+        stats.record_delay(snapshot.delay);
+
+        let skip = drift.measure(snapshot.htstamp - start, snapshot.delay);
+        tone.skip(skip * crate::FREQUENCY as f64);
+        tone.retune((crate::FREQUENCY as f64 * drift.ratio()) as f32, rate);
+
+        measurements += 1;
+        if stats::verbose() && measurements % 10 == 0 {
+            println!(
+                "{device}: {:+.1} ppm, {:+.3} ms from the reference clock",
+                1e6 * (drift.ratio() - 1.0),
+                1e3 * drift.error,
+            );
+        }
+    }
+}
+
+fn spawn<S: convert::Sample>(
+    device: String,
+    pcm: alsa::PCM,
+    negotiated: Negotiated,
+    cpu: Option<usize>,
+    options: &crate::options::Options,
+    start: f64,
+    stats: Arc<Stats>,
+) -> std::thread::JoinHandle<()> {
+    let priority = options.realtime_priority;
+    let table = crate::make_wavetable(options);
+    std::thread::Builder::new()
+        .name(format!("alsa-{device}"))
+        .spawn(move || {
+            if let Some(cpu) = cpu {
+                pin_to_cpu(cpu);
+            }
+            if let Some(priority) = priority {
+                crate::rt::make_realtime(priority);
+            }
+            crate::pool::run_tracked(|| pump::<S>(&device, pcm, negotiated, start, table, &stats));
+        })
+        .expect("Failed to spawn worker thread")
+}
+
+/// Play to every one of `options.output_devices`, each from its own worker thread pinned to the
+/// corresponding entry of `options.affinity`.  Runs until a worker fails.
+pub async fn play(options: &crate::options::Options) {
+    use alsa::pcm::Format;
+
+    let start = clock::monotonic_now();
+    let mut workers = Vec::new();
+    for (i, device) in options.output_devices.iter().enumerate() {
+        let (pcm, negotiated) = crate::open_pcm(device, alsa::Direction::Playback, &options.pcm);
+        clock::enable_timestamps(&pcm);
+
+        let stats = Arc::<Stats>::default();
+        tokio::spawn(stats::report(
+            stats.clone(),
+            negotiated.rate,
+            options.stats_interval,
+        ));
+
+        let cpu = options.affinity.get(i).copied();
+        let device = device.clone();
+        let spawn = match negotiated.format {
+            Format::FloatLE => spawn::<f32>,
+            Format::S32LE => spawn::<i32>,
+            Format::S243LE => spawn::<convert::S24Packed>,
+            Format::S16LE => spawn::<i16>,
+            format => panic!("No converter for {format:?}"),
+        };
+        workers.push(spawn(device, pcm, negotiated, cpu, options, start, stats));
+    }
+
+    tokio::task::spawn_blocking(move || {
+        for worker in workers {
+            worker.join().expect("Worker thread failed");
+        }
+    })
+    .await
+    .expect("Failed to wait for workers");
+}
@@ -0,0 +1,228 @@
+//! Command line options.
+
+/// Parameters to request from ALSA.  `None` leaves the parameter at whatever ALSA picks, except
+/// for the format and channels, which are picked from what there are converters for.
+#[derive(Debug, Default, Clone)]
+pub struct PcmConfig {
+    pub format: Option<alsa::pcm::Format>,
+    pub channels: Option<u32>,
+    pub buffer_time_us: Option<u32>,
+    pub period_time_us: Option<u32>,
+    pub avail_min: Option<alsa::pcm::Frames>,
+    pub start_threshold: Option<alsa::pcm::Frames>,
+    /// Skip the `snd_pcm_dump` libalsaplay prints after opening.
+    pub no_dump: bool,
+    /// Non-interleaved access, with a buffer per channel.
+    pub planar: bool,
+    /// Take the device's own rate nearest the one asked for, rather than letting the plug layer
+    /// resample to it.
+    pub native_rate: bool,
+}
+
+#[derive(Debug, Default)]
+pub struct Options {
+    pub device: String,
+    /// Play to all of these devices instead, each from its own thread, kept in step.
+    pub output_devices: Vec<String>,
+    /// Pin the thread for each of `output_devices` to the corresponding CPU.
+    pub affinity: Vec<usize>,
+    /// Record from this device at the same time as playing.
+    pub capture_device: Option<String>,
+    /// Only generate as many whole periods as ALSA can accept, rather than a large block ahead.
+    pub low_latency: bool,
+    /// Gain in dB applied by the low latency pipeline.
+    pub gain_db: f32,
+    /// Wake on a timer when this much audio is left in the buffer, rather than polling ALSA.
+    pub timer_watermark: Option<std::time::Duration>,
+    /// Mix this many tones, each produced by its own task, rather than playing just one.
+    pub mix_sources: usize,
+    /// The waveform of each tone, and how its wavetable is interpolated.
+    pub waveform: crate::wavetable::Waveform,
+    pub interpolation: crate::wavetable::Interpolation,
+    /// Open the device at its native rate, and resample to it at this quality.
+    pub resample: Option<crate::resample::Quality>,
+    /// Run the ALSA I/O on a dedicated `SCHED_FIFO` thread at this priority.
+    pub realtime_priority: Option<i32>,
+    /// Log every wakeup and write.
+    pub verbose: bool,
+    /// Print stats this often (they are also printed on SIGUSR1).
+    pub stats_interval: Option<std::time::Duration>,
+    /// Record each stage of every wakeup into a trace ring in this file.
+    pub trace: Option<std::path::PathBuf>,
+    pub pcm: PcmConfig,
+}
+
+const USAGE: &str = "\
+Usage: alsa-test [-n] [-l] [-g dB] [-T us] [-M count] [-w waveform] [-W interp] [-Q quality]
+                 [-R priority] [-t file] [-v] [-i ms] [-D device] [-O device,...] [-a cpu,...] [-r device]
+                 [-f format] [-c count] [-B us] [-F us] [-A frames] [-S frames] [-N]
+  -n         Non-interleaved: one buffer per channel, written with snd_pcm_writen
+  -l         Low latency: only generate as many whole periods as ALSA can accept
+  -g dB      With -l, apply this gain to the tone as a stage of its pipeline
+  -T us      Wake on a timer, when the buffer drains to us microseconds, instead of polling ALSA
+  -M count   Mix count harmonics, each produced by its own task, through the mixer
+  -w wave    Waveform: sine, saw, square or triangle (band limited wavetables except sine)
+  -W interp  Wavetable interpolation: linear or cubic (default linear)
+  -Q qual    Open the device at its native rate, resampling the tone to it: fast, medium or best
+  -R prio    Run ALSA I/O on a dedicated SCHED_FIFO thread at this priority (1-99)
+  -t file    Trace each stage of every wakeup into a ring in file, for trace_dump
+  -v         Log every wakeup and write
+  -i ms      Print stats every ms milliseconds (they are also printed on SIGUSR1)
+  -D device  ALSA device to open (default \"default\")
+  -O devs    Play to each of a comma separated list of devices, from its own thread, kept in step
+  -a cpus    Pin the thread for each -O device to the corresponding CPU in a comma separated list
+  -r device  Record from device at the same time, printing the peak level every second
+  -f format  Sample format: FLOAT_LE, S32_LE, S24_3LE or S16_LE
+  -c count   Number of channels (1-8)
+  -B us      Buffer time in microseconds
+  -F us      Period time in microseconds
+  -A frames  Minimum frames available before waking up (avail_min)
+  -S frames  Frames queued before playback starts (start_threshold)
+  -N         Don't dump the PCM setup after opening";
+
+fn usage() -> ! {
+    eprintln!("{USAGE}");
+    std::process::exit(1);
+}
+
+fn parse_value<T: std::str::FromStr>(flag: &str, value: Option<String>) -> T {
+    let Some(value) = value else {
+        eprintln!("{flag}: missing value");
+        usage();
+    };
+    value.parse().unwrap_or_else(|_| {
+        eprintln!("{flag}: invalid number '{value}'");
+        usage();
+    })
+}
+
+fn parse_list<T: std::str::FromStr>(flag: &str, value: Option<String>) -> Vec<T> {
+    let list: String = parse_value(flag, value);
+    list.split(',')
+        .map(|item| parse_value(flag, Some(item.into())))
+        .collect()
+}
+
+impl Options {
+    pub fn from_args() -> Self {
+        let mut options = Self {
+            device: "default".into(),
+            ..Default::default()
+        };
+        let mut args = std::env::args().skip(1);
+
+        while let Some(arg) = args.next() {
+            match arg.as_str() {
+                "-n" => options.pcm.planar = true,
+                "-l" => options.low_latency = true,
+                "-g" => options.gain_db = parse_value(&arg, args.next()),
+                "-T" => {
+                    options.timer_watermark = Some(std::time::Duration::from_micros(parse_value(
+                        &arg,
+                        args.next(),
+                    )))
+                }
+                "-M" => options.mix_sources = parse_value(&arg, args.next()),
+                "-w" => {
+                    let name: String = parse_value(&arg, args.next());
+                    options.waveform =
+                        crate::wavetable::Waveform::parse(&name).unwrap_or_else(|| {
+                            eprintln!("{arg}: unknown waveform '{name}'");
+                            usage();
+                        })
+                }
+                "-W" => {
+                    let name: String = parse_value(&arg, args.next());
+                    options.interpolation = crate::wavetable::Interpolation::parse(&name)
+                        .unwrap_or_else(|| {
+                            eprintln!("{arg}: unknown interpolation '{name}'");
+                            usage();
+                        })
+                }
+                "-Q" => {
+                    let name: String = parse_value(&arg, args.next());
+                    options.resample =
+                        Some(crate::resample::Quality::parse(&name).unwrap_or_else(|| {
+                            eprintln!("{arg}: unknown quality '{name}'");
+                            usage();
+                        }));
+                    options.pcm.native_rate = true;
+                }
+                "-R" => options.realtime_priority = Some(parse_value(&arg, args.next())),
+                "-t" => options.trace = Some(parse_value(&arg, args.next())),
+                "-v" => options.verbose = true,
+                "-i" => {
+                    options.stats_interval = Some(std::time::Duration::from_millis(parse_value(
+                        &arg,
+                        args.next(),
+                    )))
+                }
+                "-D" => options.device = parse_value(&arg, args.next()),
+                "-O" => options.output_devices = parse_list(&arg, args.next()),
+                "-a" => options.affinity = parse_list(&arg, args.next()),
+                "-r" => options.capture_device = Some(parse_value(&arg, args.next())),
+                "-f" => {
+                    let name: String = parse_value(&arg, args.next());
+                    options.pcm.format =
+                        Some(crate::convert::parse_format(&name).unwrap_or_else(|| {
+                            eprintln!("{arg}: unsupported format '{name}'");
+                            usage();
+                        }))
+                }
+                "-c" => match parse_value(&arg, args.next()) {
+                    channels @ 1..=8 => options.pcm.channels = Some(channels),
+                    _ => {
+                        eprintln!("{arg}: between 1 and 8 channels are supported");
+                        usage();
+                    }
+                },
+                "-B" => options.pcm.buffer_time_us = Some(parse_value(&arg, args.next())),
+                "-F" => options.pcm.period_time_us = Some(parse_value(&arg, args.next())),
+                "-A" => options.pcm.avail_min = Some(parse_value(&arg, args.next())),
+                "-S" => options.pcm.start_threshold = Some(parse_value(&arg, args.next())),
+                "-N" => options.pcm.no_dump = true,
+                _ => usage(),
+            }
+        }
+
+        if options.timer_watermark.is_some() && options.realtime_priority.is_some() {
+            eprintln!("-T can't be combined with -R, the audio thread waits on ALSA itself");
+            usage();
+        }
+
+        if options.gain_db != 0.0 && !options.low_latency {
+            eprintln!("-g only applies to the -l pipeline");
+            usage();
+        }
+
+        if options.pcm.planar
+            && (options.realtime_priority.is_some() || !options.output_devices.is_empty())
+        {
+            eprintln!("-n can't be combined with -R or -O, which only write interleaved");
+            usage();
+        }
+
+        if !options.output_devices.is_empty() {
+            if options.timer_watermark.is_some() || options.mix_sources > 0 {
+                eprintln!("-T and -M can't be combined with -O, each thread plays its own tone");
+                usage();
+            }
+            if options.affinity.len() > options.output_devices.len() {
+                eprintln!("-a: more CPUs than -O devices");
+                usage();
+            }
+        }
+
+        options
+    }
+
+    /// Whether to play through libalsaplay, the C core the C programs share (see
+    /// `crate::alsaplay`), rather than this crate's own async writers, which only the pipeline,
+    /// the mixer's tasks, the realtime thread and playing to several devices need.
+    pub fn plays_through_core(&self) -> bool {
+        !self.low_latency
+            && self.mix_sources == 0
+            && self.realtime_priority.is_none()
+            && self.output_devices.is_empty()
+    }
+}
@@ -0,0 +1,324 @@
+//! Playback as a pipeline of streams: a producer yields blocks of mono samples, optional stages
+//! transform them, and an `AlsaSink` at the end converts and writes them.
+//!
+//! Nothing is generated ahead of ALSA.  The sink is only ready for another block once `avail()`
+//! says there's room for it, and `forward` only pulls the next block through the stages once the
+//! sink is ready, so the backpressure reaches all the way back to the producer.  Blocks come from
+//! pools allocated up front, and go back when they're dropped.
+
+use std::sync::{Arc, Mutex};
+
+use crate::convert::{self, Sample};
+use crate::pool::{BlockPool, PeriodCheck};
+use crate::resample::Resampler;
+
+/// Blocks in each pool: enough for one in every stage and one being written, with room to spare.
+const POOL_BLOCKS: usize = 4;
+
+type SharedPool = Arc<Mutex<BlockPool<f32>>>;
+
+fn new_pool(len: usize) -> SharedPool {
+    Arc::new(Mutex::new(BlockPool::new(POOL_BLOCKS, len)))
+}
+
+/// A block of mono samples, handed back to the pool it came from when dropped.
+pub struct Block {
+    samples: Vec<f32>,
+    pool: SharedPool,
+}
+
+impl Block {
+    fn take(pool: &SharedPool) -> Self {
+        let samples = pool.lock().expect("Block pool poisoned").take();
+        Self {
+            samples,
+            pool: pool.clone(),
+        }
+    }
+}
+
+impl std::ops::Deref for Block {
+    type Target = [f32];
+
+    fn deref(&self) -> &[f32] {
+        &self.samples
+    }
+}
+
+impl std::ops::DerefMut for Block {
+    fn deref_mut(&mut self) -> &mut [f32] {
+        &mut self.samples
+    }
+}
+
+impl Drop for Block {
+    fn drop(&mut self) {
+        let samples = std::mem::take(&mut self.samples);
+        self.pool.lock().expect("Block pool poisoned").give(samples);
+    }
+}
+
+/// A producer of blocks of `len` samples from `fill`.  It's always ready, since it's only polled
+/// once there's room for what it makes.
+#[pin_project::pin_project]
+pub struct Generate<F> {
+    fill: F,
+    pool: SharedPool,
+}
+
+pub fn generate<F: FnMut(&mut [f32])>(len: usize, fill: F) -> Generate<F> {
+    Generate {
+        fill,
+        pool: new_pool(len),
+    }
+}
+
+impl<F: FnMut(&mut [f32])> futures::Stream for Generate<F> {
+    type Item = Block;
+
+    fn poll_next(
+        self: std::pin::Pin<&mut Self>,
+        _cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<Option<Block>> {
+        let this = self.project();
+        let mut block = Block::take(this.pool);
+        let start = crate::trace::begin();
+        (this.fill)(&mut block);
+        crate::trace::end(crate::trace::Stage::Generate, start, block.len());
+        std::task::Poll::Ready(Some(block))
+    }
+}
+
+/// Scales every sample of `inner` by a gain given in dB.
+#[pin_project::pin_project]
+pub struct Gain<S> {
+    #[pin]
+    inner: S,
+    gain: f32,
+}
+
+impl<S> Gain<S> {
+    pub fn new(inner: S, db: f32) -> Self {
+        Self {
+            inner,
+            gain: 10f32.powf(db / 20.0),
+        }
+    }
+}
+
+impl<S: futures::Stream<Item = Block>> futures::Stream for Gain<S> {
+    type Item = Block;
+
+    fn poll_next(
+        self: std::pin::Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<Option<Block>> {
+        let this = self.project();
+        let gain = *this.gain;
+        std::task::Poll::Ready(
+            std::task::ready!(this.inner.poll_next(cx)).map(|mut block| {
+                for sample in block.iter_mut() {
+                    *sample *= gain;
+                }
+                block
+            }),
+        )
+    }
+}
+
+/// Resamples `inner` into blocks of `len` samples.  Before each one it pulls exactly as much input
+/// as the resampler will ask for, so the resampler itself never has to wait.
+#[pin_project::pin_project]
+pub struct Resample<S> {
+    #[pin]
+    inner: S,
+    resampler: Resampler,
+    /// Input pulled from `inner` that the resampler hasn't taken yet.
+    input: Vec<f32>,
+    pool: SharedPool,
+    len: usize,
+}
+
+impl<S> Resample<S> {
+    /// `inner`'s blocks are of `in_len` samples.
+    pub fn new(inner: S, resampler: Resampler, in_len: usize, len: usize) -> Self {
+        // Room for the most the resampler can ask for, plus what's left of the last block.
+        let input = Vec::with_capacity(resampler.max_input_for(len) + in_len);
+        Self {
+            inner,
+            resampler,
+            input,
+            pool: new_pool(len),
+            len,
+        }
+    }
+}
+
+impl<S: futures::Stream<Item = Block>> futures::Stream for Resample<S> {
+    type Item = Block;
+
+    fn poll_next(
+        self: std::pin::Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<Option<Block>> {
+        let mut this = self.project();
+        let needed = this.resampler.input_for(*this.len);
+        while this.input.len() < needed {
+            match std::task::ready!(this.inner.as_mut().poll_next(cx)) {
+                Some(block) => this.input.extend_from_slice(&block),
+                None => return std::task::Poll::Ready(None),
+            }
+        }
+
+        let mut block = Block::take(this.pool);
+        let mut used = 0;
+        this.resampler.fill(&mut block, |buffer| {
+            buffer.copy_from_slice(&this.input[used..used + buffer.len()]);
+            used += buffer.len();
+        });
+        this.input.drain(..used);
+        std::task::Poll::Ready(Some(block))
+    }
+}
+
+/// The end of the pipeline, converting each block to the device's format and writing it.  It's
+/// only ready for a block once ALSA has room for all of it.
+pub struct AlsaSink<'p, S: Sample> {
+    writer: crate::AlsaWriter<'p, S>,
+    convert: convert::Converter<S>,
+    channels: usize,
+    /// Non-interleaved, with `data` holding a plane of `block_len` samples per channel, written
+    /// with `snd_pcm_writen`.
+    planar: bool,
+    block_len: usize,
+    /// The last block, converted, of which `written` of `len` frames have been written.
+    data: Vec<S>,
+    len: usize,
+    written: usize,
+    /// Frames ALSA last said it had room for, less what's been written since.
+    room: usize,
+    check: PeriodCheck,
+}
+
+impl<'p, S: Sample> AlsaSink<'p, S> {
+    /// For blocks of up to `block_len` samples, interleaved or, if `planar`, not.
+    pub fn new(writer: crate::AlsaWriter<'p, S>, block_len: usize, planar: bool) -> Self {
+        let channels = writer.0.get_channels();
+        Self {
+            writer,
+            convert: convert::converter::<S>(if planar { 1 } else { channels }),
+            channels,
+            planar,
+            block_len,
+            data: vec![S::default(); block_len * channels],
+            len: 0,
+            written: 0,
+            room: 0,
+            check: Default::default(),
+        }
+    }
+
+    /// What's left of the block in each channel's plane.
+    fn planes(&self) -> [&[S]; convert::MAX_CHANNELS] {
+        let mut planes: [&[S]; convert::MAX_CHANNELS] = [&[]; convert::MAX_CHANNELS];
+        for (plane, data) in planes.iter_mut().zip(self.data.chunks(self.block_len)) {
+            *plane = &data[self.written..self.len];
+        }
+        planes
+    }
+
+    /// What's left of the block, interleaved.
+    fn frames(&self) -> &[S] {
+        &self.data[self.written * self.channels..self.len * self.channels]
+    }
+
+    /// Write some of what's left of the block, once ALSA is writable.
+    fn poll_write_some(
+        &mut self,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        let frames = if self.planar {
+            let planes = self.planes();
+            std::task::ready!(self.writer.poll_write_planar(cx, &planes[..self.channels]))?
+        } else {
+            std::task::ready!(self.writer.poll_write(cx, self.frames()))? / self.channels
+        };
+        self.wrote(frames);
+        std::task::Poll::Ready(Ok(()))
+    }
+
+    /// Record `frames` of the block as written.
+    fn wrote(&mut self, frames: usize) {
+        self.written += frames;
+        self.room = self.room.saturating_sub(frames);
+    }
+}
+
+impl<S: Sample> futures::Sink<Block> for AlsaSink<'_, S> {
+    type Error = std::io::Error;
+
+    fn poll_ready(
+        self: std::pin::Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        let this = self.get_mut();
+        loop {
+            if this.written < this.len {
+                std::task::ready!(this.poll_write_some(cx))?;
+            } else if this.room >= this.block_len {
+                return std::task::Poll::Ready(Ok(()));
+            } else {
+                this.room = std::task::ready!(this.writer.poll_avail(cx))?;
+            }
+        }
+    }
+
+    fn start_send(self: std::pin::Pin<&mut Self>, block: Block) -> std::io::Result<()> {
+        let this = self.get_mut();
+        this.check.period();
+        this.len = block.len();
+        if this.planar {
+            for plane in this.data.chunks_mut(this.block_len) {
+                (this.convert)(&mut plane[..block.len()], &block);
+            }
+        } else {
+            (this.convert)(&mut this.data[..block.len() * this.channels], &block);
+        }
+        this.written = 0;
+
+        // There's room for it, so it should all go now.  If not, poll_ready/poll_flush wait to
+        // write it.
+        let result = if this.planar {
+            let planes = this.planes();
+            this.writer.write_planar_now(&planes[..this.channels])
+        } else {
+            this.writer
+                .write_now(this.frames())
+                .map(|count| count / this.channels)
+        };
+        let frames = match result {
+            Err(err) if err.kind() == std::io::ErrorKind::WouldBlock => 0,
+            result => result?,
+        };
+        this.wrote(frames);
+        Ok(())
+    }
+
+    fn poll_flush(
+        self: std::pin::Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        let this = self.get_mut();
+        while this.written < this.len {
+            std::task::ready!(this.poll_write_some(cx))?;
+        }
+        std::task::Poll::Ready(Ok(()))
+    }
+
+    fn poll_close(
+        self: std::pin::Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        self.poll_flush(cx)
+    }
+}
@@ -0,0 +1,189 @@
+//! Keeping the heap off the audio path.
+//!
+//! `BlockPool` hands out buffers allocated up front, sized from the negotiated period, so a
+//! steady stream of them doesn't go through the allocator.  In debug builds a counting global
+//! allocator checks that claim: a thread run by `run_tracked`, or a future polled through `track`,
+//! counts every allocation it makes, and its `PeriodCheck` panics if any are made once the stream
+//! has warmed up.
+
+/// Periods to allow for lazy setup (registering with the reactor, stdout's buffer, ...) before
+/// allocating is treated as a bug.
+#[cfg(debug_assertions)]
+const WARMUP_PERIODS: u64 = 8;
+
+/// Fixed size blocks, allocated when the pool is created and recycled after that.
+#[derive(Debug)]
+pub struct BlockPool<T> {
+    len: usize,
+    /// Never grown past the capacity it's created with, so handing blocks back doesn't allocate
+    /// either.
+    free: Vec<Vec<T>>,
+}
+
+impl<T: Copy + Default> BlockPool<T> {
+    /// `count` blocks of `len` items each.
+    pub fn new(count: usize, len: usize) -> Self {
+        Self {
+            len,
+            free: (0..count).map(|_| vec![T::default(); len]).collect(),
+        }
+    }
+
+    /// A block, holding whatever it last did.  Only allocates once every block is in use.
+    pub fn take(&mut self) -> Vec<T> {
+        self.free
+            .pop()
+            .unwrap_or_else(|| vec![T::default(); self.len])
+    }
+
+    /// Hand back a block from `take` to be reused.  Blocks of another length, or beyond what the
+    /// pool was created with, are dropped instead.
+    pub fn give(&mut self, block: Vec<T>) {
+        if block.len() == self.len && self.free.len() < self.free.capacity() {
+            self.free.push(block);
+        }
+    }
+}
+
+#[cfg(debug_assertions)]
+mod counting {
+    use std::alloc::{GlobalAlloc, Layout, System};
+    use std::cell::Cell;
+
+    thread_local! {
+        /// What this thread's allocations are being counted against, if anything.
+        pub static CURRENT: Cell<*const Cell<u64>> = const { Cell::new(std::ptr::null()) };
+    }
+
+    /// Run `f`, counting this thread's allocations in `counter` meanwhile.
+    pub fn with_counter<R>(counter: &Cell<u64>, f: impl FnOnce() -> R) -> R {
+        struct Restore(*const Cell<u64>);
+        impl Drop for Restore {
+            fn drop(&mut self) {
+                CURRENT.set(self.0);
+            }
+        }
+
+        let _restore = Restore(CURRENT.replace(counter));
+        f()
+    }
+
+    /// The count for the code currently running, if it's being tracked.
+    pub fn current() -> Option<u64> {
+        // SAFETY: CURRENT only points at a counter while `with_counter` borrows it.
+        unsafe { CURRENT.get().as_ref() }.map(Cell::get)
+    }
+
+    pub struct Counting;
+
+    impl Counting {
+        #[inline]
+        fn count(&self) {
+            // The Cell needs no destructor, so this works even while the thread is exiting.
+            // SAFETY: As in `current`.
+            if let Some(counter) = unsafe { CURRENT.get().as_ref() } {
+                counter.set(counter.get() + 1);
+            }
+        }
+    }
+
+    // SAFETY: Everything is passed straight through to the system allocator.
+    unsafe impl GlobalAlloc for Counting {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            self.count();
+            // SAFETY: As for our caller.
+            unsafe { System.alloc(layout) }
+        }
+
+        unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+            self.count();
+            // SAFETY: As for our caller.
+            unsafe { System.alloc_zeroed(layout) }
+        }
+
+        unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            self.count();
+            // SAFETY: As for our caller.
+            unsafe { System.realloc(ptr, layout, new_size) }
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            // SAFETY: As for our caller.
+            unsafe { System.dealloc(ptr, layout) }
+        }
+    }
+
+    #[global_allocator]
+    static ALLOCATOR: Counting = Counting;
+}
+
+/// Run `f`, the body of a thread on the audio path, so any `PeriodCheck` in it sees what it
+/// allocates.
+pub fn run_tracked<R>(f: impl FnOnce() -> R) -> R {
+    #[cfg(debug_assertions)]
+    return counting::with_counter(&std::cell::Cell::new(0), f);
+    #[cfg(not(debug_assertions))]
+    f()
+}
+
+/// A future whose allocations are counted, for any `PeriodCheck` it runs.  Wherever the task is
+/// polled, it only counts what this future does, not whatever else shares the thread.
+#[pin_project::pin_project]
+pub struct Track<F> {
+    #[pin]
+    inner: F,
+    #[cfg(debug_assertions)]
+    allocations: std::cell::Cell<u64>,
+}
+
+/// Count `future`'s allocations, as a task on the audio path.
+pub fn track<F: std::future::Future>(future: F) -> Track<F> {
+    Track {
+        inner: future,
+        #[cfg(debug_assertions)]
+        allocations: Default::default(),
+    }
+}
+
+impl<F: std::future::Future> std::future::Future for Track<F> {
+    type Output = F::Output;
+
+    fn poll(
+        self: std::pin::Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<F::Output> {
+        let this = self.project();
+        #[cfg(debug_assertions)]
+        return counting::with_counter(this.allocations, || this.inner.poll(cx));
+        #[cfg(not(debug_assertions))]
+        this.inner.poll(cx)
+    }
+}
+
+/// Called once per period of a loop on the audio path, run by `run_tracked` or `track`.  Panics in
+/// debug builds if anything it's tracking has allocated since the last period, after the first
+/// few.
+#[derive(Debug, Default)]
+pub struct PeriodCheck {
+    #[cfg(debug_assertions)]
+    periods: u64,
+    #[cfg(debug_assertions)]
+    allocations: u64,
+}
+
+impl PeriodCheck {
+    #[inline]
+    pub fn period(&mut self) {
+        #[cfg(debug_assertions)]
+        if let Some(allocations) = counting::current() {
+            assert!(
+                self.periods < WARMUP_PERIODS || allocations == self.allocations,
+                "{} heap allocations on the audio path before period {}",
+                allocations - self.allocations,
+                self.periods
+            );
+            self.allocations = allocations;
+            self.periods += 1;
+        }
+    }
+}
@@ -0,0 +1,225 @@
+//! A polyphase resampler, for playing content generated at a fixed rate to a device opened at its
+//! native one, instead of through the plug plugin's generic resampler.
+//!
+//! The ratio between the rates is reduced to `up / down`, and each output sample is one dot
+//! product of the input against one of `up` windowed sinc filters.
+
+const LANES: usize = 8;
+/// Input pulled from the source at a time.
+const BLOCK: usize = 1024;
+/// Ratios that don't reduce to this few phases use the nearest that does, which is off by a
+/// fraction of a cent.
+const MAX_PHASES: u32 = 1024;
+
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub enum Quality {
+    Fast,
+    #[default]
+    Medium,
+    Best,
+}
+
+impl Quality {
+    pub fn parse(name: &str) -> Option<Self> {
+        match name {
+            "fast" => Some(Self::Fast),
+            "medium" => Some(Self::Medium),
+            "best" => Some(Self::Best),
+            _ => None,
+        }
+    }
+
+    /// Taps per phase, the Kaiser window's beta (its stopband attenuation), and where the
+    /// passband ends as a fraction of the lower Nyquist frequency.
+    fn design(self) -> (usize, f64, f64) {
+        match self {
+            Self::Fast => (16, 6.0, 0.80),
+            Self::Medium => (32, 8.5, 0.88),
+            Self::Best => (64, 11.0, 0.93),
+        }
+    }
+}
+
+fn gcd(mut a: u32, mut b: u32) -> u32 {
+    while b != 0 {
+        (a, b) = (b, a % b);
+    }
+    a
+}
+
+/// The zeroth order modified Bessel function, for the Kaiser window.
+fn bessel_i0(x: f64) -> f64 {
+    let mut sum = 1.0;
+    let mut term = 1.0;
+    let mut k = 1.0;
+    while term > 1e-12 * sum {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        k += 1.0;
+    }
+    sum
+}
+
+pub struct Resampler {
+    up: usize,
+    down: usize,
+    /// Per phase, a multiple of `LANES`.
+    taps: usize,
+    /// `up` filters of `taps` coefficients each, reversed so they line up with the input they're
+    /// applied to.
+    filters: Vec<f32>,
+    /// The input, starting with the last `taps - 1` samples of the previous block.
+    input: Vec<f32>,
+    /// The newest input sample the next output sample uses, and which filter.
+    next: usize,
+    phase: usize,
+}
+
+impl std::fmt::Debug for Resampler {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(
+            f,
+            "Resampler {{ {}/{}, {} taps }}",
+            self.up, self.down, self.taps
+        )
+    }
+}
+
+impl Resampler {
+    pub fn new(in_rate: u32, out_rate: u32, quality: Quality) -> Self {
+        let divisor = gcd(in_rate, out_rate);
+        let (mut up, mut down) = (out_rate / divisor, in_rate / divisor);
+        if up > MAX_PHASES {
+            down = (down as f64 * MAX_PHASES as f64 / up as f64).round() as u32;
+            up = MAX_PHASES;
+        }
+        let (up, down) = (up as usize, down as usize);
+        let (taps, beta, passband) = quality.design();
+        // Otherwise one output sample could need input from beyond the next block.
+        assert!(
+            down <= up * taps,
+            "Can't resample from {in_rate} Hz down to {out_rate} Hz"
+        );
+
+        // The prototype lowpass runs at `up` times the input rate, so its cutoff is the lower of
+        // the two Nyquist frequencies relative to that.
+        let length = taps * up;
+        let ratio = if up < down {
+            up as f64 / down as f64
+        } else {
+            1.0
+        };
+        let cutoff = passband * 0.5 * ratio / up as f64;
+        let centre = (length - 1) as f64 / 2.0;
+        let prototype: Vec<f64> = (0..length)
+            .map(|n| {
+                let t = n as f64 - centre;
+                let x = std::f64::consts::TAU * cutoff * t;
+                let sinc = if t == 0.0 { 1.0 } else { x.sin() / x };
+                let w = t / centre;
+                sinc * bessel_i0(beta * (1.0 - w * w).max(0.0).sqrt()) / bessel_i0(beta)
+            })
+            .collect();
+        let sum: f64 = prototype.iter().sum();
+
+        // Each phase sees one in `up` of the taps, so normalise for unity gain per phase.
+        let mut filters = vec![0.0; length];
+        for phase in 0..up {
+            for j in 0..taps {
+                filters[phase * taps + taps - 1 - j] =
+                    (prototype[phase + j * up] * up as f64 / sum) as f32;
+            }
+        }
+
+        // Starting from silence.
+        let mut input = Vec::with_capacity(taps - 1 + BLOCK);
+        input.resize(taps - 1, 0.0);
+        Self {
+            up,
+            down,
+            taps,
+            filters,
+            input,
+            next: taps - 1,
+            phase: 0,
+        }
+    }
+
+    /// Exactly how much input the next `fill` of `frames` samples will pull from its source, a
+    /// whole number of blocks, so a caller can have it ready before asking.
+    pub fn input_for(&self, frames: usize) -> usize {
+        if frames == 0 {
+            return 0;
+        }
+        // Refilling drains the start of the input and moves `next` back by the same amount, so
+        // how far the last sample's input is past the end doesn't change.
+        let last = self.next + (self.phase + (frames - 1) * self.down) / self.up;
+        let missing = (last + 1).saturating_sub(self.input.len());
+        missing.div_ceil(BLOCK) * BLOCK
+    }
+
+    /// The most `input_for(frames)` can ever be.
+    pub fn max_input_for(&self, frames: usize) -> usize {
+        ((frames * self.down).div_ceil(self.up) + 1).div_ceil(BLOCK) * BLOCK
+    }
+
+    /// Keep the input the next output sample needs, and pull in another block.
+    fn refill(&mut self, source: &mut impl FnMut(&mut [f32])) {
+        let start = self.next + 1 - self.taps;
+        self.input.drain(..start);
+        self.next -= start;
+        let len = self.input.len();
+        self.input.resize(len + BLOCK, 0.0);
+        source(&mut self.input[len..]);
+    }
+
+    /// Fill `out` with resampled samples, pulling as much input from `source` as that takes.
+    ///
+    /// On x86 the AVX2 variant is picked at runtime when the CPU supports it.
+    pub fn fill(&mut self, out: &mut [f32], source: impl FnMut(&mut [f32])) {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        if std::arch::is_x86_feature_detected!("avx2") && std::arch::is_x86_feature_detected!("fma")
+        {
+            // SAFETY: We've just checked the CPU supports the features this was compiled for.
+            return unsafe { self.fill_avx2(out, source) };
+        }
+
+        self.fill_generic(out, source)
+    }
+
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    #[target_feature(enable = "avx2,fma")]
+    unsafe fn fill_avx2(&mut self, out: &mut [f32], source: impl FnMut(&mut [f32])) {
+        self.fill_generic(out, source)
+    }
+
+    #[inline(always)]
+    fn fill_generic(&mut self, out: &mut [f32], mut source: impl FnMut(&mut [f32])) {
+        for out in out {
+            if self.next >= self.input.len() {
+                self.refill(&mut source);
+            }
+
+            let x = &self.input[self.next + 1 - self.taps..=self.next];
+            let h = &self.filters[self.phase * self.taps..][..self.taps];
+            *out = dot(x, h);
+
+            self.phase += self.down;
+            self.next += self.phase / self.up;
+            self.phase %= self.up;
+        }
+    }
+}
+
+/// The dot product of `x` and `h`, which are the same length, a multiple of `LANES`, over fixed
+/// size chunks that the compiler vectorises.
+#[inline(always)]
+fn dot(x: &[f32], h: &[f32]) -> f32 {
+    let mut sum = [0.0f32; LANES];
+    for (x, h) in x.chunks_exact(LANES).zip(h.chunks_exact(LANES)) {
+        for ((sum, x), h) in sum.iter_mut().zip(x).zip(h) {
+            *sum += x * h;
+        }
+    }
+    sum.iter().sum()
+}
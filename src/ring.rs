@@ -0,0 +1,213 @@
+//! Fixed capacity, lock-free, single producer single consumer ring buffer.
+
+use std::cell::UnsafeCell;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+struct Shared<T> {
+    buffer: Box<[UnsafeCell<T>]>,
+    /// Total number of items ever consumed.  Only written by the consumer.
+    head: AtomicUsize,
+    /// Total number of items ever pushed.  Only written by the producer.
+    tail: AtomicUsize,
+}
+
+// SAFETY: The producer only ever writes to slots outside head..tail, and the consumer only ever
+// reads slots inside it, with the acquire/release pairs on head and tail ordering the accesses.
+unsafe impl<T: Send> Sync for Shared<T> {}
+
+impl<T> Shared<T> {
+    #[inline]
+    fn mask(&self) -> usize {
+        self.buffer.len() - 1
+    }
+
+    /// A pointer to slot `index` (modulo the capacity), which may be used for the slots after it
+    /// up to the end of the buffer.  It's derived from the whole buffer rather than the one
+    /// slot's cell, so its provenance covers them all.
+    #[inline]
+    fn slot(&self, index: usize) -> *mut T {
+        // SAFETY: Masking keeps the offset in bounds.  UnsafeCell<T> has the same layout as T.
+        unsafe { UnsafeCell::raw_get(self.buffer.as_ptr().add(index & self.mask())) }
+    }
+}
+
+pub struct Producer<T> {
+    shared: Arc<Shared<T>>,
+    tail: usize,
+}
+
+pub struct Consumer<T> {
+    shared: Arc<Shared<T>>,
+    head: usize,
+}
+
+/// Create a ring buffer holding at least `capacity` items (rounded up to a power of two).
+pub fn ring_buffer<T: Copy + Default>(capacity: usize) -> (Producer<T>, Consumer<T>) {
+    let buffer = (0..capacity.next_power_of_two())
+        .map(|_| UnsafeCell::new(T::default()))
+        .collect();
+    let shared = Arc::new(Shared {
+        buffer,
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+    });
+
+    (
+        Producer {
+            shared: shared.clone(),
+            tail: 0,
+        },
+        Consumer { shared, head: 0 },
+    )
+}
+
+impl<T: Copy> Producer<T> {
+    #[inline]
+    pub fn capacity(&self) -> usize {
+        self.shared.buffer.len()
+    }
+
+    /// How many items can currently be pushed.
+    #[inline]
+    pub fn free_len(&self) -> usize {
+        let head = self.shared.head.load(Ordering::Acquire);
+        self.capacity() - self.tail.wrapping_sub(head)
+    }
+
+    /// Push as many of `items` as fit, returning how many were pushed.
+    pub fn push_slice(&mut self, items: &[T]) -> usize {
+        let count = std::cmp::min(items.len(), self.free_len());
+        let start = self.tail & self.shared.mask();
+        let first = std::cmp::min(count, self.capacity() - start);
+
+        // SAFETY: slots tail..tail+count are free space, so the consumer isn't reading them, and
+        // first/count - first are in bounds of the buffer either side of the wrap.
+        unsafe {
+            std::ptr::copy_nonoverlapping(items.as_ptr(), self.shared.slot(self.tail), first);
+            std::ptr::copy_nonoverlapping(
+                items[first..].as_ptr(),
+                self.shared.slot(0),
+                count - first,
+            );
+        }
+
+        self.tail = self.tail.wrapping_add(count);
+        self.shared.tail.store(self.tail, Ordering::Release);
+        count
+    }
+}
+
+impl<T: Copy> Consumer<T> {
+    /// How many items are available to read.
+    #[inline]
+    pub fn len(&self) -> usize {
+        self.shared
+            .tail
+            .load(Ordering::Acquire)
+            .wrapping_sub(self.head)
+    }
+
+    /// The readable items, in order, as the parts before and after the end of the buffer.
+    pub fn as_slices(&self) -> (&[T], &[T]) {
+        let len = self.len();
+        let start = self.head & self.shared.mask();
+        let first = std::cmp::min(len, self.shared.buffer.len() - start);
+
+        // SAFETY: slots head..head+len have been published by the producer, which won't write to
+        // them again until we consume them.
+        unsafe {
+            (
+                std::slice::from_raw_parts(self.shared.slot(self.head), first),
+                std::slice::from_raw_parts(self.shared.slot(0), len - first),
+            )
+        }
+    }
+
+    /// The readable items at the start of the buffer, trimmed to whole frames of `frame_len`
+    /// items.  If a frame straddles the end of the buffer it's copied into `scratch`, which must
+    /// hold at least a frame, and returned from there instead.
+    pub fn as_frames<'a>(&'a self, frame_len: usize, scratch: &'a mut [T]) -> &'a [T] {
+        let (first, second) = self.as_slices();
+        let whole = first.len() - first.len() % frame_len;
+        if whole > 0 || first.is_empty() {
+            return &first[..whole];
+        }
+
+        let rest = frame_len - first.len();
+        if second.len() < rest {
+            return &[];
+        }
+        let frame = &mut scratch[..frame_len];
+        frame[..first.len()].copy_from_slice(first);
+        frame[first.len()..].copy_from_slice(&second[..rest]);
+        frame
+    }
+
+    /// Release the first `count` readable items back to the producer.
+    pub fn consume(&mut self, count: usize) {
+        assert!(count <= self.len(), "consumed more than was available");
+        self.head = self.head.wrapping_add(count);
+        self.shared.head.store(self.head, Ordering::Release);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn wraps_around() {
+        let (mut producer, mut consumer) = ring_buffer(4);
+        assert_eq!(producer.push_slice(&[1, 2, 3]), 3);
+        consumer.consume(3);
+        assert_eq!(producer.push_slice(&[4, 5, 6]), 3);
+
+        assert_eq!(consumer.len(), 3);
+        assert_eq!(consumer.as_slices(), (&[4][..], &[5, 6][..]));
+        consumer.consume(1);
+        assert_eq!(consumer.as_slices(), (&[5, 6][..], &[][..]));
+    }
+
+    #[test]
+    fn push_slice_when_full() {
+        let (mut producer, mut consumer) = ring_buffer(4);
+        assert_eq!(producer.push_slice(&[1, 2, 3, 4, 5]), 4);
+        assert_eq!(producer.free_len(), 0);
+        assert_eq!(producer.push_slice(&[6]), 0);
+
+        consumer.consume(1);
+        assert_eq!(producer.push_slice(&[6, 7]), 1);
+        assert_eq!(consumer.as_slices(), (&[2, 3, 4][..], &[6][..]));
+    }
+
+    #[test]
+    fn as_frames_straddling_the_end() {
+        let (mut producer, mut consumer) = ring_buffer(8);
+        producer.push_slice(&[0; 6]);
+        consumer.consume(6);
+        // Slots 6, 7, 0, 1, 2, 3: the first frame of three straddles the end.
+        producer.push_slice(&[1, 2, 3, 4, 5, 6]);
+
+        let mut scratch = [0; 3];
+        assert_eq!(consumer.as_frames(3, &mut scratch), &[1, 2, 3]);
+        consumer.consume(3);
+        assert_eq!(consumer.as_frames(3, &mut scratch), &[4, 5, 6]);
+        consumer.consume(3);
+        assert_eq!(consumer.as_frames(3, &mut scratch), &[] as &[i32]);
+    }
+
+    #[test]
+    fn as_frames_waits_for_a_whole_frame() {
+        let (mut producer, mut consumer) = ring_buffer(4);
+        producer.push_slice(&[0; 3]);
+        consumer.consume(3);
+        // Slots 3 and 0, the frame's third sample not yet pushed.
+        producer.push_slice(&[1, 2]);
+
+        let mut scratch = [0; 3];
+        assert_eq!(consumer.as_frames(3, &mut scratch), &[] as &[i32]);
+        producer.push_slice(&[3]);
+        assert_eq!(consumer.as_frames(3, &mut scratch), &[1, 2, 3]);
+    }
+}
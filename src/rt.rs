@@ -0,0 +1,224 @@
+//! Playback from a dedicated real-time thread, decoupled from the tokio runtime.
+//!
+//! The audio thread owns the PCM and runs at `SCHED_FIFO` priority with memory locked, so other
+//! tasks on the async executor can't delay a refill.  The async side hands it samples through a
+//! wait-free SPSC ring, and is woken when the audio thread frees up space.
+
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, Ordering};
+
+use crate::Negotiated;
+use crate::convert::MAX_CHANNELS;
+use crate::ring;
+use crate::stats::Stats;
+use crate::trace::{self, Stage};
+
+struct Shared {
+    /// Woken by the audio thread whenever it frees up space in the ring.
+    space: futures::task::AtomicWaker,
+    running: AtomicBool,
+    stats: Arc<Stats>,
+}
+
+pub struct RtWriter<Sample> {
+    producer: ring::Producer<Sample>,
+    shared: Arc<Shared>,
+    thread: Option<std::thread::JoinHandle<()>>,
+    rate: f32,
+}
+
+/// Give the current thread `SCHED_FIFO` at `priority`, and lock the process's memory so the audio
+/// path never takes a page fault.  Failures (typically missing `CAP_SYS_NICE`/rtprio limits) are
+/// reported but not fatal.
+pub fn make_realtime(priority: i32) {
+    let param = libc::sched_param {
+        sched_priority: priority,
+    };
+    // SAFETY: plain libc calls on the current thread with valid arguments.
+    let err =
+        unsafe { libc::pthread_setschedparam(libc::pthread_self(), libc::SCHED_FIFO, &param) };
+    if err != 0 {
+        eprintln!(
+            "Couldn't set SCHED_FIFO priority {priority}: {}",
+            std::io::Error::from_raw_os_error(err)
+        );
+    }
+
+    // SAFETY: as above.
+    if unsafe { libc::mlockall(libc::MCL_CURRENT | libc::MCL_FUTURE) } != 0 {
+        eprintln!("Couldn't lock memory: {}", std::io::Error::last_os_error());
+    }
+}
+
+fn recover(pcm: &alsa::PCM, err: alsa::Error, stats: &Stats) {
+    crate::recover_pcm(pcm, err, stats).expect("Failed to recover from ALSA error");
+}
+
+fn pump<Sample>(
+    pcm: alsa::PCM,
+    period_size: usize,
+    channels: usize,
+    mut consumer: ring::Consumer<Sample>,
+    shared: &Shared,
+) where
+    Sample: alsa::pcm::IoFormat + Default,
+{
+    let io = pcm.io_checked::<Sample>().expect("Wrong format");
+    // Allocated up front, so nothing allocates once we're running.
+    let silence = vec![Sample::default(); period_size * channels];
+    let mut scratch = [Sample::default(); MAX_CHANNELS];
+    let mut check = crate::pool::PeriodCheck::default();
+
+    while shared.running.load(Ordering::Acquire) {
+        check.period();
+        // snd_pcm_wait does the poll descriptor revents remapping itself.  The timeout is just so
+        // we notice being stopped.
+        if let Err(err) = pcm.wait(Some(100)) {
+            recover(&pcm, err, &shared.stats);
+            continue;
+        }
+
+        let woken = std::time::Instant::now();
+        shared.stats.record_wakeup();
+        trace::instant(Stage::Wakeup);
+        let start = trace::begin();
+        let avail = match pcm.avail_update() {
+            Ok(avail) => avail as usize,
+            Err(err) => {
+                recover(&pcm, err, &shared.stats);
+                continue;
+            }
+        };
+        if let Ok(delay) = pcm.delay() {
+            shared.stats.record_delay(delay);
+        }
+        trace::end(Stage::Avail, start, avail);
+
+        let mut remaining = avail;
+        while remaining > 0 {
+            let to_send = consumer.as_frames(channels, &mut scratch);
+            if to_send.is_empty() {
+                break;
+            }
+            let requested = std::cmp::min(to_send.len() / channels, remaining);
+            let start = trace::begin();
+            let result = io.writei(&to_send[..requested * channels]);
+            trace::end(Stage::Write, start, *result.as_ref().unwrap_or(&0));
+            match result {
+                Ok(count) => {
+                    shared.stats.record_write(requested, count);
+                    consumer.consume(count * channels);
+                    remaining -= count;
+                    shared.space.wake();
+                }
+                Err(err) => {
+                    recover(&pcm, err, &shared.stats);
+                    break;
+                }
+            }
+        }
+
+        // The producer has fallen behind.  Keep the device fed with silence rather than letting
+        // it xrun, which would cost far more than a period to recover from.
+        if remaining == avail && remaining >= period_size {
+            if let Err(err) = io.writei(&silence) {
+                recover(&pcm, err, &shared.stats);
+            }
+        }
+        if remaining < avail {
+            shared.stats.record_latency(woken);
+        }
+    }
+}
+
+impl<Sample> RtWriter<Sample>
+where
+    Sample: alsa::pcm::IoFormat + Default + Send + 'static,
+{
+    /// Hand `pcm` over to a new audio thread running at `SCHED_FIFO` `priority`, buffering up to
+    /// `capacity` samples between the caller and the thread.
+    pub fn spawn(pcm: alsa::PCM, negotiated: &Negotiated, priority: i32, capacity: usize) -> Self {
+        let (producer, consumer) = ring::ring_buffer(capacity);
+        let shared = Arc::new(Shared {
+            space: futures::task::AtomicWaker::new(),
+            running: AtomicBool::new(true),
+            stats: Default::default(),
+        });
+
+        let thread = {
+            let Negotiated {
+                period_size,
+                channels,
+                ..
+            } = *negotiated;
+            let shared = shared.clone();
+            std::thread::Builder::new()
+                .name("alsa-rt".into())
+                .spawn(move || {
+                    make_realtime(priority);
+                    crate::pool::run_tracked(|| {
+                        pump::<Sample>(pcm, period_size, channels, consumer, &shared)
+                    });
+                })
+                .expect("Failed to spawn audio thread")
+        };
+
+        Self {
+            producer,
+            shared,
+            thread: Some(thread),
+            rate: negotiated.rate,
+        }
+    }
+
+    #[inline]
+    pub fn get_rate(&self) -> f32 {
+        self.rate
+    }
+
+    #[inline]
+    pub fn stats(&self) -> &Arc<Stats> {
+        &self.shared.stats
+    }
+
+    /// Queue as much of `samples` as there is room for, waiting for the audio thread to make room
+    /// if the queue is full.  Returns the number of samples queued.
+    pub fn poll_write(
+        &mut self,
+        cx: &mut std::task::Context<'_>,
+        samples: &[Sample],
+    ) -> std::task::Poll<std::io::Result<usize>> {
+        if self.producer.free_len() == 0 {
+            self.shared.space.register(cx.waker());
+            // Check again, in case the audio thread made room before we registered.
+            if self.producer.free_len() == 0 {
+                if self.thread.as_ref().is_some_and(|t| t.is_finished()) {
+                    return std::task::Poll::Ready(Err(std::io::Error::new(
+                        std::io::ErrorKind::BrokenPipe,
+                        "Audio thread exited",
+                    )));
+                }
+                return std::task::Poll::Pending;
+            }
+        }
+
+        std::task::Poll::Ready(Ok(self.producer.push_slice(samples)))
+    }
+
+    pub async fn write_all(&mut self, mut samples: &[Sample]) -> std::io::Result<()> {
+        while !samples.is_empty() {
+            let count = std::future::poll_fn(|cx| self.poll_write(cx, samples)).await?;
+            samples = &samples[count..];
+        }
+        Ok(())
+    }
+}
+
+impl<Sample> Drop for RtWriter<Sample> {
+    fn drop(&mut self) {
+        self.shared.running.store(false, Ordering::Release);
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+    }
+}
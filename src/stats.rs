@@ -0,0 +1,207 @@
+//! Playback counters, and control over per-wakeup logging.
+
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicI64, AtomicU64, Ordering};
+
+static VERBOSE: AtomicBool = AtomicBool::new(false);
+
+/// Whether to log every wakeup and write.  Off by default, as stdio on the audio path causes
+/// jitter.
+#[inline]
+pub fn verbose() -> bool {
+    VERBOSE.load(Ordering::Relaxed)
+}
+
+pub fn set_verbose(verbose: bool) {
+    VERBOSE.store(verbose, Ordering::Relaxed);
+}
+
+/// How many of the most recent xrun times are kept.
+const XRUN_LOG_LEN: usize = 16;
+const HISTOGRAM_BUCKETS: usize = 24;
+
+/// Bucket `i` counts values below 2^i (and at least 2^(i-1)), the last one everything larger.
+#[derive(Debug)]
+struct Histogram([AtomicU64; HISTOGRAM_BUCKETS]);
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self(std::array::from_fn(|_| AtomicU64::new(0)))
+    }
+}
+
+impl Histogram {
+    #[inline]
+    fn add(&self, value: u64) {
+        let bucket = (u64::BITS - value.leading_zeros()) as usize;
+        self.0[std::cmp::min(bucket, HISTOGRAM_BUCKETS - 1)].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Print `stats: name <2^i:count ... >=2^22:count` for the non-empty buckets.
+    fn dump(&self, name: &str) {
+        let buckets = self
+            .0
+            .iter()
+            .enumerate()
+            .filter_map(|(bucket, count)| match count.load(Ordering::Relaxed) {
+                0 => None,
+                count if bucket == HISTOGRAM_BUCKETS - 1 => {
+                    Some(format!(" >={}:{count}", 1u64 << (bucket - 1)))
+                }
+                count => Some(format!(" <{}:{count}", 1u64 << bucket)),
+            })
+            .collect::<String>();
+        println!("stats: {name}{buckets}");
+    }
+}
+
+/// Playback counters.  These are only written by the audio path, but are atomic (with relaxed
+/// ordering) so they can be read from anywhere without locking.  Counters and histograms are
+/// cumulative, the delay range covers the time since the last dump.
+#[derive(Debug)]
+pub struct Stats {
+    start: std::time::Instant,
+    wakeups: AtomicU64,
+    frames_written: AtomicU64,
+    short_writes: AtomicU64,
+    xruns: AtomicU64,
+    source_underruns: AtomicU64,
+    min_delay: AtomicI64,
+    max_delay: AtomicI64,
+    /// Microseconds since `start` of the most recent xruns, indexed by xrun number.
+    xrun_log: [AtomicU64; XRUN_LOG_LEN],
+    recovery_us: Histogram,
+    /// From the PCM becoming ready to the write that it woke us for completing.
+    wakeup_latency_us: Histogram,
+    delay_frames: Histogram,
+}
+
+impl Default for Stats {
+    fn default() -> Self {
+        Self {
+            start: std::time::Instant::now(),
+            wakeups: AtomicU64::new(0),
+            frames_written: AtomicU64::new(0),
+            short_writes: AtomicU64::new(0),
+            xruns: AtomicU64::new(0),
+            source_underruns: AtomicU64::new(0),
+            min_delay: AtomicI64::new(i64::MAX),
+            max_delay: AtomicI64::new(i64::MIN),
+            xrun_log: std::array::from_fn(|_| AtomicU64::new(0)),
+            recovery_us: Default::default(),
+            wakeup_latency_us: Default::default(),
+            delay_frames: Default::default(),
+        }
+    }
+}
+
+impl Stats {
+    #[inline]
+    pub fn record_wakeup(&self) {
+        self.wakeups.fetch_add(1, Ordering::Relaxed);
+    }
+
+    #[inline]
+    pub fn record_write(&self, requested: usize, written: usize) {
+        self.frames_written
+            .fetch_add(written as u64, Ordering::Relaxed);
+        if written < requested {
+            self.short_writes.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Record an xrun that happened `at`, and took `recovery` to recover from.
+    pub fn record_xrun(&self, at: std::time::Instant, recovery: std::time::Duration) {
+        let xrun = self.xruns.fetch_add(1, Ordering::Relaxed) as usize;
+        let since_start = at.duration_since(self.start).as_micros() as u64;
+        self.xrun_log[xrun % XRUN_LOG_LEN].store(since_start, Ordering::Relaxed);
+
+        self.recovery_us.add(recovery.as_micros() as u64);
+    }
+
+    /// Record a mixer source not having the samples to fill a block.
+    #[inline]
+    pub fn record_source_underrun(&self) {
+        self.source_underruns.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Record the time from ALSA waking us at `woken` until now.
+    #[inline]
+    pub fn record_latency(&self, woken: std::time::Instant) {
+        self.wakeup_latency_us
+            .add(woken.elapsed().as_micros() as u64);
+    }
+
+    #[inline]
+    pub fn record_delay(&self, delay: alsa::pcm::Frames) {
+        let delay = delay as i64;
+        self.min_delay.fetch_min(delay, Ordering::Relaxed);
+        self.max_delay.fetch_max(delay, Ordering::Relaxed);
+        self.delay_frames.add(delay.max(0) as u64);
+    }
+
+    pub fn dump(&self, rate: f32) {
+        let min_delay = self.min_delay.swap(i64::MAX, Ordering::Relaxed);
+        let max_delay = self.max_delay.swap(i64::MIN, Ordering::Relaxed);
+        let delay = if min_delay <= max_delay {
+            format!(
+                "{:.1}..{:.1}ms",
+                1000.0 * min_delay as f32 / rate,
+                1000.0 * max_delay as f32 / rate
+            )
+        } else {
+            "n/a".to_owned()
+        };
+
+        let xruns = self.xruns.load(Ordering::Relaxed);
+        println!(
+            "stats: wakeups={} frames_written={} short_writes={} xruns={xruns} delay={delay}",
+            self.wakeups.load(Ordering::Relaxed),
+            self.frames_written.load(Ordering::Relaxed),
+            self.short_writes.load(Ordering::Relaxed),
+        );
+        let source_underruns = self.source_underruns.load(Ordering::Relaxed);
+        if source_underruns > 0 {
+            println!("stats: source_underruns={source_underruns}");
+        }
+        self.wakeup_latency_us.dump("wakeup_latency_us");
+        self.delay_frames.dump("delay_frames");
+
+        if xruns > 0 {
+            let recent = (xruns.saturating_sub(XRUN_LOG_LEN as u64)..xruns)
+                .map(|xrun| {
+                    let micros =
+                        self.xrun_log[xrun as usize % XRUN_LOG_LEN].load(Ordering::Relaxed);
+                    format!("{:.3}s", micros as f64 / 1e6)
+                })
+                .collect::<Vec<_>>()
+                .join(" ");
+            println!("stats: recent xruns at {recent}");
+            self.recovery_us.dump("recovery_us");
+        }
+    }
+}
+
+/// Dump `stats` on SIGUSR1, and every `interval` if given.  Runs forever.
+pub async fn report(stats: Arc<Stats>, rate: f32, interval: Option<std::time::Duration>) {
+    use tokio::signal::unix::{SignalKind, signal};
+
+    let mut usr1 = signal(SignalKind::user_defined1()).expect("Couldn't handle SIGUSR1");
+    let mut ticker = interval
+        .map(|interval| tokio::time::interval_at(tokio::time::Instant::now() + interval, interval));
+
+    loop {
+        tokio::select! {
+            _ = usr1.recv() => {}
+            _ = async {
+                match &mut ticker {
+                    Some(ticker) => {
+                        ticker.tick().await;
+                    }
+                    None => std::future::pending().await,
+                }
+            } => {}
+        }
+        stats.dump(rate);
+    }
+}
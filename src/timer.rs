@@ -0,0 +1,117 @@
+//! Timer driven wakeups, as an alternative to ALSA's poll descriptors.
+//!
+//! Rather than waiting for ALSA to say there's room, a timerfd is armed to fire when the buffer
+//! will have drained down to a watermark, going by the delay in the wakeup's status snapshot.  With plugins like dmix that
+//! signal their descriptors far more often than we need, this wakes once per buffer refill.
+
+use std::os::fd::{AsRawFd as _, FromRawFd as _, OwnedFd};
+
+pub struct WakeupTimer {
+    fd: tokio::io::unix::AsyncFd<OwnedFd>,
+    watermark: alsa::pcm::Frames,
+    rate: f32,
+}
+
+impl WakeupTimer {
+    /// Create a timer that wakes when `watermark` frames are left to play at `rate`.  It starts
+    /// out armed to fire straight away.
+    pub fn new(watermark: alsa::pcm::Frames, rate: f32) -> std::io::Result<Self> {
+        // SAFETY: plain libc call, and on success we own the returned fd.
+        let fd = unsafe {
+            let fd = libc::timerfd_create(
+                libc::CLOCK_MONOTONIC,
+                libc::TFD_NONBLOCK | libc::TFD_CLOEXEC,
+            );
+            if fd == -1 {
+                return Err(std::io::Error::last_os_error());
+            }
+            OwnedFd::from_raw_fd(fd)
+        };
+
+        let timer = Self {
+            fd: tokio::io::unix::AsyncFd::with_interest(fd, tokio::io::Interest::READABLE)?,
+            watermark,
+            rate,
+        };
+        timer.arm_in(0)?;
+        Ok(timer)
+    }
+
+    /// Arm the timer to fire after `ns` nanoseconds.
+    fn arm_in(&self, ns: u64) -> std::io::Result<()> {
+        // An it_value of zero would disarm the timer instead.
+        let ns = std::cmp::max(ns, 1);
+        let when = libc::itimerspec {
+            it_interval: libc::timespec {
+                tv_sec: 0,
+                tv_nsec: 0,
+            },
+            it_value: libc::timespec {
+                tv_sec: (ns / 1_000_000_000) as libc::time_t,
+                tv_nsec: (ns % 1_000_000_000) as libc::c_long,
+            },
+        };
+        // SAFETY: `when` is valid for the call, and we don't ask for the old value.
+        if unsafe { libc::timerfd_settime(self.fd.as_raw_fd(), 0, &when, std::ptr::null_mut()) }
+            == -1
+        {
+            return Err(std::io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    /// Arm the timer to fire when the buffer will have drained down to the watermark, going by
+    /// the wakeup's `snapshot` and the `written` frames queued since it was taken, so it costs no
+    /// more queries of ALSA.  If the stream isn't running (eg it's just been prepared after an
+    /// xrun) it fires straight away, for the write path to sort out.
+    pub fn arm(&self, snapshot: &crate::clock::Snapshot, written: usize) -> std::io::Result<()> {
+        let delay = match snapshot.state {
+            alsa::pcm::State::Running => snapshot.delay + written as alsa::pcm::Frames,
+            _ => 0,
+        };
+        let frames = std::cmp::max(delay - self.watermark, 0);
+        let ns = (frames as f64 * 1e9 / self.rate as f64) as u64;
+        if crate::stats::verbose() {
+            println!("Wakeup in {}us (delay {delay})", ns / 1000);
+        }
+        self.arm_in(ns)
+    }
+
+    /// Arm the timer to fire straight away.
+    pub fn fire_now(&self) -> std::io::Result<()> {
+        self.arm_in(0)
+    }
+
+    /// Wait for the timer to fire.
+    pub fn poll_fired(
+        &self,
+        cx: &mut std::task::Context<'_>,
+    ) -> std::task::Poll<std::io::Result<()>> {
+        loop {
+            let mut guard = std::task::ready!(self.fd.poll_read_ready(cx))?;
+
+            let read = guard.try_io(|fd| {
+                let mut expirations = 0u64;
+                // SAFETY: reading a u64 into a u64.
+                let ret = unsafe {
+                    libc::read(
+                        fd.as_raw_fd(),
+                        &mut expirations as *mut u64 as *mut libc::c_void,
+                        std::mem::size_of::<u64>(),
+                    )
+                };
+                if ret == -1 {
+                    Err(std::io::Error::last_os_error())
+                } else {
+                    Ok(())
+                }
+            });
+
+            match read {
+                Ok(result) => return std::task::Poll::Ready(result),
+                // Readiness has been cleared, so the next poll will register our waker.
+                Err(_would_block) => continue,
+            }
+        }
+    }
+}
@@ -0,0 +1,171 @@
+//! Tracepoints for each stage of the audio path, recorded into a fixed size ring in a shared
+//! mapping of a file, in the same format as the C programs' `trace.h` so `trace_dump` turns either
+//! into a Chrome trace.
+//!
+//! Recording an event is a `clock_gettime` and a few stores, with no syscalls, locks or
+//! allocation, so `-t` can stay on for a whole run, and the file keeps the last `EVENTS` events
+//! for after an underrun even if the process is killed.
+
+use std::sync::atomic::{AtomicPtr, AtomicU16, AtomicU64, Ordering};
+
+/// As `enum trace_stage` in trace.h.
+#[derive(Debug, Clone, Copy)]
+#[repr(u16)]
+pub enum Stage {
+    /// Instant: woken by ALSA or the timer.
+    Wakeup,
+    /// `snd_pcm_poll_descriptors_revents`.
+    Revents,
+    /// Querying ALSA for room (and the delay).
+    Avail,
+    /// Generating the signal.
+    Generate,
+    /// `writei` or `writen`.
+    Write,
+    /// Instant: recovering from an underrun or a suspend.
+    Xrun,
+}
+
+const MAGIC: &[u8; 8] = b"ALSATRC2";
+const EVENTS: usize = 65536;
+
+/// As `struct trace_header`.
+#[repr(C)]
+struct Header {
+    magic: [u8; 8],
+    capacity: u32,
+    event_size: u32,
+    pid: u32,
+    reserved: u32,
+    head: AtomicU64,
+}
+
+/// As `struct trace_event`.
+#[repr(C)]
+struct Event {
+    start_ns: u64,
+    arg: u64,
+    duration_ns: u32,
+    stage: u16,
+    thread: u16,
+    /// One more than the `head` it was recorded at, cleared while it's being written.
+    seq: AtomicU64,
+}
+
+/// The mapping, followed by `EVENTS` events, or null when not tracing.  Once mapped it's never
+/// unmapped, so it stays valid for every thread until the process exits.
+static RING: AtomicPtr<Header> = AtomicPtr::new(std::ptr::null_mut());
+
+static NEXT_THREAD: AtomicU16 = AtomicU16::new(1);
+
+thread_local! {
+    static THREAD: std::cell::Cell<u16> = const { std::cell::Cell::new(0) };
+}
+
+/// Create (or truncate) `path` as a ring and start tracing into it.
+pub fn open(path: &std::path::Path) {
+    use std::os::fd::AsRawFd as _;
+
+    let bytes = std::mem::size_of::<Header>() + EVENTS * std::mem::size_of::<Event>();
+    let file = std::fs::OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(path)
+        .expect("Couldn't create trace file");
+    file.set_len(bytes as u64)
+        .expect("Couldn't size trace file");
+    // SAFETY: A fresh shared mapping of the whole file, which outlives the descriptor.
+    let ring = unsafe {
+        libc::mmap(
+            std::ptr::null_mut(),
+            bytes,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED,
+            file.as_raw_fd(),
+            0,
+        )
+    };
+    assert!(ring != libc::MAP_FAILED, "Couldn't map trace file");
+
+    let ring = ring.cast::<Header>();
+    // SAFETY: The mapping is `bytes` long and suitably aligned, and nothing else has it yet.
+    // Zeroing it also faults in every page now, rather than on the audio path.
+    unsafe {
+        std::ptr::write_bytes(ring.cast::<u8>(), 0, bytes);
+        ring.write(Header {
+            magic: *MAGIC,
+            capacity: EVENTS as u32,
+            event_size: std::mem::size_of::<Event>() as u32,
+            pid: std::process::id(),
+            reserved: 0,
+            head: AtomicU64::new(0),
+        });
+    }
+    RING.store(ring, Ordering::Release);
+}
+
+fn now_ns() -> u64 {
+    let mut now = libc::timespec {
+        tv_sec: 0,
+        tv_nsec: 0,
+    };
+    // SAFETY: `now` is a valid timespec to write to.
+    unsafe { libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut now) };
+    now.tv_sec as u64 * 1_000_000_000 + now.tv_nsec as u64
+}
+
+fn record(stage: Stage, start_ns: u64, end_ns: u64, arg: usize) {
+    let ring = RING.load(Ordering::Acquire);
+    if ring.is_null() {
+        return;
+    }
+    let thread = THREAD.with(|thread| {
+        if thread.get() == 0 {
+            thread.set(NEXT_THREAD.fetch_add(1, Ordering::Relaxed));
+        }
+        thread.get()
+    });
+
+    // SAFETY: `ring` is the mapping made by `open`, which is never unmapped, with `EVENTS` events
+    // after the header.  Each index is claimed by one writer.
+    unsafe {
+        let i = (*ring).head.fetch_add(1, Ordering::Relaxed);
+        let event = ring.add(1).cast::<Event>().add(i as usize % EVENTS);
+        (*event).seq.store(0, Ordering::Relaxed);
+        std::sync::atomic::fence(Ordering::Release);
+        (&raw mut (*event).start_ns).write(start_ns);
+        (&raw mut (*event).arg).write(arg as u64);
+        (&raw mut (*event).duration_ns).write((end_ns - start_ns) as u32);
+        (&raw mut (*event).stage).write(stage as u16);
+        (&raw mut (*event).thread).write(thread);
+        (*event).seq.store(i + 1, Ordering::Release);
+    }
+}
+
+/// When a span starts, or `None` when not tracing.
+#[inline]
+pub fn begin() -> Option<u64> {
+    if RING.load(Ordering::Relaxed).is_null() {
+        None
+    } else {
+        Some(now_ns())
+    }
+}
+
+/// End the span `start` began, for `arg` frames.
+#[inline]
+pub fn end(stage: Stage, start: Option<u64>, arg: usize) {
+    if let Some(start) = start {
+        record(stage, start, now_ns(), arg);
+    }
+}
+
+#[inline]
+pub fn instant(stage: Stage) {
+    if !RING.load(Ordering::Relaxed).is_null() {
+        let now = now_ns();
+        record(stage, now, now, 0);
+    }
+}
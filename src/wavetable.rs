@@ -0,0 +1,164 @@
+//! Wavetable oscillators, for waveforms other than sine.
+//!
+//! Each waveform is built additively into a set of tables, one per octave, each holding only the
+//! harmonics that stay below Nyquist for the frequencies it's used at, so nothing aliases.  Playing
+//! is then one table lookup per sample.
+
+use crate::osc;
+
+/// Samples per cycle, a power of two so the index can wrap with a mask.
+const SIZE: usize = 2048;
+const MASK: usize = SIZE - 1;
+/// Level `i` holds harmonics up to `SIZE / 4 >> i`, the last a pure sine.
+const LEVELS: usize = 10;
+
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub enum Waveform {
+    #[default]
+    Sine,
+    Saw,
+    Square,
+    Triangle,
+}
+
+impl Waveform {
+    pub fn parse(name: &str) -> Option<Self> {
+        match name {
+            "sine" => Some(Self::Sine),
+            "saw" => Some(Self::Saw),
+            "square" => Some(Self::Square),
+            "triangle" => Some(Self::Triangle),
+            _ => None,
+        }
+    }
+
+    /// The amplitude of harmonic `k` in the waveform's Fourier series (of sines, all in phase, so
+    /// the tables can be summed from `sine_fill`).
+    fn harmonic_amplitude(self, k: usize) -> f32 {
+        use std::f64::consts::PI;
+
+        let k_f64 = k as f64;
+        let amplitude = match self {
+            Self::Sine if k == 1 => 1.0,
+            Self::Sine => 0.0,
+            Self::Saw if k % 2 == 1 => 2.0 / (PI * k_f64),
+            Self::Saw => -2.0 / (PI * k_f64),
+            Self::Square if k % 2 == 1 => 4.0 / (PI * k_f64),
+            Self::Triangle if k % 4 == 1 => 8.0 / (PI * PI * k_f64 * k_f64),
+            Self::Triangle if k % 4 == 3 => -8.0 / (PI * PI * k_f64 * k_f64),
+            Self::Square | Self::Triangle => 0.0,
+        };
+        amplitude as f32
+    }
+}
+
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub enum Interpolation {
+    #[default]
+    Linear,
+    Cubic,
+}
+
+impl Interpolation {
+    pub fn parse(name: &str) -> Option<Self> {
+        match name {
+            "linear" => Some(Self::Linear),
+            "cubic" => Some(Self::Cubic),
+            _ => None,
+        }
+    }
+}
+
+#[repr(align(64))]
+struct Table([f32; SIZE]);
+
+pub struct Wavetable {
+    waveform: Waveform,
+    interpolation: Interpolation,
+    levels: Vec<Box<Table>>,
+}
+
+impl std::fmt::Debug for Wavetable {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(
+            f,
+            "Wavetable {{ {:?}, {:?} }}",
+            self.waveform, self.interpolation
+        )
+    }
+}
+
+impl Wavetable {
+    pub fn new(waveform: Waveform, interpolation: Interpolation) -> Self {
+        let mut harmonic = vec![0.0; SIZE];
+        let levels = (0..LEVELS)
+            .map(|level| {
+                let mut table = Box::new(Table([0.0; SIZE]));
+                for k in 1..=(SIZE / 4) >> level {
+                    let amplitude = waveform.harmonic_amplitude(k);
+                    if amplitude == 0.0 {
+                        continue;
+                    }
+                    osc::sine_fill(&mut harmonic, 0.0, k as f64 / SIZE as f64);
+                    for (sample, &harmonic) in table.0.iter_mut().zip(&harmonic) {
+                        *sample += amplitude * harmonic;
+                    }
+                }
+
+                // Truncating the series overshoots at the edges (the Gibbs phenomenon), so scale
+                // the peak back to full scale.
+                let peak = table.0.iter().fold(0.0f32, |peak, &s| peak.max(s.abs()));
+                if peak > 0.0 {
+                    table.0.iter_mut().for_each(|sample| *sample /= peak);
+                }
+                table
+            })
+            .collect();
+
+        Self {
+            waveform,
+            interpolation,
+            levels,
+        }
+    }
+
+    /// The level with the most harmonics that all stay below Nyquist.
+    fn level(&self, increment: f64) -> &[f32; SIZE] {
+        let max_harmonic = 0.5 / increment.abs();
+        let level = (0..LEVELS)
+            .find(|&level| ((SIZE / 4) >> level) as f64 <= max_harmonic)
+            .unwrap_or(LEVELS - 1);
+        &self.levels[level].0
+    }
+
+    /// Like `osc::sine_fill`, but for this waveform: fill `buffer` starting at `phase`, with
+    /// samples `increment` cycles apart.
+    pub fn fill(&self, buffer: &mut [f32], phase: f64, increment: f64) {
+        let samples = self.level(increment);
+        let mut position = (phase - phase.floor()) * SIZE as f64;
+        let step = (increment - increment.floor()) * SIZE as f64;
+
+        for out in buffer {
+            let i = position as usize;
+            let frac = (position - i as f64) as f32;
+            let at = |offset: usize| samples[(i + offset) & MASK];
+
+            *out = match self.interpolation {
+                Interpolation::Linear => at(0) + frac * (at(1) - at(0)),
+                Interpolation::Cubic => {
+                    // Catmull-Rom through the two samples either side.
+                    let (y0, y1, y2, y3) = (at(MASK), at(0), at(1), at(2));
+                    let a = 0.5 * (y3 - y0) + 1.5 * (y1 - y2);
+                    let b = y0 - 2.5 * y1 + 2.0 * y2 - 0.5 * y3;
+                    let c = 0.5 * (y2 - y0);
+                    ((a * frac + b) * frac + c) * frac + y1
+                }
+            };
+
+            position += step;
+            if position >= SIZE as f64 {
+                position -= SIZE as f64;
+            }
+        }
+    }
+}
@@ -0,0 +1,161 @@
+#include "stats.h"
+
+#include <err.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static void reset_delay(struct playback_stats *stats) {
+    atomic_store_explicit(&stats->min_delay, LONG_MAX, memory_order_relaxed);
+    atomic_store_explicit(&stats->max_delay, LONG_MIN, memory_order_relaxed);
+}
+
+static void histogram_init(struct stats_histogram *histogram) {
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i)
+        atomic_init(&histogram->buckets[i], 0);
+}
+
+static void histogram_add(struct stats_histogram *histogram, uint64_t value) {
+    // The number of bits value needs, whatever the size of long.
+    size_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+    if (bucket >= STATS_HISTOGRAM_BUCKETS)
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+    stats_add(&histogram->buckets[bucket], 1);
+}
+
+// Prints "stats: name <2^i:count ... >=2^22:count" for the non-empty buckets.
+static void histogram_dump(struct stats_histogram *histogram, const char *name, FILE *out) {
+    fprintf(out, "stats: %s", name);
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+        unsigned long count = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (!count)
+            continue;
+        if (i == STATS_HISTOGRAM_BUCKETS - 1)
+            fprintf(out, " >=%lu:%lu", 1ul << (i - 1), count);
+        else
+            fprintf(out, " <%lu:%lu", 1ul << i, count);
+    }
+    fprintf(out, "\n");
+}
+
+void stats_init(struct playback_stats *stats, unsigned int rate) {
+    atomic_init(&stats->wakeups, 0);
+    atomic_init(&stats->frames_written, 0);
+    atomic_init(&stats->short_writes, 0);
+    atomic_init(&stats->xruns, 0);
+    atomic_init(&stats->min_delay, LONG_MAX);
+    atomic_init(&stats->max_delay, LONG_MIN);
+    histogram_init(&stats->wakeup_latency_us);
+    histogram_init(&stats->delay_frames);
+    stats->rate = rate;
+    stats->signal_source = NULL;
+    stats->timer_source = NULL;
+}
+
+void stats_record_delay(struct playback_stats *stats, snd_pcm_sframes_t delay) {
+    // There's only one writer, so there's no need for a compare and swap.
+    if (delay < atomic_load_explicit(&stats->min_delay, memory_order_relaxed))
+        atomic_store_explicit(&stats->min_delay, delay, memory_order_relaxed);
+    if (delay > atomic_load_explicit(&stats->max_delay, memory_order_relaxed))
+        atomic_store_explicit(&stats->max_delay, delay, memory_order_relaxed);
+    histogram_add(&stats->delay_frames, delay > 0 ? delay : 0);
+}
+
+void stats_record_latency(struct playback_stats *stats, const struct timespec *woken) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long us = (now.tv_sec - woken->tv_sec) * 1000000L + (now.tv_nsec - woken->tv_nsec) / 1000;
+    histogram_add(&stats->wakeup_latency_us, us > 0 ? us : 0);
+}
+
+void stats_dump(struct playback_stats *stats, FILE *out) {
+    long min_delay = atomic_load_explicit(&stats->min_delay, memory_order_relaxed);
+    long max_delay = atomic_load_explicit(&stats->max_delay, memory_order_relaxed);
+
+    fprintf(out, "stats: wakeups=%lu frames_written=%lu short_writes=%lu xruns=%lu",
+            atomic_load_explicit(&stats->wakeups, memory_order_relaxed),
+            atomic_load_explicit(&stats->frames_written, memory_order_relaxed),
+            atomic_load_explicit(&stats->short_writes, memory_order_relaxed),
+            atomic_load_explicit(&stats->xruns, memory_order_relaxed));
+    if (min_delay <= max_delay)
+        fprintf(out, " delay=%.1f..%.1fms\n",
+                1000.0 * min_delay / stats->rate,
+                1000.0 * max_delay / stats->rate);
+    else
+        fprintf(out, " delay=n/a\n");
+    histogram_dump(&stats->wakeup_latency_us, "wakeup_latency_us", out);
+    histogram_dump(&stats->delay_frames, "delay_frames", out);
+    fflush(out);
+
+    reset_delay(stats);
+}
+
+void stats_watch(struct playback_stats *stats, struct event_loop *loop, unsigned int interval_ms) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    errno = pthread_sigmask(SIG_BLOCK, &mask, &stats->saved_mask);
+    if (errno)
+        err(1, "pthread_sigmask");
+
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
+        err(1, "signalfd");
+    stats->signal_source = event_loop_add_fd(loop, signal_fd, POLLIN, stats);
+
+    if (interval_ms) {
+        int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd == -1)
+            err(1, "timerfd_create");
+
+        struct itimerspec interval = {
+            .it_interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000L },
+            .it_value = { interval_ms / 1000, (interval_ms % 1000) * 1000000L },
+        };
+        if (timerfd_settime(timer_fd, 0, &interval, NULL) == -1)
+            err(1, "timerfd_settime");
+        stats->timer_source = event_loop_add_fd(loop, timer_fd, POLLIN, stats);
+    }
+}
+
+// Read any signals queued on the signalfd.
+static void drain_signals(struct event_source *source) {
+    struct signalfd_siginfo info;
+    while (read(source->fds[0].fd, &info, sizeof(info)) == sizeof(info))
+        ;
+}
+
+void stats_unwatch(struct playback_stats *stats, struct event_loop *loop) {
+    if (stats->timer_source) {
+        event_loop_remove(loop, stats->timer_source);
+        stats->timer_source = NULL;
+    }
+    if (!stats->signal_source)
+        return;
+
+    // A SIGUSR1 still pending would be delivered as soon as it's unblocked,
+    // and kill the process.
+    drain_signals(stats->signal_source);
+    event_loop_remove(loop, stats->signal_source);
+    stats->signal_source = NULL;
+    pthread_sigmask(SIG_SETMASK, &stats->saved_mask, NULL);
+}
+
+bool stats_handle_event(struct playback_stats *stats, struct event_source *source) {
+    if (source == stats->signal_source) {
+        drain_signals(source);
+    } else if (source == stats->timer_source) {
+        uint64_t expirations;
+        if (read(source->fds[0].fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+            err(1, "read timerfd");
+    } else {
+        return false;
+    }
+
+    stats_dump(stats, stdout);
+    return true;
+}
@@ -0,0 +1,65 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <alsa/asoundlib.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "event_loop.h"
+
+#define STATS_HISTOGRAM_BUCKETS 24
+
+// Bucket i counts values below 2^i (and at least 2^(i-1)), the last one
+// everything larger.
+struct stats_histogram {
+    atomic_ulong buckets[STATS_HISTOGRAM_BUCKETS];
+};
+
+// Playback counters.  These are only written by the audio loop, but are
+// atomic (with relaxed ordering) so they can be read from anywhere without
+// locking.  Counters and histograms are cumulative, the delay range covers the
+// time since the last dump.
+struct playback_stats {
+    atomic_ulong wakeups;
+    atomic_ulong frames_written;
+    atomic_ulong short_writes;
+    atomic_ulong xruns;
+    atomic_long min_delay;
+    atomic_long max_delay;
+    // From the PCM becoming ready to the write that it woke us for completing.
+    struct stats_histogram wakeup_latency_us;
+    struct stats_histogram delay_frames;
+
+    unsigned int rate;
+    struct event_source *signal_source;
+    struct event_source *timer_source;
+    // The calling thread's signal mask before stats_watch blocked SIGUSR1.
+    sigset_t saved_mask;
+};
+
+void stats_init(struct playback_stats *stats, unsigned int rate);
+
+static inline void stats_add(atomic_ulong *counter, unsigned long count) {
+    atomic_fetch_add_explicit(counter, count, memory_order_relaxed);
+}
+
+void stats_record_delay(struct playback_stats *stats, snd_pcm_sframes_t delay);
+// Record the time from woken (CLOCK_MONOTONIC) until now.
+void stats_record_latency(struct playback_stats *stats, const struct timespec *woken);
+void stats_dump(struct playback_stats *stats, FILE *out);
+
+// Dump the stats on SIGUSR1, and every interval_ms if that's non-zero, by
+// adding a signalfd/timerfd to loop.  SIGUSR1 is blocked in the calling
+// thread.
+void stats_watch(struct playback_stats *stats, struct event_loop *loop, unsigned int interval_ms);
+// Undo stats_watch: remove (and so close) its descriptors from loop, and
+// restore the calling thread's signal mask.
+void stats_unwatch(struct playback_stats *stats, struct event_loop *loop);
+// If source is one added by stats_watch, consume its event, dump the stats to
+// stdout and return true.
+bool stats_handle_event(struct playback_stats *stats, struct event_source *source);
+
+#endif
@@ -0,0 +1,71 @@
+#include "trace.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct trace_ring *trace_ring = NULL;
+
+static size_t ring_bytes;
+
+static const char *const stage_names[TRACE_STAGES] = {
+    [TRACE_WAKEUP] = "wakeup",
+    [TRACE_REVENTS] = "revents",
+    [TRACE_AVAIL] = "avail",
+    [TRACE_GENERATE] = "generate",
+    [TRACE_WRITE] = "write",
+    [TRACE_XRUN] = "xrun",
+};
+
+const char *trace_stage_name(unsigned int stage) {
+    return stage < TRACE_STAGES ? stage_names[stage] : "unknown";
+}
+
+void trace_open(const char *path) {
+    ring_bytes = sizeof(struct trace_header) + TRACE_EVENTS * sizeof(struct trace_event);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        err(1, "%s", path);
+    if (ftruncate(fd, ring_bytes) == -1)
+        err(1, "ftruncate %s", path);
+    struct trace_ring *ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        err(1, "mmap %s", path);
+    close(fd);
+
+    // Touch every page now, rather than faulting them in from the audio loop.
+    memset(ring, 0, ring_bytes);
+    memcpy(ring->header.magic, TRACE_MAGIC, sizeof(ring->header.magic));
+    ring->header.capacity = TRACE_EVENTS;
+    ring->header.event_size = sizeof(struct trace_event);
+    ring->header.pid = getpid();
+    atomic_init(&ring->header.head, 0);
+    trace_ring = ring;
+}
+
+void trace_close(void) {
+    if (!trace_ring)
+        return;
+    munmap(trace_ring, ring_bytes);
+    trace_ring = NULL;
+}
+
+void trace_record(enum trace_stage stage, uint64_t start_ns, uint64_t end_ns, uint64_t arg) {
+    static atomic_uint next_thread;
+    static _Thread_local unsigned int thread;
+    if (!thread)
+        thread = atomic_fetch_add_explicit(&next_thread, 1, memory_order_relaxed) + 1;
+
+    uint64_t i = atomic_fetch_add_explicit(&trace_ring->header.head, 1, memory_order_relaxed);
+    struct trace_event *event = &trace_ring->events[i % TRACE_EVENTS];
+    atomic_store_explicit(&event->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    event->start_ns = start_ns;
+    event->arg = arg;
+    event->duration_ns = end_ns - start_ns;
+    event->stage = stage;
+    event->thread = thread;
+    atomic_store_explicit(&event->seq, i + 1, memory_order_release);
+}
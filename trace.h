@@ -0,0 +1,105 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Tracepoints for each stage of the audio loop, written to a fixed size ring
+// in a shared mapping of a file.  Recording one is a clock_gettime (from the
+// vDSO) and a few stores: no syscalls, no locks and no stdio, so it can stay
+// on for a whole run.  The file holds the last TRACE_EVENTS events even if the
+// process is killed, and trace_dump turns it into a Chrome trace (for
+// chrome://tracing or Perfetto) to see which stage ate the period before an
+// underrun.
+//
+// The Rust program writes the same format, see src/trace.rs; the layout here
+// must stay in step with it.
+
+#define TRACE_MAGIC "ALSATRC2"
+#define TRACE_EVENTS 65536
+
+enum trace_stage {
+    // Instant: woken by ALSA or the timer.
+    TRACE_WAKEUP,
+    // snd_pcm_poll_descriptors_revents.
+    TRACE_REVENTS,
+    // Querying ALSA for room (and the delay); arg is the frames available.
+    TRACE_AVAIL,
+    // Generating and converting; arg is the frames generated.
+    TRACE_GENERATE,
+    // writei, writen or an mmap begin/commit loop; arg is the frames written.
+    TRACE_WRITE,
+    // Instant: recovering from an underrun or a suspend.
+    TRACE_XRUN,
+    TRACE_STAGES,
+};
+
+struct trace_event {
+    uint64_t start_ns; // CLOCK_MONOTONIC
+    uint64_t arg;
+    uint32_t duration_ns;
+    uint16_t stage;
+    uint16_t thread;
+    // One more than the index in the header's head the event was recorded
+    // at, so 0 until it's been written.  It's cleared while the slot is being
+    // overwritten, so a reader can tell an event from an earlier time round
+    // the ring, or one that's half written, from the one it's looking for.
+    _Atomic uint64_t seq;
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t event_size;
+    uint32_t pid;
+    uint32_t reserved;
+    // Events ever recorded.  The latest capacity of them are in the ring, the
+    // next going to events[head % capacity].
+    _Atomic uint64_t head;
+};
+
+struct trace_ring {
+    struct trace_header header;
+    struct trace_event events[];
+};
+
+// NULL unless tracing, in which case tracepoints write here.
+extern struct trace_ring *trace_ring;
+
+// Create (or truncate) path as a ring, and start tracing into it.  Exits on
+// error.
+void trace_open(const char *path);
+void trace_close(void);
+
+const char *trace_stage_name(unsigned int stage);
+
+void trace_record(enum trace_stage stage, uint64_t start_ns, uint64_t end_ns, uint64_t arg);
+
+static inline uint64_t trace_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// When a span starts, or 0 when not tracing.
+static inline uint64_t trace_begin(void) {
+    return trace_ring ? trace_clock_ns() : 0;
+}
+
+// End the span started at start (from trace_begin), for arg frames.
+static inline void trace_end(enum trace_stage stage, uint64_t start, uint64_t arg) {
+    if (trace_ring)
+        trace_record(stage, start, trace_clock_ns(), arg);
+}
+
+static inline void trace_instant(enum trace_stage stage) {
+    if (trace_ring) {
+        uint64_t now = trace_clock_ns();
+        trace_record(stage, now, now, 0);
+    }
+}
+
+#endif
@@ -0,0 +1,74 @@
+// Print a ring written with -t as Chrome trace JSON, for chrome://tracing or
+// ui.perfetto.dev.  It can be read while the program is still running: events
+// being written at the same time are left out.
+#include "trace.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s trace > trace.json\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+        err(1, "%s", argv[1]);
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        err(1, "stat %s", argv[1]);
+    if ((size_t)st.st_size < sizeof(struct trace_header))
+        errx(1, "%s: too short to be a trace", argv[1]);
+    const struct trace_ring *ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        err(1, "mmap %s", argv[1]);
+    close(fd);
+
+    const struct trace_header *header = &ring->header;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 || header->event_size != sizeof(struct trace_event)
+            || sizeof(struct trace_header) + (size_t)header->capacity * sizeof(struct trace_event) > (size_t)st.st_size)
+        errx(1, "%s: not a trace", argv[1]);
+
+    uint64_t head = atomic_load(&header->head);
+    uint64_t first = head > header->capacity ? head - header->capacity : 0;
+    printf("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    const char *separator = "";
+    for (uint64_t i = first; i < head; ++i) {
+        const struct trace_event *slot = &ring->events[i % header->capacity];
+        // Claimed but not yet written (this time round the ring), or being
+        // overwritten while it was copied.
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != i + 1)
+            continue;
+        struct trace_event copy = {
+            .start_ns = slot->start_ns,
+            .arg = slot->arg,
+            .duration_ns = slot->duration_ns,
+            .stage = slot->stage,
+            .thread = slot->thread,
+        };
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != i + 1)
+            continue;
+        const struct trace_event *event = &copy;
+
+        bool instant = event->stage == TRACE_WAKEUP || event->stage == TRACE_XRUN;
+        printf("%s{\"name\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, ", separator,
+                trace_stage_name(event->stage), instant ? "i" : "X", event->start_ns / 1e3);
+        if (instant)
+            printf("\"s\": \"%s\", ", event->stage == TRACE_XRUN ? "g" : "t");
+        else
+            printf("\"dur\": %.3f, ", event->duration_ns / 1e3);
+        printf("\"pid\": %" PRIu32 ", \"tid\": %u, \"args\": {\"frames\": %" PRIu64 "}}",
+                header->pid, event->thread, event->arg);
+        separator = ",\n";
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include "wavetable.h"
+#include "oscillator.h"
+
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+#define MASK (WAVETABLE_SIZE - 1)
+
+static const char *const waveform_names[] = { "sine", "saw", "square", "triangle" };
+static const char *const interp_names[] = { "linear", "cubic" };
+
+static int lookup(const char *const *names, size_t count, const char *name) {
+    for (size_t i = 0; i < count; ++i) {
+        if (strcmp(names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int waveform_value(const char *name) {
+    return lookup(waveform_names, sizeof(waveform_names) / sizeof(*waveform_names), name);
+}
+
+int wavetable_interp_value(const char *name) {
+    return lookup(interp_names, sizeof(interp_names) / sizeof(*interp_names), name);
+}
+
+// The amplitude of harmonic k in waveform's Fourier series (of sines, all in
+// phase, so the tables can be summed from sine_fill).
+static float harmonic_amplitude(enum waveform waveform, unsigned int k) {
+    switch (waveform) {
+        case WAVEFORM_SINE:
+            return k == 1 ? 1.0f : 0.0f;
+        case WAVEFORM_SAW:
+            return (k % 2 ? 2.0 : -2.0) / (M_PI * k);
+        case WAVEFORM_SQUARE:
+            return k % 2 ? 4.0 / (M_PI * k) : 0.0f;
+        case WAVEFORM_TRIANGLE:
+            return k % 2 ? (k % 4 == 1 ? 8.0 : -8.0) / (M_PI * M_PI * k * k) : 0.0f;
+    }
+    return 0.0f;
+}
+
+void wavetable_init(struct wavetable *table, enum waveform waveform) {
+    static float harmonic[WAVETABLE_SIZE];
+
+    table->waveform = waveform;
+    for (size_t level = 0; level < WAVETABLE_LEVELS; ++level) {
+        float *samples = aligned_alloc(CACHE_LINE, WAVETABLE_SIZE * sizeof(float));
+        if (!samples)
+            err(1, "aligned_alloc");
+        memset(samples, 0, WAVETABLE_SIZE * sizeof(float));
+
+        unsigned int harmonics = (WAVETABLE_SIZE / 4) >> level;
+        for (unsigned int k = 1; k <= harmonics; ++k) {
+            float amplitude = harmonic_amplitude(waveform, k);
+            if (amplitude == 0.0f)
+                continue;
+            sine_fill(harmonic, WAVETABLE_SIZE, 0.0, (double)k / WAVETABLE_SIZE);
+            for (size_t i = 0; i < WAVETABLE_SIZE; ++i)
+                samples[i] += amplitude * harmonic[i];
+        }
+
+        // Truncating the series overshoots at the edges (the Gibbs
+        // phenomenon), so scale the peak back to full scale.
+        float peak = 0.0f;
+        for (size_t i = 0; i < WAVETABLE_SIZE; ++i)
+            peak = fmaxf(peak, fabsf(samples[i]));
+        for (size_t i = 0; peak > 0.0f && i < WAVETABLE_SIZE; ++i)
+            samples[i] /= peak;
+
+        table->levels[level] = samples;
+    }
+}
+
+void wavetable_free(struct wavetable *table) {
+    for (size_t level = 0; level < WAVETABLE_LEVELS; ++level) {
+        free(table->levels[level]);
+        table->levels[level] = NULL;
+    }
+}
+
+// The level with the most harmonics that all stay below Nyquist.
+static const float *pick_level(const struct wavetable *table, double increment) {
+    double max_harmonic = 0.5 / fabs(increment);
+    size_t level = 0;
+    while (level + 1 < WAVETABLE_LEVELS && ((WAVETABLE_SIZE / 4) >> level) > max_harmonic)
+        ++level;
+    return table->levels[level];
+}
+
+void wavetable_fill(const struct wavetable *table, enum wavetable_interp interp, float *buffer, size_t buffer_size, double phase, double increment) {
+    const float *samples = pick_level(table, increment);
+    double position = (phase - floor(phase)) * WAVETABLE_SIZE;
+    double step = (increment - floor(increment)) * WAVETABLE_SIZE;
+
+    for (size_t idx = 0; idx < buffer_size; ++idx) {
+        uint32_t i = (uint32_t)position;
+        float frac = position - i;
+
+        if (interp == WAVETABLE_CUBIC) {
+            // Catmull-Rom through the two samples either side.
+            float y0 = samples[(i - 1) & MASK];
+            float y1 = samples[i & MASK];
+            float y2 = samples[(i + 1) & MASK];
+            float y3 = samples[(i + 2) & MASK];
+            float a = 0.5f * (y3 - y0) + 1.5f * (y1 - y2);
+            float b = y0 - 2.5f * y1 + 2.0f * y2 - 0.5f * y3;
+            float c = 0.5f * (y2 - y0);
+            buffer[idx] = ((a * frac + b) * frac + c) * frac + y1;
+        } else {
+            float y1 = samples[i & MASK];
+            float y2 = samples[(i + 1) & MASK];
+            buffer[idx] = y1 + frac * (y2 - y1);
+        }
+
+        position += step;
+        if (position >= WAVETABLE_SIZE)
+            position -= WAVETABLE_SIZE;
+    }
+}
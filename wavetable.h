@@ -0,0 +1,46 @@
+#ifndef WAVETABLE_H
+#define WAVETABLE_H
+
+#include <stddef.h>
+
+// Wavetable oscillators, for waveforms other than sine.  Each waveform is
+// built additively into a set of tables, one per octave, each holding only the
+// harmonics that stay below Nyquist for the frequencies it's used at, so
+// nothing aliases.  Playing is then one table lookup per sample.
+
+// Samples per cycle, a power of two so the index can wrap with a mask.
+#define WAVETABLE_SIZE 2048
+// Level i holds harmonics up to WAVETABLE_SIZE / 4 >> i, the last a pure sine.
+#define WAVETABLE_LEVELS 10
+
+enum waveform {
+    WAVEFORM_SINE,
+    WAVEFORM_SAW,
+    WAVEFORM_SQUARE,
+    WAVEFORM_TRIANGLE,
+};
+
+enum wavetable_interp {
+    WAVETABLE_LINEAR,
+    WAVETABLE_CUBIC,
+};
+
+struct wavetable {
+    enum waveform waveform;
+    // Each WAVETABLE_SIZE samples, aligned to a cache line.
+    float *levels[WAVETABLE_LEVELS];
+};
+
+// Returns -1 for an unknown name.
+int waveform_value(const char *name);
+int wavetable_interp_value(const char *name);
+
+// Build the tables for waveform, exiting on allocation failure.
+void wavetable_init(struct wavetable *table, enum waveform waveform);
+void wavetable_free(struct wavetable *table);
+
+// Like sine_fill, but for table's waveform: fill buffer with buffer_size
+// samples starting at phase, increment cycles apart.
+void wavetable_fill(const struct wavetable *table, enum wavetable_interp interp, float *buffer, size_t buffer_size, double phase, double increment);
+
+#endif